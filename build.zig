@@ -1,5 +1,13 @@
 const std = @import("std");
 
+// C flags of src/tracy.c, shared by all builds. -fno-math-errno and -fopenmp-simd let the compiler
+// vectorize the intersection kernels, TRACY_OPENMP_SIMD tells the code that the simd pragmas are
+// understood (-fopenmp-simd defines no macro of its own).
+const c_flags = [_][]const u8{ "-std=c11", "-fno-math-errno", "-fopenmp-simd", "-DTRACY_OPENMP_SIMD" };
+const wasm_c_flags = c_flags ++ [_][]const u8{"-D__EMSCRIPTEN__"};
+const openmp_flags = [_][]const u8{ "-fopenmp", "-D_OPENMP" };
+const russian_roulette_flags = [_][]const u8{"-DENABLE_RUSSIAN_ROULETTE"};
+
 pub fn build(b: *std.Build) void {
     const native_target = b.standardTargetOptions(.{});
     const optimize = b.standardOptimizeOption(.{});
@@ -10,10 +18,11 @@ pub fn build(b: *std.Build) void {
 
     // --- OPTIONS ---
     const use_openmp = b.option(bool, "multithreaded", "Enable OpenMP support") orelse false;
+    const use_thread_pool = b.option(bool, "threadpool", "Enable the built-in pthread thread pool (no libomp needed)") orelse false;
     const use_russian_roulette = b.option(bool, "russianroulette", "Enable Russian Roulette termination strategy") orelse false;
 
-    const tracy_flags = if (use_russian_roulette) &[_][]const u8{ "-std=c11", "-DENABLE_RUSSIAN_ROULETTE" } else &[_][]const u8{"-std=c11"};
-    const wasm_flags = if (use_russian_roulette) &[_][]const u8{ "-std=c11", "-D__EMSCRIPTEN__", "-DENABLE_RUSSIAN_ROULETTE" } else &[_][]const u8{ "-std=c11", "-D__EMSCRIPTEN__" };
+    const tracy_flags: []const []const u8 = if (use_russian_roulette) &(c_flags ++ russian_roulette_flags) else &c_flags;
+    const wasm_flags: []const []const u8 = if (use_russian_roulette) &(wasm_c_flags ++ russian_roulette_flags) else &wasm_c_flags;
 
     // PCG Configuration
     const pcg_include = b.path("dependencies/pcg-c/include");
@@ -48,6 +57,7 @@ pub fn build(b: *std.Build) void {
     });
     tracy_mod.addCSourceFile(.{ .file = b.path("src/tracy.c"), .flags = tracy_flags });
     tracy_mod.addIncludePath(b.path("include"));
+    if (use_thread_pool) tracy_mod.addCMacro("TRACY_THREAD_POOL", "1");
     tracy_mod.addIncludePath(pcg_include);
     for (pcg_sources) |src| tracy_mod.addCSourceFile(.{ .file = b.path(src) });
     const lib = b.addLibrary(.{
@@ -59,15 +69,22 @@ pub fn build(b: *std.Build) void {
     b.installArtifact(lib);
 
     // --- HELPER FOR OPENMP ---
+    // Adds the given C source (src/tracy.c, or a file that includes it) with the matching flags.
+    // The thread pool backend only needs pthreads and can be combined with OpenMP.
     const configure_openmp = struct {
-        fn apply(step: *std.Build.Step.Compile, enabled: bool, russian_roulette_enabled: bool, b_ptr: *std.Build) void {
-            const flags = if (enabled)
-                if (russian_roulette_enabled) &[_][]const u8{ "-std=c11", "-fopenmp", "-D_OPENMP", "-DENABLE_RUSSIAN_ROULETTE" } else &[_][]const u8{ "-std=c11", "-fopenmp", "-D_OPENMP" }
-            else if (russian_roulette_enabled) &[_][]const u8{ "-std=c11", "-DENABLE_RUSSIAN_ROULETTE" } else &[_][]const u8{"-std=c11"};
+        fn apply(step: *std.Build.Step.Compile, source: []const u8, enabled: bool, russian_roulette_enabled: bool, thread_pool_enabled: bool, b_ptr: *std.Build) void {
+            if (thread_pool_enabled) {
+                step.root_module.addCMacro("TRACY_THREAD_POOL", "1");
+                step.linkSystemLibrary("pthread");
+            }
+
+            const flags: []const []const u8 = if (enabled)
+                if (russian_roulette_enabled) &(c_flags ++ openmp_flags ++ russian_roulette_flags) else &(c_flags ++ openmp_flags)
+            else if (russian_roulette_enabled) &(c_flags ++ russian_roulette_flags) else &c_flags;
 
             if (enabled) {
                 step.root_module.addCSourceFile(.{
-                    .file = step.root_module.owner.path("src/tracy.c"),
+                    .file = step.root_module.owner.path(source),
                     .flags = flags,
                 });
 
@@ -78,7 +95,7 @@ pub fn build(b: *std.Build) void {
                 step.linkSystemLibrary("m");
             } else {
                 step.root_module.addCSourceFile(.{
-                    .file = step.root_module.owner.path("src/tracy.c"),
+                    .file = step.root_module.owner.path(source),
                     .flags = flags,
                 });
             }
@@ -105,7 +122,7 @@ pub fn build(b: *std.Build) void {
     c_exe.want_lto = use_lto;
     c_exe.root_module.addCSourceFile(.{ .file = b.path("examples/c_render/main.c") });
 
-    configure_openmp.apply(c_exe, use_openmp, use_russian_roulette, b);
+    configure_openmp.apply(c_exe, "src/tracy.c", use_openmp, use_russian_roulette, use_thread_pool, b);
 
     c_exe.root_module.addIncludePath(b.path("include"));
     c_exe.root_module.addIncludePath(pcg_include);
@@ -127,7 +144,7 @@ pub fn build(b: *std.Build) void {
     });
     zig_exe.want_lto = use_lto;
 
-    configure_openmp.apply(zig_exe, use_openmp, use_russian_roulette, b);
+    configure_openmp.apply(zig_exe, "src/tracy.c", use_openmp, use_russian_roulette, use_thread_pool, b);
 
     zig_exe.root_module.addIncludePath(b.path("include"));
     zig_exe.root_module.addIncludePath(pcg_include);
@@ -158,6 +175,8 @@ pub fn build(b: *std.Build) void {
         const wasm_target = b.resolveTargetQuery(.{
             .cpu_arch = .wasm32,
             .os_tag = .emscripten,
+            // lets the wide BVH child tests vectorize
+            .cpu_features_add = std.Target.wasm.featureSet(&.{.simd128}),
         });
         const wasm_mod = b.createModule(.{
             .link_libc = true,
@@ -259,7 +278,7 @@ pub fn build(b: *std.Build) void {
     // so that the program knows about the multithreaded flag
     render_bench_exe.want_lto = use_lto;
 
-    configure_openmp.apply(render_bench_exe, use_openmp, use_russian_roulette, b);
+    configure_openmp.apply(render_bench_exe, "src/tracy.c", use_openmp, use_russian_roulette, use_thread_pool, b);
 
     render_bench_exe.root_module.addIncludePath(b.path("include"));
     render_bench_exe.root_module.addIncludePath(pcg_include);
@@ -278,6 +297,66 @@ pub fn build(b: *std.Build) void {
     const build_bench_step = b.step("bench-build", "Only build the benchmark binary");
     build_bench_step.dependOn(&install_bench.step);
 
+    // BVH BENCHMARK
+    // White-box benchmark: tests/bvh_benchmark.c includes src/tracy.c itself
+    const bvh_bench_exe = b.addExecutable(.{
+        .name = "bvh-bench",
+        .root_module = b.createModule(.{
+            .target = native_target,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    bvh_bench_exe.want_lto = use_lto;
+    configure_openmp.apply(bvh_bench_exe, "tests/bvh_benchmark.c", use_openmp, use_russian_roulette, use_thread_pool, b);
+    bvh_bench_exe.root_module.addIncludePath(b.path("include"));
+    bvh_bench_exe.root_module.addIncludePath(pcg_include);
+    for (pcg_sources) |src| bvh_bench_exe.root_module.addCSourceFile(.{ .file = b.path(src) });
+    bvh_bench_exe.linkSystemLibrary("m");
+    const run_bvh_bench = b.addRunArtifact(bvh_bench_exe);
+    if (b.args) |args| run_bvh_bench.addArgs(args);
+    b.step("bench-bvh", "Run the BVH build and traversal benchmark").dependOn(&run_bvh_bench.step);
+
+    // REFINE BENCHMARK
+    // Thread scaling of render_refine, also includes src/tracy.c itself
+    const refine_bench_exe = b.addExecutable(.{
+        .name = "refine-bench",
+        .root_module = b.createModule(.{
+            .target = native_target,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    refine_bench_exe.want_lto = use_lto;
+    configure_openmp.apply(refine_bench_exe, "tests/refine_benchmark.c", use_openmp, use_russian_roulette, use_thread_pool, b);
+    refine_bench_exe.root_module.addIncludePath(b.path("include"));
+    refine_bench_exe.root_module.addIncludePath(pcg_include);
+    for (pcg_sources) |src| refine_bench_exe.root_module.addCSourceFile(.{ .file = b.path(src) });
+    refine_bench_exe.linkSystemLibrary("m");
+    const run_refine_bench = b.addRunArtifact(refine_bench_exe);
+    if (b.args) |args| run_refine_bench.addArgs(args);
+    b.step("bench-refine", "Run the render_refine thread scaling benchmark").dependOn(&run_refine_bench.step);
+
+    // SAMPLER BENCHMARK
+    // Visible error of the samplers at a few samples per pixel, also includes src/tracy.c itself
+    const sampler_bench_exe = b.addExecutable(.{
+        .name = "sampler-bench",
+        .root_module = b.createModule(.{
+            .target = native_target,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    sampler_bench_exe.want_lto = use_lto;
+    configure_openmp.apply(sampler_bench_exe, "tests/sampler_benchmark.c", use_openmp, use_russian_roulette, use_thread_pool, b);
+    sampler_bench_exe.root_module.addIncludePath(b.path("include"));
+    sampler_bench_exe.root_module.addIncludePath(pcg_include);
+    for (pcg_sources) |src| sampler_bench_exe.root_module.addCSourceFile(.{ .file = b.path(src) });
+    sampler_bench_exe.linkSystemLibrary("m");
+    const run_sampler_bench = b.addRunArtifact(sampler_bench_exe);
+    if (b.args) |args| run_sampler_bench.addArgs(args);
+    b.step("bench-sampler", "Run the sampler noise benchmark at 1, 2 and 4 samples per pixel").dependOn(&run_sampler_bench.step);
+
     // --- UNIT TESTS ---
     const test_mod = b.createModule(.{
         .root_source_file = b.path("tests/unit_tests.zig"),
@@ -293,5 +372,26 @@ pub fn build(b: *std.Build) void {
     tests.linkSystemLibrary("m");
     const run_tests = b.addRunArtifact(tests);
     run_tests.has_side_effects = true;
-    b.step("test", "Run all tests").dependOn(&run_tests.step);
+
+    // Renders the scenes with different thread counts, so it uses the selected thread backends
+    const determinism_test_exe = b.addExecutable(.{
+        .name = "determinism-test",
+        .root_module = b.createModule(.{
+            .target = native_target,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    determinism_test_exe.root_module.addCSourceFile(.{ .file = b.path("tests/determinism_test.c") });
+    configure_openmp.apply(determinism_test_exe, "src/tracy.c", use_openmp, use_russian_roulette, use_thread_pool, b);
+    determinism_test_exe.root_module.addIncludePath(b.path("include"));
+    determinism_test_exe.root_module.addIncludePath(pcg_include);
+    for (pcg_sources) |src| determinism_test_exe.root_module.addCSourceFile(.{ .file = b.path(src) });
+    determinism_test_exe.linkSystemLibrary("m");
+    const run_determinism_test = b.addRunArtifact(determinism_test_exe);
+    run_determinism_test.has_side_effects = true;
+
+    const test_step = b.step("test", "Run all tests");
+    test_step.dependOn(&run_tests.step);
+    test_step.dependOn(&run_determinism_test.step);
 }
@@ -20,8 +20,10 @@ const emflags = [
 	'-sASSERTIONS=1',
 	'-sALLOW_MEMORY_GROWTH=1', // the maximum is defined in javascript (WebAssembly.Memory)
 	'-sSHARED_MEMORY=1', '-sIMPORTED_MEMORY=1', // required so shared memory can be used
-	'-sPTHREAD_POOL_SIZE=navigator.hardwareConcurrency', // required for SimpleOMP
+	// SimpleOMP and the thread pool each need a worker per core, they must exist before they are used
+	'-sPTHREAD_POOL_SIZE=2*navigator.hardwareConcurrency',
 	'-fopenmp', '-pthread',
+	'-DTRACY_THREAD_POOL', // render_refine runs on its own pthread workers, SimpleOMP builds the BVHs
 	'--emit-tsd', 'tracy_c.d.ts',
 	'-Wall', // enable warnings
 ];
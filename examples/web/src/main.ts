@@ -7,6 +7,8 @@ const sceneCameras: Tracy.CameraProperties[] =[
 	{ rotation: { x: 0, y: 0 }, distance: 2.5, focusPoint: { x: 0, y: 0.4, z: 0 } },
 	{ rotation: { x: 0.2, y: 0 }, distance: 6, focusPoint: { x: 0, y: 1.25, z: 0 } },
 	{ rotation: { x: 0.2, y: 0.2 }, distance: 12, focusPoint: { x: 0, y: 1.3, z: 0 } },
+	{ rotation: { x: 0.35, y: 0.3 }, distance: 14, focusPoint: { x: 0, y: 0.3, z: 0 } },
+	{ rotation: { x: 0.15, y: 0 }, distance: 9, focusPoint: { x: 0, y: 1, z: 0 } },
 ];
 
 const canvas = document.querySelector("canvas") as HTMLCanvasElement;
@@ -157,7 +159,7 @@ function renderLoop() {
 			settleTimer = null;
 		}
 
-		// Only terminate the worker if we are interrupting a heavy final render
+		// Only cancel the worker's render if we are interrupting a heavy final render
 		if (renderMode === 'final') {
 			tracy.cancel();
 			renderMode = 'none';
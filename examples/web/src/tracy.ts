@@ -15,6 +15,9 @@ export interface RenderSettings {
 	samplesPerPixel: number,
 }
 
+// Messages from the main thread to the worker
+export type WorkerMessage = { type: 'render', settings: RenderSettings } | { type: 'cancel' };
+
 export interface RenderStatus {
 	finished: boolean,
 	samplesCompleted: number,
@@ -45,7 +48,6 @@ export function create(context: CanvasRenderingContext2D): TracyModule {
 		cancel: cancel
 	};
 
-	// Encapsulate worker initialization so we can respawn it
 	function initWorker() {
 		// Create the worker. The new URL(...) syntax is the modern standard for module-based workers.
 		// This requires a bundler (like Vite, Webpack, Parcel) to work correctly.
@@ -75,8 +77,9 @@ export function create(context: CanvasRenderingContext2D): TracyModule {
 
 	function cancel() {
 		if (resolveCurrentRender) {
-			worker.terminate(); // Force-kill the blocked thread
-			initWorker();       // Instantly respawn a fresh worker & WASM environment
+			// The worker stops the render after the current tile, the WASM module stays
+			const message: WorkerMessage = { type: 'cancel' };
+			worker.postMessage(message);
 
 			resolveCurrentRender(); // Resolve the pending promise so the app doesn't hang
 			resolveCurrentRender = null;
@@ -91,7 +94,8 @@ export function create(context: CanvasRenderingContext2D): TracyModule {
 			resolveCurrentRender = resolve;
 		});
 
-		worker.postMessage(s);
+		const message: WorkerMessage = { type: 'render', settings: s };
+		worker.postMessage(message);
 		return renderPromise;
 	}
 
@@ -1,7 +1,7 @@
 /// <reference lib="webworker" />
 // tell TypeScript this file is in a worker context -> avoids compile error
 
-import { RenderSettings, RenderStatus } from './tracy';
+import { RenderStatus, WorkerMessage } from './tracy';
 import ModuleFactory, { MainModule } from './tracy_c';
 
 // We create a shared memory that we use to initialize our wasm module with
@@ -10,13 +10,25 @@ const sharedMemory = new WebAssembly.Memory({ initial: 256, maximum: 8192, share
 // This promise ensures the Wasm module is initialized only once.
 const modulePromise: Promise<MainModule> = ModuleFactory({ wasmMemory: sharedMemory });
 
+// Counts the messages, a render stops as soon as a newer message arrives
+let generation = 0;
+
 // Listen for messages from the main thread
 self.onmessage = async (event) => {
-	const s = event.data as RenderSettings;
+	const message = event.data as WorkerMessage;
+	const messageGeneration = ++generation;
 
 	// Await initialization of WebAssembly Module
 	const Module = await modulePromise;
 
+	// Stop the running render after its current tile
+	Module._render_cancel_refine();
+	if (message.type === 'cancel') return;
+	const s = message.settings;
+
+	// float accumulation halves the memory of large images, WASM memory is limited
+	Module._render_set_accumulator(1);
+	// waits until the cancelled refine stopped
 	Module._render_init(
 		s.scene, s.maxDepth, s.width, s.height, s.filterType,
 		s.camera.rotation.x, s.camera.rotation.y, s.camera.distance,
@@ -36,7 +48,13 @@ self.onmessage = async (event) => {
 	while (samplesRemaining > 0) {
 		// either a full run, or whatever is left
 		const samplesForThisRun = Math.min(samplesRemaining, samplesPerRun);
-		Module._render_refine(samplesForThisRun);
+		// The refine runs on a background thread, so the worker can receive a cancel meanwhile
+		Module._render_refine_async(samplesForThisRun);
+		while (Module._render_is_refining() && generation === messageGeneration) {
+			await new Promise((resolve) => setTimeout(resolve, 1));
+		}
+		if (generation !== messageGeneration) return;
+		Module._render_wait_refine();
 		const bufferPtr = Module._update_image_ldr();
 		samplesRemaining -= samplesForThisRun;
 
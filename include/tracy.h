@@ -8,24 +8,316 @@ extern "C" {
 #include <stdbool.h>
 #include <stdint.h>
 
+/**
+ * The functions starting with `render_` and `update_image_` work on one default context that is
+ * created on first use. The `tracy_` functions take the context explicitly, so several renders
+ * can be set up and refined independently, also concurrently from different threads.
+ * The thread settings (`render_set_thread_*`, `render_set_numa_node`) are shared by all contexts,
+ * which run their parallel sections on one thread pool. They must not be changed while a context
+ * is refined.
+ */
+typedef struct TracyContext TracyContext;
+
+/**
+ * Called by `render_refine` after every finished work item (a tile and a batch of samples), from
+ * the rendering threads, possibly concurrently. May call `render_cancel_refine`.
+ * @param completed Work items finished so far in this refine.
+ * @param total Work items of this refine.
+ */
+typedef void (*TracyProgressCallback)(int completed, int total, void* user_data);
+
+/**
+ * Creates a context with the default settings. Call `tracy_render_init` before rendering.
+ * @return The context, free it with `tracy_destroy`.
+ */
+TracyContext* tracy_create();
+
+/**
+ * Frees a context with all its buffers and its copy of the scene.
+ */
+void tracy_destroy(TracyContext* ctx);
+
 /**
  * Initializes or reconfigures the renderer with new render settings.
  * Must be called at least once before any rendering. Calling it again will reset the render
- * progress with the new settings.
+ * progress with the new settings. The BVHs of the scene's meshes are only rebuilt if the scene or
+ * the BVH builder changed, otherwise only the top level BVH over the instances is rebuilt.
  */
 void render_init(int scene_id, int max_depth, int width, int height, int filter_type,
 				 double cam_angle_x, double cam_angle_y, double cam_dist, double focus_x,
 				 double focus_y, double focus_z);
 
+/**
+ * Selects the algorithm used to build the scene's bounding volume hierarchy. Takes effect on the
+ * next call to `render_init`.
+ * @param builder 0: binned SAH (default, fastest tracing), 1: LBVH (fastest build), 2: LBVH refined
+ * with treelet restructuring (fast build, close to SAH quality). Other values are ignored. LBVH
+ * trees that are too deep to traverse are rebuilt with SAH.
+ */
+void render_set_bvh_builder(int builder);
+
+/**
+ * Selects the precision of the buffers that accumulate the samples of every pixel. The float
+ * accumulators keep the radiance and the weight of a pixel interleaved in 16 bytes instead of 32,
+ * which halves the memory of large images. Every work item of `render_refine` adds its samples in
+ * double precision, so only one rounding per work item reaches the float sums. The compensated
+ * variant also tracks these rounding errors (Neumaier summation) and is as accurate as double
+ * precision with the same 32 bytes per pixel, but next to each other instead of in two buffers.
+ * Takes effect on the next call to `render_init`.
+ * @param accumulator 0: double (default), 1: float, 2: float with compensated summation. Other
+ * values are ignored.
+ */
+void render_set_accumulator(int accumulator);
+
+/**
+ * Selects how the bounding volume hierarchy is traversed. The wide BVH (4 or 8 children per node,
+ * depending on the available SIMD width) tests all children of a node at once.
+ * @param enabled true: wide BVH (default), false: binary BVH. Takes effect immediately.
+ */
+void render_set_wide_bvh(bool enabled);
+
+/**
+ * Selects whether diffuse surfaces sample the emissive triangles of the scene directly
+ * (next-event estimation with a shadow ray). Such light samples are combined with the light found
+ * by the bounced rays by multiple importance sampling, which removes most of the noise of small
+ * lights. A light is picked in proportion to its power, and in scenes with many lights by a
+ * light BVH that also weighs how close and how well oriented each light is to the shaded point.
+ * Emissive spheres and instanced meshes are only found by bounced rays. Takes effect immediately.
+ * @param enabled true: light sampling (default), false: only bounced rays.
+ */
+void render_set_light_sampling(bool enabled);
+
+/**
+ * Selects the random numbers of the samples. The Sobol sampler gives every pixel its own
+ * Owen-scrambled Sobol sequence, continued at the number of samples the pixel already has, so that
+ * the film positions, light points and directions of the samples of a pixel cover their ranges
+ * evenly instead of clumping like independent random numbers. The image converges faster, mostly
+ * at low sample counts and on soft shadows and smooth lighting. The blue noise sampler shares one
+ * such sequence between all pixels and shifts it per pixel by a tiled blue noise mask, so that the
+ * errors of neighboring pixels differ as much as possible. Its noise is finer grained at 1 to 4
+ * samples per pixel, e.g. for interactive previews, mostly where direct light dominates.
+ * Takes effect on the next call to `render_init`, the first one with blue noise generates the mask.
+ * @param sampler 0: independent random numbers (PCG), 1: Owen-scrambled Sobol (default), 2: blue
+ * noise. Other values are ignored.
+ */
+void render_set_sampler(int sampler);
+
+/**
+ * Selects whether `render_refine` distributes the samples by the estimated error of the pixels
+ * instead of giving every pixel the same number. Every pixel then also tracks the variance of the
+ * luminance of its samples. Once all pixels of a tile have at least 16 samples, the tile gets
+ * samples in proportion to the mean relative error of its pixels (up to 8 times `n_samples`), so
+ * that noisy regions like caustics get more than flat ones. The total stays about `n_samples`
+ * times the number of pixels that did not converge, see `render_set_convergence_threshold`. Takes
+ * effect on the next call to `render_init`.
+ * @param enabled true: adaptive sampling, false: the same samples for every pixel (default).
+ */
+void render_set_adaptive_sampling(bool enabled);
+
+/**
+ * Sets the relative error below which pixels stop getting samples with adaptive sampling: the
+ * standard error of the mean luminance of the pixel, relative to that luminance. The refine
+ * functions then only render the other pixels, and `render_refine_for` returns early once all
+ * pixels converged. Takes effect on the next refine.
+ * @param threshold Relative error, e.g. 0.01 for 1%, 0: never stop pixels (default).
+ */
+void render_set_convergence_threshold(float threshold);
+
+/**
+ * Sets how many samples per pixel `render_refine` renders in one work item (a tile of the image).
+ * Larger values reduce the scheduling overhead, smaller values balance the load better when there
+ * are few tiles per thread. Takes effect immediately.
+ * @param samples Samples per work item, 0: automatic (default), based on the image size, the number
+ * of samples and the number of threads.
+ */
+void render_set_refine_grain(int samples);
+
+/**
+ * Makes the result of `render_refine` independent of the thread count and the thread backend:
+ * every pixel is then bitwise identical for the same settings, scene and sequence of refine calls.
+ * The tiles and their ghost borders are always merged in a fixed order, but the automatic grain
+ * (see `render_set_refine_grain`) adapts to the thread count and changes the rounding. The
+ * deterministic mode chooses it as if there were always 64 threads. `render_refine_for` stays
+ * time dependent. Takes effect immediately.
+ * @param enabled true: deterministic, false: automatic grain per thread count (default).
+ */
+void render_set_deterministic(bool enabled);
+
+/**
+ * Sets the width and height in pixels of the tiles that `render_refine` distributes to the threads.
+ * The result does not depend on how the tiles are distributed. Takes effect immediately.
+ * @param size Tile size, default 32, at least 4.
+ */
+void render_set_tile_size(int size);
+
+/**
+ * Selects how `render_refine` distributes the tiles to threads. Takes effect immediately.
+ * @param backend 0: single threaded, 1: OpenMP (`-Dmultithreaded=true`), 2: built-in thread pool
+ * with one persistent worker per additional processor (`-Dthreadpool=true`). The default is the
+ * thread pool if available, otherwise OpenMP if available, otherwise single threaded.
+ * @return false if the backend is not compiled in, the selection is then unchanged.
+ */
+bool render_set_thread_backend(int backend);
+
+/**
+ * Sets how many threads `render_refine` runs on, instead of `OMP_NUM_THREADS` or the number of
+ * processors. The thread calling `render_refine` is one of them. Takes effect immediately.
+ * @param threads Thread count, 0: automatic (default), one per pinned core if the workers are
+ * pinned, otherwise the OpenMP default or one per processor. At most 1024, larger counts are
+ * clamped.
+ */
+void render_set_thread_count(int threads);
+
+/**
+ * @return The number of threads `render_refine` runs on with the current settings. Does not start
+ * the thread pool; before the first render, the pool may end up with fewer threads if the system
+ * refuses to start some of them.
+ */
+int render_get_thread_count();
+
+/**
+ * Pins the workers of the thread pool backend to the given cores, in turn. The thread calling
+ * `render_refine` is not pinned. For OpenMP, use `OMP_PLACES` and `OMP_PROC_BIND` instead.
+ * Takes effect immediately.
+ * @param cores Core indices as used by the operating system, NULL: don't pin (default).
+ * @param core_count Number of cores. If the thread count is automatic, one thread is started per
+ * core.
+ * @return false if pinning is not supported (no thread pool, or not Linux) or a core index is
+ * negative or not below `CPU_SETSIZE`; the previous setting is kept then.
+ */
+bool render_set_thread_affinity(const int* cores, int core_count);
+
+/**
+ * Pins the workers of the thread pool backend to the cores of a NUMA node, like
+ * `render_set_thread_affinity`. Only the tile scratch buffers of the workers are then allocated on
+ * that node. The image buffers and the ghost borders of the tiles stay on the node of the thread
+ * that allocated them (`render_init`, `render_refine`).
+ * @param node NUMA node index, -1: don't pin.
+ * @return false if the node does not exist or pinning is not supported.
+ */
+bool render_set_numa_node(int node);
+
+/**
+ * @return The number of mesh instances in the current scene (0 for scenes without instancing).
+ */
+int render_get_instance_count();
+
+/**
+ * Moves an instance of the current scene. Takes effect on the next call to `render_update_scene` or
+ * `render_init` with the same scene, which then only rebuild the top level BVH. Switching the scene
+ * resets all instances.
+ * @param instance Index of the instance, see `render_get_instance_count`.
+ * @param transform Object to world transform as row major 3x4 matrix (12 floats). Must be
+ * invertible and must not mirror.
+ */
+void render_set_instance_transform(int instance, const float* transform);
+
+/**
+ * @return The number of primitives of the current scene, not counting the primitives of instances.
+ */
+int render_get_primitive_count();
+
+/**
+ * Moves a sphere of the current scene. Takes effect on the next call to `render_update_scene`.
+ * Switching the scene resets all primitives.
+ * @param primitive Index of the primitive, see `render_get_primitive_count`.
+ * @return false if the primitive does not exist or is not a sphere.
+ */
+bool render_set_sphere(int primitive, float x, float y, float z, float radius);
+
+/**
+ * Moves a triangle of the current scene. Takes effect on the next call to `render_update_scene`.
+ * Switching the scene resets all primitives.
+ * @param primitive Index of the primitive, see `render_get_primitive_count`.
+ * @param vertices The three vertices as 9 floats (x, y, z each), in counter-clockwise order.
+ * @return false if the primitive does not exist or is not a triangle.
+ */
+bool render_set_triangle(int primitive, const float* vertices);
+
+/**
+ * Applies moved primitives and instances without a full `render_init`: the BVH is refitted to the
+ * new positions (and only rebuilt if refitting degraded it too much), and the render progress is
+ * reset while keeping all buffers.
+ */
+void render_update_scene();
+
 /**
  * Progressively refines the image by adding more samples.
  * Call this repeatedly to reduce noise and improve image quality.
  * To get the result call `refresh_image_ldr` or `refresh_image_hdr`.
  * This function does not update the image buffers retrieved by those functions.
- * @param n_samples The number of samples to add per pixel in this step.
+ * @param n_samples The number of samples to add per pixel in this step, on average over the pixels
+ * that did not converge with adaptive sampling (see `render_set_adaptive_sampling`).
  */
 void render_refine(unsigned int n_samples);
 
+/**
+ * Refines the image for the given time instead of a number of samples. Renders passes over the
+ * whole image until the time is up and stops the last pass before the next tile that would start
+ * too late, so the pixels can have different sample counts, see `render_get_sample_counts`.
+ * @param budget_ms Time budget in milliseconds.
+ * @return The samples per pixel added by this call, averaged over all pixels.
+ */
+float render_refine_for(double budget_ms);
+
+/**
+ * @return The number of samples of every pixel since the last `render_init` or
+ * `render_update_scene`, row by row.
+ */
+const int* render_get_sample_counts();
+
+/**
+ * Estimates how far the image is from converged, e.g. to stop a render at a quality target. Needs
+ * adaptive sampling, see `render_set_adaptive_sampling`.
+ * @return The relative error of the pixels (see `render_set_convergence_threshold`), averaged over
+ * all pixels. INFINITY while a pixel has fewer than 16 samples or without adaptive sampling.
+ */
+float render_get_estimated_error();
+
+/**
+ * @return The fraction (0 to 1) of the pixels whose relative error is below the convergence
+ * threshold, so that they get no more samples. 1 once the render is finished. 0 without adaptive
+ * sampling or without a threshold.
+ */
+float render_get_converged_fraction();
+
+/**
+ * Like `render_refine`, but runs in the background and returns immediately. Until it finished,
+ * only the progress, cancel and wait functions may be used, `render_init`, `render_update_scene`,
+ * and the refine functions wait for it. Without the thread pool (`-Dthreadpool=true`) the refine
+ * is finished when this returns.
+ */
+void render_refine_async(unsigned int n_samples);
+
+/**
+ * Waits until the background refine started by `render_refine_async` finished or was cancelled.
+ */
+void render_wait_refine();
+
+/**
+ * @return true while the background refine started by `render_refine_async` runs.
+ */
+bool render_is_refining();
+
+/**
+ * Stops the running refine before its next work item, so it ends within the time of one tile. The
+ * finished work items stay in the image, the cancelled ones are missing from it. Can be called
+ * from any thread.
+ */
+void render_cancel_refine();
+
+/**
+ * @return The finished fraction (0 to 1) of the current or last refine. Below 1 after a cancel.
+ */
+float render_get_refine_progress();
+
+/**
+ * Sets a function that is called during `render_refine` after every finished work item.
+ * @param callback The function, NULL: none (default).
+ * @param user_data Passed to the callback.
+ */
+void render_set_progress_callback(TracyProgressCallback callback, void* user_data);
+
 /**
  * Processes the current rendered state into 8-bit LDR (RGBA).
  * Call this each time after `render_refine` to get the current image data.
@@ -40,6 +332,41 @@ uint8_t* update_image_ldr();
  */
 float* update_image_hdr();
 
+// The functions of the default context on a given context, see above for the documentation.
+void tracy_render_init(TracyContext* ctx, int scene_id, int max_depth, int width, int height,
+					   int filter_type, double cam_angle_x, double cam_angle_y, double cam_dist,
+					   double focus_x, double focus_y, double focus_z);
+void tracy_set_bvh_builder(TracyContext* ctx, int builder);
+void tracy_set_accumulator(TracyContext* ctx, int accumulator);
+void tracy_set_wide_bvh(TracyContext* ctx, bool enabled);
+void tracy_set_light_sampling(TracyContext* ctx, bool enabled);
+void tracy_set_sampler(TracyContext* ctx, int sampler);
+void tracy_set_adaptive_sampling(TracyContext* ctx, bool enabled);
+void tracy_set_convergence_threshold(TracyContext* ctx, float threshold);
+void tracy_set_refine_grain(TracyContext* ctx, int samples);
+void tracy_set_tile_size(TracyContext* ctx, int size);
+void tracy_set_deterministic(TracyContext* ctx, bool enabled);
+int tracy_get_instance_count(const TracyContext* ctx);
+void tracy_set_instance_transform(TracyContext* ctx, int instance, const float* transform);
+int tracy_get_primitive_count(const TracyContext* ctx);
+bool tracy_set_sphere(TracyContext* ctx, int primitive, float x, float y, float z, float radius);
+bool tracy_set_triangle(TracyContext* ctx, int primitive, const float* vertices);
+void tracy_update_scene(TracyContext* ctx);
+void tracy_render_refine(TracyContext* ctx, unsigned int n_samples);
+float tracy_render_refine_for(TracyContext* ctx, double budget_ms);
+const int* tracy_get_sample_counts(const TracyContext* ctx);
+float tracy_get_estimated_error(const TracyContext* ctx);
+float tracy_get_converged_fraction(const TracyContext* ctx);
+void tracy_render_refine_async(TracyContext* ctx, unsigned int n_samples);
+void tracy_wait_refine(TracyContext* ctx);
+bool tracy_is_refining(const TracyContext* ctx);
+void tracy_cancel_refine(TracyContext* ctx);
+float tracy_get_refine_progress(const TracyContext* ctx);
+void tracy_set_progress_callback(TracyContext* ctx, TracyProgressCallback callback,
+								 void* user_data);
+uint8_t* tracy_update_image_ldr(TracyContext* ctx);
+float* tracy_update_image_hdr(TracyContext* ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,6 +60,10 @@ if __name__ == "__main__":
         "reference_dir",
         help="Path to the directory containing the reference/ground-truth EXR files",
     )
+    parser.add_argument(
+        "--fallback-reference-dir",
+        help="Directory with the references of the scenes missing in reference_dir",
+    )
 
     args = parser.parse_args()
 
@@ -78,6 +82,8 @@ if __name__ == "__main__":
     for render_path in exr_files:
         scene = os.path.splitext(render_path)[0].split("_")[-2]
         ref_fp = os.path.join(args.reference_dir, f"{scene}/scene.exr")
+        if not os.path.exists(ref_fp) and args.fallback_reference_dir:
+            ref_fp = os.path.join(args.fallback_reference_dir, f"{scene}/scene.exr")
 
         print(f"Comparing {render_path} against reference: {ref_fp}")
         filename = os.path.basename(render_path)
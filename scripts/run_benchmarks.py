@@ -49,14 +49,17 @@ def validate_and_merge(job_data, templates):
     final_params = DEFAULT_PARAMS.copy()
 
     # Layer in the template provided by the tag
-    final_params.update({k: v for k, v in template.items() if k in PARAM_SCHEMA})
+    final_params.update(
+        {k: v for k, v in template.items() if k in PARAM_SCHEMA or k == "reference"}
+    )
 
     # Layer in the specific job overrides (including non-render fields like 'scene')
     final_params.update(
         {
             k: v
             for k, v in job_data.items()
-            if k in PARAM_SCHEMA or k in ["scene", "variant", "iterations", "tag"]
+            if k in PARAM_SCHEMA
+            or k in ["scene", "variant", "iterations", "tag", "reference"]
         }
     )
 
@@ -70,6 +73,7 @@ def validate_and_merge(job_data, templates):
             "scene",
             "variant",
             "iterations",
+            "reference",
         ]:
             print(f"  Note: Parameter '{k}' is unrecognized and will be ignored.")
 
@@ -141,6 +145,8 @@ def main():
                 job["tag"],
                 str(job["iterations"]),
                 json_payload,
+                # the Mitsuba ground truth, unless the scene has its own reference
+                job.get("reference", f"mitsuba_scenes/{job['tag']}/scene.exr"),
             ]
 
             start_render = time.time()
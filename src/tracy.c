@@ -1,3 +1,13 @@
+// Pinning the pool workers to cores needs pthread_setaffinity_np, which is Linux only
+#if defined(TRACY_THREAD_POOL) && defined(__linux__)
+#define THREAD_AFFINITY
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // must be defined before any system header
+#endif
+#endif
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L // clock_gettime, for the time budget of render_refine_for
+#endif
 #include "tracy.h"
 #include "pcg_variants.h"
 #include <assert.h>
@@ -5,10 +15,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
+#ifdef TRACY_THREAD_POOL
+#include <pthread.h>
+#include <unistd.h>
+#elif defined(_OPENMP)
+#include <sched.h>
+#endif
 
 // Conditionally include emscripten.h and define EMSCRIPTEN_KEEPALIVE
 #ifdef __EMSCRIPTEN__
@@ -36,7 +53,56 @@
 
 // offset used for rays. may need to be adjusted depending on scene scale
 #define SELF_OCCLUSION_DELTA 0.00001f
-#define EPSILON 0.0001f
+#define SHADOW_RAY_EPSILON 0.0001f // shadow rays stop this fraction of the distance before lights
+#define LIGHT_BVH_MIN_LIGHTS 16 // fewer lights are selected by power, more with the light BVH
+// Sampler dimensions (a number or a pair of numbers) of the camera ray and of every bounce: light
+// selection, light point, russian roulette and the direction or the Fresnel choice
+#define SAMPLER_CAMERA_DIMENSIONS 1
+#define SAMPLER_BOUNCE_DIMENSIONS 4
+#define BLUE_NOISE_SIZE 64	  // width and height of the tiled blue noise mask, a power of 2
+#define BLUE_NOISE_SIGMA 1.5f // of the gaussian that measures the clusters and voids of the mask
+
+// BVH construction parameters. Costs are relative to each other, only their ratio matters.
+#define BVH_BINS 16				 // number of bins per axis for the binned SAH build
+#define BVH_MAX_LEAF_SIZE 4		 // leaves may only be larger if no split is possible
+#define BVH_TRAVERSAL_COST 1.0f	 // cost of visiting an interior node
+#define BVH_INTERSECTION_COST 1.0f // cost of a single ray-primitive test
+#define BVH_STACK_SIZE 128 // deeper LBVH trees are rebuilt with SAH, see build_bvh
+#define BVH_REFIT_MAX_COST_RATIO 1.5f // refitted BVHs are rebuilt if their SAH cost grew more
+
+// children per wide BVH node: one SIMD register of floats (8 with AVX, 4 with SSE, NEON, SIMD128)
+#if defined(__AVX__)
+#define WIDE_BVH_WIDTH 8
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+// Vectorization hint for the loops of the batched kernels. -fopenmp-simd defines no macro, so the
+// build defines TRACY_OPENMP_SIMD with it, and other builds don't get an unknown pragma.
+#if defined(_OPENMP) || defined(TRACY_OPENMP_SIMD)
+#define SIMD_LOOP _Pragma("omp simd")
+#else
+#define SIMD_LOOP
+#endif
+// Primitives tested at once by the batched intersection kernels. 4 fills a SSE, NEON or SIMD128
+// register and holds a full leaf, wider batches (AVX, AVX-512) mostly compute empty lanes.
+#define BATCH_SIZE 4
+#define DEFAULT_TILE_SIZE 32 // width and height of the tiles that render_refine distributes
+#define MIN_TILE_SIZE 4		 // at least the filter reach, so ghost borders only reach neighbors
+#define REFINE_ITEMS_PER_THREAD 4 // minimum work items per thread for the automatic grain size
+#define DETERMINISTIC_GRAIN_THREADS 64 // automatic grain of the deterministic mode, for any threads
+#define MAX_THREAD_COUNT 1024 // larger thread counts of render_set_thread_count are clamped
+// Adaptive sampling: the error of a pixel is only estimated from this many samples on, the
+// luminance offset keeps the relative error of dark pixels finite, and no tile gets more than the
+// factor times the average samples per pixel of a refine
+#define ADAPTIVE_MIN_SAMPLES 16
+#define ADAPTIVE_DARK_LUMINANCE 0.01
+#define ADAPTIVE_MAX_FACTOR 8
+#define BRUTE_FORCE_MAX_PRIMS 8 // smaller scenes are intersected without traversing the BVH
+
+#define LBVH_MORTON_30_MAX_PRIMS (1 << 16) // larger scenes use 63-bit instead of 30-bit Morton codes
+#define LBVH_TREELET_SIZE 7				   // leaves per treelet in the optional restructuring pass
+#define LBVH_TASK_MIN_PRIMS 4096		   // smaller subtrees are emitted serially
 
 // clang-format off
 // allow one line typedefs
@@ -46,8 +112,8 @@ typedef struct { Vec origin; Vec dir; } Ray;
 
 typedef enum { SPHERE, TRIANGLE } ShapeType;
 typedef struct { Vec center; float radius; } Sphere;
-// one_sided triangles are only hit from their front side (CCW ordering)
-typedef struct { Vec v0, v1, v2; Vec edge1, edge2; bool one_sided; } Triangle;
+// one_sided triangles are only hit from their front side (CCW ordering), normal is precomputed
+typedef struct { Vec v0, v1, v2; Vec normal; bool one_sided; } Triangle;
 typedef struct {
 	union { Sphere sphere; Triangle triangle; } data;
 	ShapeType type;
@@ -74,9 +140,213 @@ typedef struct {
 } Primitive;
 typedef struct { Primitive* primitives; int size; } Scene;
 
-// t: distance, p: point, n: normal, inside: flag
-typedef struct { float t; Vec p; Vec n; bool inside; } HitInfo;
+typedef struct { Vec min, max; } Aabb;
+// Interior nodes (count == 0) store the index of their left child in left_first, the right child
+// is always stored right after it. Leaves (count > 0) store the first index into prim_indices.
+typedef struct { Aabb bounds; int left_first; int count; } BvhNode;
+typedef struct { BvhNode* nodes; int* prim_indices; int node_count; } Bvh;
+typedef struct { Aabb bounds; int count; } BvhBin;
+// Wide BVH node, collapsed from the binary BVH. Child bounds are stored as structure of arrays so
+// that all children are tested against a ray at once. A child is either a node (count == 0), a
+// leaf (count > 0, child is the first index into the binary BVH's prim_indices) or empty (count == 0,
+// child == -1).
+typedef struct {
+	float min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+	float max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+	int child[WIDE_BVH_WIDTH];
+	int count[WIDE_BVH_WIDTH];
+} WideBvhNode;
+typedef struct { WideBvhNode* nodes; int node_count; } WideBvh;
+typedef enum { BVH_BUILDER_SAH = 0, BVH_BUILDER_LBVH = 1, BVH_BUILDER_LBVH_TREELET = 2 } BvhBuilder;
+// Binary radix tree node used while building a LBVH. Children reference internal nodes (>= 0) or
+// leaves (~leaf_index, < 0). The leaves are the primitives in Morton order.
+typedef struct {
+	int left, right, parent;
+	int prim_count;	  // number of primitives in this subtree
+	int output_count; // number of nodes this subtree occupies in the final Bvh
+	bool collapse;	  // emit this subtree as a single leaf
+	float cost;		  // SAH cost of this subtree (not normalized by the root area)
+	Aabb bounds;
+} LbvhNode;
+typedef struct {
+	LbvhNode* nodes;		  // n - 1 internal nodes, the root is nodes[0]
+	int* leaf_parents;		  // parent of each of the n leaves
+	const int* sorted_prims;  // primitive index of each leaf
+	const Aabb* prim_bounds;  // indexed by primitive index
+	int* visit_counters;	  // used to synchronize the bottom up pass
+} LbvhBuild;
+
+// Scene compiled for intersection: the primitives are split by shape type into structure of arrays
+// in BVH order, so every leaf covers one contiguous range of spheres followed by one contiguous
+// range of triangles. Materials are referenced by index.
+typedef struct {
+	float *center_x, *center_y, *center_z, *radius;
+	int* material;
+	int count;
+} SphereArrays;
+typedef struct {
+	float *v0_x, *v0_y, *v0_z;
+	float *v1_x, *v1_y, *v1_z;
+	float *v2_x, *v2_y, *v2_z;
+	float* min_determinant; // 0 for one sided triangles (culls back faces), else -INFINITY
+	float *normal_x, *normal_y, *normal_z; // only read by finalize_triangle_hit
+	int* material;
+	int count;
+} TriangleArrays;
+typedef struct {
+	SphereArrays spheres;
+	TriangleArrays triangles;
+	Material* materials; // shared by all primitives with the same material
+	int material_count;
+	// number of spheres before each position of the BVH's prim_indices (prim_count + 1 entries), to
+	// turn a leaf's primitive range into its sphere and triangle ranges
+	int* sphere_offset;
+} CompiledScene;
+// Bottom level acceleration structure: BVH and compiled primitives of one mesh, in object space
+typedef struct {
+	Bvh bvh;
+	WideBvh wide_bvh;		// collapsed from bvh, shares its prim_indices
+	CompiledScene compiled; // primitives in BVH order
+	int prim_count;
+	float built_sah_cost; // of the last full build, refits compare against it
+} Blas;
+
+// Affine transform, row major 3x4 matrix: p' = m * (p, 1)
+typedef struct { float m[3][4]; } Transform;
+// A mesh placed in the world. Transforms must not mirror, that would turn front into back faces.
+typedef struct { int mesh; Transform object_to_world; } Instance;
+// Instanced geometry of a scene: the meshes are defined in object space and shared by all instances
+typedef struct {
+	Scene* meshes;
+	int mesh_count;
+	Instance* instances;
+	int instance_count;
+} SceneInstances;
+typedef struct { Transform world_to_object; int mesh; } TlasInstance;
+// Top level acceleration structure: a BVH over the world space bounds of the instances
+typedef struct { Bvh bvh; TlasInstance* instances; int instance_count; } Tlas;
+
+// Emissive triangle of current_scene, sampled by next-event estimation. It emits radiance to the
+// side of its normal, or to both sides if it is thin walled.
+typedef struct { Vec v0, v1, v2; Vec normal; Vec radiance; float area; bool two_sided; } EmissiveTriangle;
+// Vose's alias table, samples index i with probability weight_i / sum of all weights in O(1)
+typedef struct { float* probability; int* alias; int count; } AliasTable;
+// Bounds of the light of one or more emissive triangles: the bounds of their points, a cone of
+// half angle acos(cos_theta_o) around axis that contains their normals (-1: all directions) and
+// their total power
+typedef struct { Aabb bounds; Vec axis; float cos_theta_o; float power; } LightBounds;
+// BVH over the lights with the LightBounds of every node, parents: of every node (-1: the root),
+// leaves: the leaf of every light
+typedef struct { Bvh bvh; LightBounds* node_bounds; int* parents; int* leaves; } LightBvh;
+// The emissive triangles and the structures that select one of them for a shading point: by power
+// with the alias table, or by the estimated contribution with the light BVH if there are many.
+// triangle_lights: the light of every triangle of scene_blas.compiled, -1 if it is not emissive
+typedef struct {
+	EmissiveTriangle* triangles;
+	LightBounds* bounds;
+	float* power_probability; // of selecting each light by the power table
+	AliasTable power_table;
+	LightBvh bvh; // only built with LIGHT_BVH_MIN_LIGHTS lights or more
+	int* triangle_lights;
+	int count;
+} LightList;
+
+// t: distance, p: point, n: normal, inside: flag, light: the index in the LightList or -1
+typedef struct { float t; Vec p; Vec n; bool inside; int light; } HitInfo;
+// Result of the intersection kernels: t: distance, u, v: barycentrics (triangles only), inside: flag,
+// type and index: the hit sphere or triangle in the compiled scene, instance: the instance whose
+// mesh was hit or -1 for current_scene
+typedef struct { float t, u, v; bool inside; ShapeType type; int index, instance; } HitCandidate;
 typedef enum { FILTER_BOX = 0, FILTER_GAUSSIAN = 1, FILTER_MITCHELL = 2 } FilterType;
+// Precision of the accumulated radiance and weights of every pixel. The float accumulators keep
+// radiance and weight of a pixel interleaved in one FloatAccum, the compensated one follows it by
+// the Neumaier compensation of the four sums.
+typedef enum { ACCUMULATOR_DOUBLE = 0, ACCUMULATOR_FLOAT = 1, ACCUMULATOR_FLOAT_COMPENSATED = 2 } Accumulator;
+typedef struct { float r, g, b, weight; } FloatAccum;
+// Summed luminance of the samples of a pixel and of their squares, for the variance of adaptive
+// sampling. Only the pixel's own samples count, not the ones splatted from its neighbors.
+typedef struct { double sum, sum_squares; } LuminanceMoments;
+// Source of the random numbers of the samples: the PCG stream of every pixel, an Owen-scrambled
+// Sobol sequence per pixel, indexed by the sample number and the dimension, or one such sequence
+// for all pixels, rotated per pixel by a blue noise mask
+typedef enum { SAMPLER_PCG = 0, SAMPLER_SOBOL = 1, SAMPLER_BLUE_NOISE = 2 } SamplerType;
+// Random numbers of one sample (a path). rng: the pixel's stream (SAMPLER_PCG). seed: of the pixel,
+// reversed_index: the sample's index in the pixel's sequence with reversed bits, dimension: the
+// next one (SAMPLER_SOBOL). blue_noise: the mask, x, y: the pixel (SAMPLER_BLUE_NOISE).
+typedef struct {
+	SamplerType type;
+	pcg32_random_t* rng;
+	uint32_t seed, reversed_index, dimension;
+	const uint32_t* blue_noise;
+	int x, y;
+} Sampler;
+// Pixel rectangle [x0, x1) x [y0, y1), the unit of work of render_refine
+typedef struct { int x0, y0, x1, y1; } Tile;
+// Accumulation buffer of one thread for one tile, covering the tile and a border of the filter
+// reach around it. x, y: image position of the first element.
+typedef struct { DVec* radiance; double* weights; int x, y, stride; } TileBuffer;
+// Work item of render_refine: a batch of samples of one tile (index in Morton order)
+typedef struct { int tile, batch; } TileWork;
+// Lock of the parallel sections that run on every threading backend. Pthread mutexes also work on
+// OpenMP threads, so both backends share them if the thread pool is compiled in.
+#ifdef TRACY_THREAD_POOL
+typedef pthread_mutex_t Mutex;
+#elif defined(_OPENMP)
+typedef omp_lock_t Mutex;
+#else
+typedef int Mutex; // single threaded build, locking does nothing
+#endif
+#ifdef TRACY_THREAD_POOL
+typedef pthread_cond_t Condition;
+#else
+typedef int Condition; // OpenMP has no condition variables, waiting threads yield instead
+#endif
+// Work queue of one thread: the owner pushes and pops at the bottom, idle threads steal at the top
+typedef struct { TileWork* items; int top, bottom; Mutex lock; } WorkDeque;
+typedef enum { THREAD_BACKEND_SERIAL = 0, THREAD_BACKEND_OPENMP = 1, THREAD_BACKEND_POOL = 2 } ThreadBackend;
+// Body of a parallel section, called once for every thread in 0 .. threads - 1. The calls may run
+// one after another (e.g. single threaded), so they must not wait for each other.
+typedef void (*ParallelFunction)(void* context, int thread, int threads);
+#ifdef TRACY_THREAD_POOL
+// Parallel section queued in the thread pool. The workers take its threads one at a time, a worker
+// may run several threads of the same job after each other.
+typedef struct ParallelJob {
+	ParallelFunction function;
+	void* context;
+	int threads;
+	int next_thread, finished; // guarded by the pool mutex
+	struct ParallelJob* next;  // in the job queue
+} ParallelJob;
+// Persistent worker threads, waiting for jobs in a FIFO queue
+typedef struct {
+	pthread_t* workers;
+	int worker_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t job_queued, job_finished;
+	ParallelJob *queue_head, *queue_tail;
+	bool shutdown;
+} ThreadPool;
+#endif
+// Shared state of the parallel phases of render_refine
+typedef struct {
+	TracyContext* ctx;
+	int n_samples, grain;
+	int* tile_samples; // samples per pixel of every tile, n_samples unless sampling adaptively
+	float filter_radius;
+	int filter_reach;
+	int tiles_x, tiles_y, tile_count;
+	int* tiles; // Morton order
+	int tile_stride, tile_buffer_size, ghost_size;
+	DVec* ghost_radiance;
+	double* ghost_weights;
+	WorkDeque* deques;
+	int deque_count;
+	int remaining_items, next_gather_tile; // atomic
+	// threads without work sleep until the generation changes: a batch finished or a thread left
+	Mutex idle_lock;
+	Condition work_changed;
+	int work_generation; // atomic, changed with idle_lock held
+} RefineJob;
 // clang-format on
 
 // light radiant energy calculation:
@@ -188,13 +458,74 @@ Primitive scene_cyberpunk[] = {
 	{.shape.type=SPHERE, .shape.data.sphere={.center={-1.8, 0.8, 2.0}, .radius=0.8}, .material=MAT_MIRROR_DARK},
 };
 
+#define MAT_STONE (Material){.type = DIFFUSE, .data.diffuse.albedo = {0.45, 0.42, 0.38}}
+#define MAT_GRASS (Material){.type = DIFFUSE, .data.diffuse.albedo = {0.2, 0.35, 0.1}}
+#define MAT_SKY   (Material){.type = EMISSIVE, .data.emissive.radiosity = {3.0, 3.5, 4.5}}
+
+// Meshes of the instanced rock field, in object space. The rock is an octahedron around the origin.
+Primitive mesh_rock[] = {
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 1, 0, 0},{ 0, 1, 0},{ 0, 0, 1},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 0, 0, 1},{ 0, 1, 0},{-1, 0, 0},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-1, 0, 0},{ 0, 1, 0},{ 0, 0,-1},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 0, 0,-1},{ 0, 1, 0},{ 1, 0, 0},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 1, 0, 0},{ 0, 0, 1},{ 0,-1, 0},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 0, 0, 1},{-1, 0, 0},{ 0,-1, 0},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-1, 0, 0},{ 0, 0,-1},{ 0,-1, 0},.one_sided=true}, .material=MAT_STONE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{ 0, 0,-1},{ 1, 0, 0},{ 0,-1, 0},.one_sided=true}, .material=MAT_STONE},
+};
+Primitive mesh_ball[] = {
+	{.shape.type=SPHERE, .shape.data.sphere={.center={0, 0, 0}, .radius=1}, .material=MAT_MIRROR},
+};
+
+Primitive scene_rock_field[] = {
+	// ground
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0, 20},{ 20, 0, 20},{ 20, 0,-20},.one_sided=true}, .material=MAT_GRASS},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0, 20},{ 20, 0,-20},{-20, 0,-20},.one_sided=true}, .material=MAT_GRASS},
+	// overcast sky, facing down
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 8, 20},{ 20, 8,-20},{ 20, 8, 20},.one_sided=true}, .material=MAT_SKY},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 8, 20},{-20, 8,-20},{ 20, 8,-20},.one_sided=true}, .material=MAT_SKY},
+};
+
+#define LIGHT_GRID_SIZE 16 // the many lights scene has LIGHT_GRID_SIZE^2 small area lights
+#define LIGHT_GRID_FIRST 7 // index of the first light in scene_many_lights
+Primitive scene_many_lights[LIGHT_GRID_FIRST + 2 * LIGHT_GRID_SIZE * LIGHT_GRID_SIZE] = {
+	// floor
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0, 20},{ 20, 0, 20},{ 20, 0,-20},.one_sided=true}, .material=MAT_WHITE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0, 20},{ 20, 0,-20},{-20, 0,-20},.one_sided=true}, .material=MAT_WHITE},
+	// back wall
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0,-20},{ 20, 0,-20},{ 20, 3,-20},.one_sided=true}, .material=MAT_WHITE},
+	{.shape.type=TRIANGLE, .shape.data.triangle={{-20, 0,-20},{ 20, 3,-20},{-20, 3,-20},.one_sided=true}, .material=MAT_WHITE},
+	{.shape.type=SPHERE, .shape.data.sphere={.center={-1.8, 0.8, 0.0}, .radius=0.8}, .material=MAT_WHITE},
+	{.shape.type=SPHERE, .shape.data.sphere={.center={ 0.0, 0.8,-1.0}, .radius=0.8}, .material=MAT_MIRROR},
+	{.shape.type=SPHERE, .shape.data.sphere={.center={ 1.8, 0.8, 0.0}, .radius=0.8}, .material=MAT_GLASS},
+	// the lights are generated into the rest
+};
+
 // clang-format on
 
+#define ROCK_FIELD_SIZE 64 // the rock field has ROCK_FIELD_SIZE^2 instances on a grid
+Scene rock_field_meshes[] = {
+	{mesh_rock, sizeof(mesh_rock) / sizeof(Primitive)},
+	{mesh_ball, sizeof(mesh_ball) / sizeof(Primitive)},
+};
+Instance rock_field_instances[ROCK_FIELD_SIZE * ROCK_FIELD_SIZE]; // generated into each context
+
 Scene all_scenes[] = {
 	{scene_cornell, sizeof(scene_cornell) / sizeof(Primitive)},
 	{scene_caustics, sizeof(scene_caustics) / sizeof(Primitive)},
 	{scene_glass_sphere, sizeof(scene_glass_sphere) / sizeof(Primitive)},
 	{scene_cyberpunk, sizeof(scene_cyberpunk) / sizeof(Primitive)},
+	{scene_rock_field, sizeof(scene_rock_field) / sizeof(Primitive)},
+	{scene_many_lights, sizeof(scene_many_lights) / sizeof(Primitive)},
+};
+#define SCENE_ROCK_FIELD 4
+#define SCENE_MANY_LIGHTS 5
+
+// Instanced geometry of each scene in all_scenes, in the same order
+SceneInstances all_scene_instances[] = {
+	{0}, {0}, {0}, {0},
+	{rock_field_meshes, 2, rock_field_instances, ROCK_FIELD_SIZE * ROCK_FIELD_SIZE},
+	{0},
 };
 
 #ifndef M_PI
@@ -203,6 +534,11 @@ Scene all_scenes[] = {
 
 // clang-format off
 // KEEP COMPACT: Vector intrinsics are more readable as one-liners
+// unlike fminf/fmaxf these compile to a single instruction, but they don't handle NaNs symmetrically
+float min_float(float a, float b) { return a < b ? a : b; }
+float max_float(float a, float b) { return a > b ? a : b; }
+int min_int(int a, int b) { return a < b ? a : b; }
+int max_int(int a, int b) { return a > b ? a : b; }
 Vec vec_add(Vec a, Vec b) { return (Vec){a.x + b.x, a.y + b.y, a.z + b.z}; }
 Vec vec_sub(Vec a, Vec b) { return (Vec){a.x - b.x, a.y - b.y, a.z - b.z}; }
 Vec vec_scale(Vec v, float s) { return (Vec){v.x * s, v.y * s, v.z * s}; }
@@ -210,6 +546,10 @@ Vec vec_hadamard_prod(Vec a, Vec b) { return (Vec){a.x * b.x, a.y * b.y, a.z * b
 float vec_dot(Vec a, Vec b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
 float vec_length(Vec v) { return sqrtf(vec_dot(v, v)); }
 float vec_length_squared(Vec v) { return vec_dot(v, v); }
+Vec vec_min(Vec a, Vec b) { return (Vec){min_float(a.x, b.x), min_float(a.y, b.y), min_float(a.z, b.z)}; }
+Vec vec_max(Vec a, Vec b) { return (Vec){max_float(a.x, b.x), max_float(a.y, b.y), max_float(a.z, b.z)}; }
+float vec_axis(Vec v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+Vec vec_load(const float* x, const float* y, const float* z, int i) { return (Vec){x[i], y[i], z[i]}; }
 // clang-format on
 Vec vec_normalize(Vec v) {
 	float l = vec_length(v);
@@ -224,26 +564,83 @@ Vec vec_cross(Vec a, Vec b) {
 	};
 }
 
-// The image buffer will be allocated on demand.
-uint8_t* image_buffer_ldr = NULL;			  // stores tone mapped gamma corrected colors (rgba)
-float* image_buffer_hdr = NULL;				  // stores linear averaged floats (rgb)
-DVec* summed_weighted_radiance_buffer = NULL; // stores summed raw radiance
-double* summed_weights_buffer = NULL;		  // stores the summed weights of the samples
-pcg32_random_t* rng_buffer = NULL;			  // stores RNG state per pixel
-int buffer_width = 0;
-int buffer_height = 0;
+// State of one render. Every context has its own copy of the scene, so that contexts can move
+// their primitives and instances independently and can render concurrently.
+struct TracyContext {
+	// The image buffer will be allocated on demand.
+	uint8_t* image_buffer_ldr;				// stores tone mapped gamma corrected colors (rgba)
+	float* image_buffer_hdr;				// stores linear averaged floats (rgb)
+	DVec* summed_weighted_radiance_buffer;	// stores summed raw radiance (ACCUMULATOR_DOUBLE)
+	double* summed_weights_buffer;			// stores the summed weights of the samples (ditto)
+	FloatAccum* float_accum_buffer; // stores both, 1 or 2 (compensated) per pixel (float modes)
+	pcg32_random_t* rng_buffer;				// stores RNG state per pixel
+	int* sample_count_buffer;				// stores the number of samples per pixel
+	LuminanceMoments* moment_buffer; // per pixel, only allocated for adaptive sampling
+	bool* converged_buffer;			 // pixels that get no more samples, ditto
+	int buffer_width;
+	int buffer_height;
+	Accumulator buffer_accumulator; // of the allocated buffers
+	Accumulator accumulator;		// selected for the next render_init
+
+	Scene current_scene;
+	Primitive* scene_primitives;	   // copy of the primitives of current_scene, may be moved
+	SceneInstances current_instances; // meshes placed in current_scene, a copy owned by the context
+	// The bottom levels are only rebuilt by render_init if the scene or the builder changed, the
+	// small top level over the instances is rebuilt every time.
+	Blas scene_blas; // over current_scene, in world space
+	Blas* mesh_blas; // one per mesh of current_instances
+	int mesh_blas_count;
+	Tlas scene_tlas;
+	LightList lights; // emissive triangles of current_scene, rebuilt with the top level
+	bool light_sampling;
+	SamplerType sampler;		// selected for the next render_init
+	SamplerType render_sampler; // of the current render
+	uint32_t* blue_noise;		// mask of SAMPLER_BLUE_NOISE, generated by its first render_init
+	bool adaptive_sampling;		// selected for the next render_init
+	float convergence_threshold; // relative error below which pixels stop, 0: never
+	int built_scene_id;
+	BvhBuilder built_bvh_builder;
+	BvhBuilder bvh_builder;
+	bool use_wide_bvh;
+	int max_depth;
+	int width, height;
+	Vec camera_origin;
+	Vec forward, right, up;
+	FilterType filter_type; // Current selected filter
+	int refine_grain;		// samples per pixel in one work item of render_refine, 0: automatic
+	int tile_size;
+	bool deterministic; // the automatic grain does not depend on the thread count
+	// progress of the current or last render_refine, in work items (a tile and a batch of samples)
+	int refine_completed, refine_total; // atomic
+	int refine_cancelled;				// atomic, checked before every work item
+	double refine_deadline;				// of render_refine_for, also checked before every work item
+	TracyProgressCallback progress_callback;
+	void* progress_user_data;
+#ifdef TRACY_THREAD_POOL
+	pthread_t refine_thread; // of tracy_render_refine_async, until it is joined
+	bool refine_thread_started;
+	int refining; // atomic, the refine thread is running
+	unsigned int refine_thread_samples;
+#endif
+};
 
 // state variables
-Scene current_scene;
-int max_depth;
-int width, height;
-Vec camera_origin;
-Vec forward, right, up;
-FilterType filter_type; // Current selected filter
+TracyContext* default_context = NULL; // of the functions without a context, created on first use
+// The thread pool is preferred if it is compiled in, production builds don't need libomp
+#if defined(TRACY_THREAD_POOL)
+ThreadBackend thread_backend = THREAD_BACKEND_POOL;
+ThreadPool* thread_pool = NULL; // started on first use, restarted when its settings change
+#elif defined(_OPENMP)
+ThreadBackend thread_backend = THREAD_BACKEND_OPENMP;
+#else
+ThreadBackend thread_backend = THREAD_BACKEND_SERIAL;
+#endif
+int thread_count = 0;		// threads of render_refine, 0: automatic
+int* thread_cores = NULL;	// cores the pool workers are pinned to in turn, NULL: not pinned
+int thread_core_count = 0;
 
 void precompute_triangle(Triangle* tri) {
-	tri->edge1 = vec_sub(tri->v1, tri->v0);
-	tri->edge2 = vec_sub(tri->v2, tri->v0);
+	tri->normal = vec_normalize(vec_cross(vec_sub(tri->v1, tri->v0), vec_sub(tri->v2, tri->v0)));
 }
 
 // 10.3.16
@@ -251,266 +648,2230 @@ Vec reflect(Vec incident, Vec normal) {
 	return vec_sub(incident, vec_scale(normal, 2.0f * vec_dot(normal, incident)));
 }
 
-// ray-sphere intersection (6.2.4)
-bool intersect_sphere(const Ray* r, const Sphere* s, HitInfo* hit) {
-	Vec oc = vec_sub(r->origin, s->center);
+// Batched ray-sphere intersection (6.2.4): tests one ray against the spheres begin..end-1,
+// BATCH_SIZE at a time. Like all intersection kernels it only accepts hits closer than
+// closest_hit->t and only returns the distance and the data needed to reconstruct the hit (see
+// finalize_*_hit), so that farther candidates are rejected without computing a hit point and
+// normal. Returns true if closest_hit was updated.
+// Every lane is computed without branches and misses are masked out at the end. The arrays must
+// be readable up to BATCH_SIZE - 1 elements past end (see compile_scene).
+bool hit_test_spheres(const Ray* r, const SphereArrays* spheres, int begin, int end,
+					  HitCandidate* closest_hit) {
 	float a = vec_dot(r->dir, r->dir);
-	float b = 2.0f * vec_dot(oc, r->dir);
-	float c = vec_dot(oc, oc) - s->radius * s->radius;
-	// quadratic formula
-	float discriminant = b * b - 4.0f * a * c;
-	if (discriminant < 0.0f) {
-		// cant take the square root of negative number
-		// the quadratic formula has no solution -> no intersection
-		return false;
-	} else {
-		float sqrtDiscriminant = sqrtf(discriminant);
-		// we may have either one solution (t0==t1) or two solutions (t0 < t1)
-		float t0 = (-b - sqrtDiscriminant) / (2.0f * a);
-		float t1 = (-b + sqrtDiscriminant) / (2.0f * a);
-		// we want to know about the closest intersection in front of the camera
-		// -> smallest t value
-		// however a negative t value would mean an intersection behind the camera
-		// -> ignore negative t value
-		// therefore we return the smallest positive t value
-		if (t1 <= 0.0f) {
-			return false; // both intersections are behind ray
-		}
-		hit->t = t0 > 0.0f ? t0 : t1; // if the first intersection is behind ray, use the other
-		hit->p = vec_add(r->origin, vec_scale(r->dir, hit->t));
-		hit->n = vec_normalize(vec_sub(hit->p, s->center));
-		hit->inside = !(t0 > 0.0f);
-		return true;
+	bool found = false;
+	for (int first = begin; first < end; first += BATCH_SIZE) {
+		float t[BATCH_SIZE], t_near[BATCH_SIZE];
+		SIMD_LOOP
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			Vec center =
+				vec_load(spheres->center_x, spheres->center_y, spheres->center_z, first + i);
+			float radius = spheres->radius[first + i];
+			Vec oc = vec_sub(r->origin, center);
+			float b = 2.0f * vec_dot(oc, r->dir);
+			float c = vec_dot(oc, oc) - radius * radius;
+			// quadratic formula, no solution for a negative discriminant -> no intersection
+			float discriminant = b * b - 4.0f * a * c;
+			float sqrt_discriminant = sqrtf(max_float(discriminant, 0.0f));
+			// we may have either one solution (t0==t1) or two solutions (t0 < t1)
+			float t0 = (-b - sqrt_discriminant) / (2.0f * a);
+			float t1 = (-b + sqrt_discriminant) / (2.0f * a);
+			// we want the smallest positive t value, negative t values are behind the ray
+			// if the first intersection is behind the ray, use the other
+			bool hit = !(discriminant < 0.0f) & !(t1 <= 0.0f) & (first + i < end);
+			t[i] = hit ? (t0 > 0.0f ? t0 : t1) : INFINITY;
+			t_near[i] = t0;
+		}
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			if (t[i] < closest_hit->t) {
+				closest_hit->t = t[i];
+				closest_hit->inside = !(t_near[i] > 0.0f);
+				closest_hit->type = SPHERE;
+				closest_hit->index = first + i;
+				found = true;
+			}
+		}
 	}
+	return found;
 }
 
-// ray-triangle intersection using Möller–Trumbore algorithm
-bool intersect_triangle(const Ray* r, const Triangle* tri, HitInfo* hit) {
-	Vec h = vec_cross(r->dir, tri->edge2);
-	float a = vec_dot(tri->edge1, h);
+// Per ray part of the watertight triangle test: the axes are permuted so that z is the dominant
+// direction axis and the shear (sx, sy) and scale (sz) map the ray direction to (0, 0, 1)
+typedef struct { int kx, ky, kz; float sx, sy, sz; } RayShear;
+
+RayShear ray_shear(Vec dir) {
+	// written with arrays and selects instead of vec_axis, the branches would be unpredictable
+	float d[3] = {dir.x, dir.y, dir.z};
+	float x = fabsf(dir.x), y = fabsf(dir.y), z = fabsf(dir.z);
+	int kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+	int kx = kz == 2 ? 0 : kz + 1;
+	int ky = kx == 2 ? 0 : kx + 1;
+	// swap to preserve the winding direction of the triangles
+	bool swap = d[kz] < 0.0f;
+	int swapped_kx = swap ? ky : kx;
+	ky = swap ? kx : ky;
+	kx = swapped_kx;
+	float inv_dir_z = 1.0f / d[kz];
+	return (RayShear){kx, ky, kz, d[kx] * inv_dir_z, d[ky] * inv_dir_z, inv_dir_z};
+}
+
+// Batched watertight ray-triangle intersection (Woop, Benthin and Wald 2013), same conventions as
+// hit_test_spheres. The vertices are transformed into a space where the ray starts at the origin
+// and points along +z, there the 2D edge functions decide if the ray passes inside the triangle.
+// Rounding is monotonic, so the sign of an edge function (a difference of two rounded products) is
+// either exact or zero, and the edge function of a shared edge is exactly negated in the neighboring
+// triangle. Triangles sharing an edge therefore never both miss a ray through that edge, which makes
+// the test watertight without any epsilon. This requires the products not to be fused into FMAs,
+// which is why they are separate statements and contraction is turned off for this function.
+bool hit_test_triangles(const Ray* r, const TriangleArrays* triangles, int begin, int end,
+						HitCandidate* closest_hit) {
+	// applies until the end of the function. GCC ignores the pragma with a warning, but doesn't
+	// contract in the ISO C modes the build uses (-std=c11), GNU modes need -ffp-contract=off.
+#if defined(__clang__) || !defined(__GNUC__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+	if (begin >= end) return false; // skip the per ray setup for leaves without triangles
+	RayShear shear = ray_shear(r->dir);
+	const float* v0[3] = {triangles->v0_x, triangles->v0_y, triangles->v0_z};
+	const float* v1[3] = {triangles->v1_x, triangles->v1_y, triangles->v1_z};
+	const float* v2[3] = {triangles->v2_x, triangles->v2_y, triangles->v2_z};
+	float origin[3] = {r->origin.x, r->origin.y, r->origin.z};
+	float origin_x = origin[shear.kx], origin_y = origin[shear.ky], origin_z = origin[shear.kz];
+	bool found = false;
+	for (int first = begin; first < end; first += BATCH_SIZE) {
+		float t[BATCH_SIZE], u[BATCH_SIZE], v[BATCH_SIZE], determinant[BATCH_SIZE];
+		SIMD_LOOP
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			int j = first + i;
+			// vertices relative to the ray origin, z is scaled later
+			float az = v0[shear.kz][j] - origin_z, bz = v1[shear.kz][j] - origin_z;
+			float cz = v2[shear.kz][j] - origin_z;
+			float ax = v0[shear.kx][j] - origin_x - shear.sx * az;
+			float ay = v0[shear.ky][j] - origin_y - shear.sy * az;
+			float bx = v1[shear.kx][j] - origin_x - shear.sx * bz;
+			float by = v1[shear.ky][j] - origin_y - shear.sy * bz;
+			float cx = v2[shear.kx][j] - origin_x - shear.sx * cz;
+			float cy = v2[shear.ky][j] - origin_y - shear.sy * cz;
+			// scaled barycentric coordinates
+			float cx_by = cx * by, cy_bx = cy * bx, ax_cy = ax * cy;
+			float ay_cx = ay * cx, bx_ay = bx * ay, by_ax = by * ax;
+			float e0 = cx_by - cy_bx, e1 = ax_cy - ay_cx, e2 = bx_ay - by_ax;
+			// twice the projected area, positive if the ray hits the front face
+			float det = e0 + e1 + e2;
+			float t_scaled = shear.sz * (e0 * az + e1 * bz + e2 * cz);
+			float inv_det = 1.0f / det;
+			u[i] = e1 * inv_det;
+			v[i] = e2 * inv_det;
+			float t_hit = t_scaled * inv_det;
 
-	// If we only care about front-faces, we can exit early
-	if (tri->one_sided && a < EPSILON) return false;
+			// bitwise instead of logical operators, so that no branches are generated
+			bool hit = ((e0 >= 0.0f) & (e1 >= 0.0f) & (e2 >= 0.0f)) |
+					   ((e0 <= 0.0f) & (e1 <= 0.0f) & (e2 <= 0.0f));
+			hit &= (det != 0.0f) & !(det < triangles->min_determinant[j]); // one sided: front only
+			hit &= (t_hit > 0.0f) & (j < end); // in front of the ray
+			t[i] = hit ? t_hit : INFINITY;
+			determinant[i] = det;
+		}
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			if (t[i] < closest_hit->t) {
+				closest_hit->t = t[i];
+				closest_hit->u = u[i];
+				closest_hit->v = v[i];
+				// If normal and ray point in the same direction, we are exiting the object (inside)
+				closest_hit->inside = determinant[i] < 0.0f;
+				closest_hit->type = TRIANGLE;
+				closest_hit->index = first + i;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
 
-	// Check if ray is parallel to the triangle
-	// We perform double-sided intersection here.
-	if (a > -EPSILON && a < EPSILON) { return false; }
+// Reconstruct the full hit information, only done once for the closest hit of a ray
+void finalize_sphere_hit(const Ray* r, Vec center, const HitCandidate* candidate, HitInfo* hit) {
+	hit->t = candidate->t;
+	hit->p = vec_add(r->origin, vec_scale(r->dir, candidate->t));
+	hit->n = vec_normalize(vec_sub(hit->p, center));
+	hit->inside = candidate->inside;
+}
 
-	float f = 1.0f / a;
-	Vec s = vec_sub(r->origin, tri->v0);
-	float u = f * vec_dot(s, h);
+void finalize_triangle_hit(const Ray* r, Vec normal, const HitCandidate* candidate, HitInfo* hit) {
+	hit->t = candidate->t;
+	hit->p = vec_add(r->origin, vec_scale(r->dir, candidate->t));
+	hit->n = normal; // geometric normal, not flipped when inside
+	hit->inside = candidate->inside;
+}
 
-	if (u < 0.0f || u > 1.0f) { return false; }
+// Single primitive versions, run the batched kernels on one padded batch
+bool intersect_sphere(const Ray* r, const Sphere* s, HitInfo* hit) {
+	float data[4][BATCH_SIZE] = {{s->center.x}, {s->center.y}, {s->center.z}, {s->radius}};
+	SphereArrays spheres = {data[0], data[1], data[2], data[3], .count = 1};
+	HitCandidate candidate = {.t = INFINITY};
+	if (!hit_test_spheres(r, &spheres, 0, 1, &candidate)) return false;
+	finalize_sphere_hit(r, s->center, &candidate, hit);
+	return true;
+}
 
-	Vec q = vec_cross(s, tri->edge1);
-	float v = f * vec_dot(r->dir, q);
+bool intersect_triangle(const Ray* r, const Triangle* tri, HitInfo* hit) {
+	float data[10][BATCH_SIZE] = {
+		{tri->v0.x}, {tri->v0.y}, {tri->v0.z}, {tri->v1.x}, {tri->v1.y},
+		{tri->v1.z}, {tri->v2.x}, {tri->v2.y}, {tri->v2.z}, {tri->one_sided ? 0.0f : -INFINITY},
+	};
+	TriangleArrays triangles = {data[0], data[1], data[2], data[3], data[4],
+								data[5], data[6], data[7], data[8], data[9], .count = 1};
+	HitCandidate candidate = {.t = INFINITY};
+	if (!hit_test_triangles(r, &triangles, 0, 1, &candidate)) return false;
+	finalize_triangle_hit(r, tri->normal, &candidate, hit);
+	return true;
+}
 
-	if (v < 0.0f || u + v > 1.0f) { return false; }
+bool intersect_primitive(const Ray* r, const Primitive* prim, HitInfo* hit) {
+	switch (prim->shape.type) {
+	case SPHERE: return intersect_sphere(r, &prim->shape.data.sphere, hit);
+	case TRIANGLE: return intersect_triangle(r, &prim->shape.data.triangle, hit);
+	}
+	return false;
+}
 
-	float t = f * vec_dot(tri->edge2, q);
+// clang-format off
+Aabb aabb_empty() { return (Aabb){{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}}; }
+Aabb aabb_grow(Aabb b, Vec p) { return (Aabb){vec_min(b.min, p), vec_max(b.max, p)}; }
+Aabb aabb_union(Aabb a, Aabb b) { return (Aabb){vec_min(a.min, b.min), vec_max(a.max, b.max)}; }
+Vec aabb_center(Aabb b) { return vec_scale(vec_add(b.min, b.max), 0.5f); }
+// clang-format on
+float aabb_surface_area(Aabb b) {
+	Vec e = vec_sub(b.max, b.min);
+	return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
 
-	// Check if intersection is in front of the camera
-	if (t > EPSILON) {
-		hit->t = t;
-		hit->p = vec_add(r->origin, vec_scale(r->dir, t));
+Aabb primitive_bounds(const Primitive* prim) {
+	switch (prim->shape.type) {
+	case SPHERE: {
+		Sphere s = prim->shape.data.sphere;
+		Vec extent = {s.radius, s.radius, s.radius};
+		return (Aabb){vec_sub(s.center, extent), vec_add(s.center, extent)};
+	}
+	case TRIANGLE: {
+		Triangle tri = prim->shape.data.triangle;
+		return aabb_grow(aabb_grow((Aabb){tri.v0, tri.v0}, tri.v1), tri.v2);
+	}
+	}
+	return aabb_empty();
+}
 
-		// Calculate geometric normal
-		Vec n = vec_normalize(vec_cross(tri->edge1, tri->edge2));
+Vec transform_point(const Transform* t, Vec p) {
+	return (Vec){t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3],
+				 t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3],
+				 t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3]};
+}
+Vec transform_vector(const Transform* t, Vec v) {
+	return (Vec){t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+				 t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+				 t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z};
+}
+// Normals are transformed with the inverse transpose, so this takes the inverse transform
+Vec transform_normal(const Transform* inverse, Vec n) {
+	return (Vec){inverse->m[0][0] * n.x + inverse->m[1][0] * n.y + inverse->m[2][0] * n.z,
+				 inverse->m[0][1] * n.x + inverse->m[1][1] * n.y + inverse->m[2][1] * n.z,
+				 inverse->m[0][2] * n.x + inverse->m[1][2] * n.y + inverse->m[2][2] * n.z};
+}
 
-		// Check orientation to set 'inside' flag correctly
-		// If normal and ray point in the same direction, we are exiting the object (inside)
-		hit->inside = (vec_dot(r->dir, n) > 0.0f);
-		hit->n = n;
+Transform transform_inverse(const Transform* t) {
+	const float(*m)[4] = t->m;
+	// adjugate of the linear part divided by its determinant
+	Transform inv = {{
+		{m[1][1] * m[2][2] - m[1][2] * m[2][1], m[0][2] * m[2][1] - m[0][1] * m[2][2],
+		 m[0][1] * m[1][2] - m[0][2] * m[1][1], 0},
+		{m[1][2] * m[2][0] - m[1][0] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0],
+		 m[0][2] * m[1][0] - m[0][0] * m[1][2], 0},
+		{m[1][0] * m[2][1] - m[1][1] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1],
+		 m[0][0] * m[1][1] - m[0][1] * m[1][0], 0},
+	}};
+	float inv_det = 1.0f / (m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0]);
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 3; ++j) inv.m[i][j] *= inv_det;
+	}
+	Vec translation = transform_vector(&inv, (Vec){m[0][3], m[1][3], m[2][3]});
+	inv.m[0][3] = -translation.x, inv.m[1][3] = -translation.y, inv.m[2][3] = -translation.z;
+	return inv;
+}
 
-		return true;
+// Bounds of the transformed box (Arvo): every output axis is the translation plus the extremes of
+// the contributions of the input axes
+Aabb transform_aabb(const Transform* t, Aabb b) {
+	float min[3], max[3];
+	for (int i = 0; i < 3; ++i) {
+		min[i] = max[i] = t->m[i][3];
+		for (int j = 0; j < 3; ++j) {
+			float a = t->m[i][j] * vec_axis(b.min, j), c = t->m[i][j] * vec_axis(b.max, j);
+			min[i] += fminf(a, c);
+			max[i] += fmaxf(a, c);
+		}
 	}
+	return (Aabb){{min[0], min[1], min[2]}, {max[0], max[1], max[2]}};
+}
 
-	return false;
+// Slab test (12.3). Returns the distance at which the ray enters the box, or INFINITY if the box
+// is missed or lies completely behind t_max. Divisions by zero in inv_dir are intended: they produce
+// +-inf slabs. A NaN (origin exactly on a slab plane) is always passed as the first argument of
+// min_float/max_float, which then return the other argument, so that axis is ignored.
+float intersect_aabb(Vec origin, Vec inv_dir, const Aabb* b, float t_max) {
+	float t_enter = -INFINITY, t_exit = t_max;
+	float t1 = (b->min.x - origin.x) * inv_dir.x, t2 = (b->max.x - origin.x) * inv_dir.x;
+	t_enter = max_float(min_float(t1, t2), t_enter);
+	t_exit = min_float(max_float(t1, t2), t_exit);
+	t1 = (b->min.y - origin.y) * inv_dir.y, t2 = (b->max.y - origin.y) * inv_dir.y;
+	t_enter = max_float(min_float(t1, t2), t_enter);
+	t_exit = min_float(max_float(t1, t2), t_exit);
+	t1 = (b->min.z - origin.z) * inv_dir.z, t2 = (b->max.z - origin.z) * inv_dir.z;
+	t_enter = max_float(min_float(t1, t2), t_enter);
+	t_exit = min_float(max_float(t1, t2), t_exit);
+	return (t_exit >= t_enter && t_exit > 0.0f) ? t_enter : INFINITY;
 }
 
-bool intersect_scene(const Ray* r, HitInfo* closest_hit, Primitive** hit_primitive) {
-	closest_hit->t = INFINITY;
-	*hit_primitive = NULL;
+int bvh_bin_index(Vec centroid, int axis, float axis_min, float bin_scale) {
+	int bin = (int)((vec_axis(centroid, axis) - axis_min) * bin_scale);
+	return bin < 0 ? 0 : (bin >= BVH_BINS ? BVH_BINS - 1 : bin);
+}
 
-	for (int i = 0; i < current_scene.size; ++i) {
-		HitInfo current_hit;
-		bool hit = false;
+// Recursively splits a node using the surface area heuristic (12.3). Instead of evaluating every
+// possible split position, primitive centroids are sorted into BVH_BINS equally sized bins per axis
+// and only the bin boundaries are evaluated, which keeps the build O(n log n). The depth counts
+// from 1 at the root, nodes at the depth limit of the traversal stacks become leaves.
+void bvh_subdivide(Bvh* bvh, int node_index, const Aabb* prim_bounds, const Vec* centroids,
+				   int depth) {
+	BvhNode* node = &bvh->nodes[node_index];
+	int* indices = &bvh->prim_indices[node->left_first];
 
-		switch (current_scene.primitives[i].shape.type) {
-		case SPHERE:
-			hit = intersect_sphere(r, &current_scene.primitives[i].shape.data.sphere, &current_hit);
-			break;
-		case TRIANGLE:
-			hit = intersect_triangle(r, &current_scene.primitives[i].shape.data.triangle,
-									 &current_hit);
-			break;
+	node->bounds = aabb_empty();
+	Aabb centroid_bounds = aabb_empty();
+	for (int i = 0; i < node->count; ++i) {
+		node->bounds = aabb_union(node->bounds, prim_bounds[indices[i]]);
+		centroid_bounds = aabb_grow(centroid_bounds, centroids[indices[i]]);
+	}
+	if (node->count == 1 || depth + 1 >= BVH_STACK_SIZE) return;
+
+	float best_cost = INFINITY;
+	int best_axis = -1, best_split = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		float axis_min = vec_axis(centroid_bounds.min, axis);
+		float extent = vec_axis(centroid_bounds.max, axis) - axis_min;
+		if (extent <= 0.0f) continue; // all centroids share this coordinate
+
+		BvhBin bins[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; ++b) { bins[b] = (BvhBin){aabb_empty(), 0}; }
+		float bin_scale = BVH_BINS / extent;
+		for (int i = 0; i < node->count; ++i) {
+			BvhBin* bin = &bins[bvh_bin_index(centroids[indices[i]], axis, axis_min, bin_scale)];
+			bin->bounds = aabb_union(bin->bounds, prim_bounds[indices[i]]);
+			bin->count++;
 		}
 
-		if (hit && current_hit.t < closest_hit->t) {
-			*closest_hit = current_hit;
-			*hit_primitive = &current_scene.primitives[i];
+		// sweep from the left and from the right to get the cost of every split plane
+		float left_cost[BVH_BINS - 1];
+		Aabb left_bounds = aabb_empty();
+		int left_count = 0;
+		for (int b = 0; b < BVH_BINS - 1; ++b) {
+			left_bounds = aabb_union(left_bounds, bins[b].bounds);
+			left_count += bins[b].count;
+			left_cost[b] = left_count ? left_count * aabb_surface_area(left_bounds) : 0.0f;
+		}
+		Aabb right_bounds = aabb_empty();
+		int right_count = 0;
+		for (int b = BVH_BINS - 1; b > 0; --b) {
+			right_bounds = aabb_union(right_bounds, bins[b].bounds);
+			right_count += bins[b].count;
+			float right_cost = right_count ? right_count * aabb_surface_area(right_bounds) : 0.0f;
+			float cost = left_cost[b - 1] + right_cost;
+			if (right_count > 0 && right_count < node->count && cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b - 1;
+			}
 		}
 	}
+	if (best_axis == -1) return; // centroids are identical, keep all primitives in one leaf
 
-	return (*hit_primitive != NULL);
-}
+	// compare against the cost of not splitting at all. Both costs are scaled by the node area.
+	float parent_area = aabb_surface_area(node->bounds);
+	float split_cost = BVH_TRAVERSAL_COST * parent_area + BVH_INTERSECTION_COST * best_cost;
+	float leaf_cost = BVH_INTERSECTION_COST * node->count * parent_area;
+	if (split_cost >= leaf_cost && node->count <= BVH_MAX_LEAF_SIZE) return;
 
-// srgb response curve (4.1.9)
-float linear_to_srgb(float v) {
-	return (v <= 0.0031308f) ? (12.92f * v) : (1.055f * powf(v, 0.416666667f) - 0.055f);
-}
-Vec vec_linear_to_srgb(Vec v) {
-	return (Vec){linear_to_srgb(v.x), linear_to_srgb(v.y), linear_to_srgb(v.z)};
+	// partition the primitives in place
+	float axis_min = vec_axis(centroid_bounds.min, best_axis);
+	float bin_scale = BVH_BINS / (vec_axis(centroid_bounds.max, best_axis) - axis_min);
+	int i = 0, j = node->count - 1;
+	while (i <= j) {
+		if (bvh_bin_index(centroids[indices[i]], best_axis, axis_min, bin_scale) <= best_split) {
+			i++;
+		} else {
+			int tmp = indices[i];
+			indices[i] = indices[j];
+			indices[j--] = tmp;
+		}
+	}
+	if (i == 0 || i == node->count) return; // should not happen, but never create empty nodes
+
+	int left_index = bvh->node_count++;
+	int right_index = bvh->node_count++;
+	bvh->nodes[left_index] = (BvhNode){.left_first = node->left_first, .count = i};
+	bvh->nodes[right_index] = (BvhNode){.left_first = node->left_first + i, .count = node->count - i};
+	node->left_first = left_index;
+	node->count = 0;
+
+	bvh_subdivide(bvh, left_index, prim_bounds, centroids, depth + 1);
+	bvh_subdivide(bvh, right_index, prim_bounds, centroids, depth + 1);
 }
 
-// for tone mapping we convert our color values to a single luminance value to combat
-// the problem of washing out our image described in 4.2.5
-float luminance(Vec rgb) {
-	return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+void bvh_free(Bvh* bvh) {
+	free(bvh->nodes);
+	free(bvh->prim_indices);
+	*bvh = (Bvh){0};
 }
-// simple reinhard tone mapping operator based on luminance
-Vec reinhard_luminance(Vec rgb_hdr) {
-	float l_hdr = luminance(rgb_hdr);
-	if (l_hdr <= 0.0f) return (Vec){0}; // Handle black so we don't divide by 0
-	float l_ldr = l_hdr / (1.0f + l_hdr);
-	Vec v = vec_scale(rgb_hdr, l_ldr / l_hdr);
-	return (Vec){fminf(v.x, 1.0f), fminf(v.y, 1.0f), fminf(v.z, 1.0f)};
+
+// Builds a BVH over arbitrary primitives, described only by their bounding boxes.
+void bvh_build(Bvh* bvh, const Aabb* prim_bounds, int prim_count) {
+	bvh_free(bvh);
+	if (prim_count <= 0) return;
+
+	// a binary tree with n leaves has at most 2n - 1 nodes
+	bvh->nodes = malloc((2 * prim_count - 1) * sizeof(BvhNode));
+	bvh->prim_indices = malloc(prim_count * sizeof(int));
+	Vec* centroids = malloc(prim_count * sizeof(Vec));
+	for (int i = 0; i < prim_count; ++i) {
+		bvh->prim_indices[i] = i;
+		centroids[i] = aabb_center(prim_bounds[i]);
+	}
+
+	bvh->nodes[0] = (BvhNode){.left_first = 0, .count = prim_count};
+	bvh->node_count = 1;
+	bvh_subdivide(bvh, 0, prim_bounds, centroids, 1);
+	free(centroids);
 }
-// 0-1 to 0-255
-uint8_t quantize(float v) {
-	v = (v < 0.0f) ? 0.0f : (v > 1.0f) ? 1.0f : v; // clamp 0 1
-	return (uint8_t)(v * 255.999f);
+
+// Expected cost of tracing a random ray that hits the root, with the same costs as the builders
+float bvh_sah_cost(const Bvh* bvh) {
+	if (bvh->node_count == 0) return 0.0f;
+	float cost = 0.0f;
+	for (int i = 0; i < bvh->node_count; ++i) {
+		const BvhNode* node = &bvh->nodes[i];
+		float area = aabb_surface_area(node->bounds);
+		cost += node->count > 0 ? BVH_INTERSECTION_COST * node->count * area
+								: BVH_TRAVERSAL_COST * area;
+	}
+	return cost / aabb_surface_area(bvh->nodes[0].bounds);
 }
 
-void initialize_buffers() {
-	// (Re)allocate buffer if dimensions change or not allocated yet
-	if (image_buffer_ldr == NULL || image_buffer_hdr == NULL ||
-		summed_weighted_radiance_buffer == NULL || summed_weights_buffer == NULL ||
-		rng_buffer == NULL || width != buffer_width || height != buffer_height) {
+// Recomputes the bounds of all nodes after the primitives moved, keeping the topology. Works like
+// the LBVH bottom up pass: a thread is started at every leaf, the first one to arrive at a node
+// terminates and the second one processes it, so both children are complete.
+void bvh_refit(Bvh* bvh, const Aabb* prim_bounds) {
+	if (bvh->node_count == 0) return;
+	int* parents = malloc(bvh->node_count * sizeof(int));
+	int* visit_counters = calloc(bvh->node_count, sizeof(int));
+	parents[0] = -1;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < bvh->node_count; ++i) {
+		const BvhNode* node = &bvh->nodes[i];
+		if (node->count > 0) continue;
+		parents[node->left_first] = i;
+		parents[node->left_first + 1] = i;
+	}
 
-		if (image_buffer_ldr != NULL) { free(image_buffer_ldr); }
-		if (image_buffer_hdr != NULL) { free(image_buffer_hdr); }
-		if (summed_weighted_radiance_buffer != NULL) { free(summed_weighted_radiance_buffer); }
-		if (summed_weights_buffer != NULL) { free(summed_weights_buffer); }
-		if (rng_buffer) free(rng_buffer);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < bvh->node_count; ++i) {
+		BvhNode* leaf = &bvh->nodes[i];
+		if (leaf->count == 0) continue;
+		leaf->bounds = aabb_empty();
+		for (int j = 0; j < leaf->count; ++j) {
+			int prim_index = bvh->prim_indices[leaf->left_first + j];
+			leaf->bounds = aabb_union(leaf->bounds, prim_bounds[prim_index]);
+		}
+		int node = parents[i];
+		while (node >= 0) {
+			int visits;
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic capture
+#endif
+			visits = visit_counters[node]++;
+			if (visits == 0) break;
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+			BvhNode* interior = &bvh->nodes[node];
+			interior->bounds = aabb_union(bvh->nodes[interior->left_first].bounds,
+										  bvh->nodes[interior->left_first + 1].bounds);
+			node = parents[node];
+		}
+	}
+	free(parents);
+	free(visit_counters);
+}
 
-		summed_weighted_radiance_buffer = malloc(width * height * sizeof(DVec));
-		summed_weights_buffer = malloc(width * height * sizeof(double));
-		image_buffer_ldr = malloc(width * height * 4 * sizeof(uint8_t));
-		image_buffer_hdr = malloc(width * height * 3 * sizeof(float));
-		rng_buffer = malloc(width * height * sizeof(pcg32_random_t));
+// spreads the lowest 10 bits of v so that there are two zero bits between each of them
+uint64_t morton_spread_10(uint64_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x30000ff;
+	v = (v | (v << 8)) & 0x300f00f;
+	v = (v | (v << 4)) & 0x30c30c3;
+	v = (v | (v << 2)) & 0x9249249;
+	return v;
+}
 
-		buffer_width = width;
-		buffer_height = height;
-	}
-	// write zeros in radiance buffers
-	// no need to clear image_buffers as they are overwritten every time they are requested
-	memset(summed_weighted_radiance_buffer, 0, width * height * sizeof(DVec));
-	memset(summed_weights_buffer, 0, width * height * sizeof(double));
+// spreads the lowest 21 bits of v so that there are two zero bits between each of them
+uint64_t morton_spread_21(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffULL;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
 }
 
-// 1D Box Filter
-float box_1d(float x) {
-	// half-open interval[-radius, radius). Ensures pixels on a boundary are not used for two
-	// pixels, although in praxis this doesn't make any difference.
-	return (x >= -BOX_RADIUS && x < BOX_RADIUS) ? 1.0f : 0.0f;
+// Interleaves the quantized coordinates of p (normalized to [0, 1]) into a 30-bit (10 bits per
+// axis) or 63-bit (21 bits per axis) Morton code.
+uint64_t morton_code(Vec p, int bits_per_axis) {
+	float scale = (float)((1 << bits_per_axis) - 1);
+	uint64_t x = (uint64_t)(fminf(fmaxf(p.x, 0.0f), 1.0f) * scale);
+	uint64_t y = (uint64_t)(fminf(fmaxf(p.y, 0.0f), 1.0f) * scale);
+	uint64_t z = (uint64_t)(fminf(fmaxf(p.z, 0.0f), 1.0f) * scale);
+	if (bits_per_axis == 10) {
+		return (morton_spread_10(x) << 2) | (morton_spread_10(y) << 1) | morton_spread_10(z);
+	}
+	return (morton_spread_21(x) << 2) | (morton_spread_21(y) << 1) | morton_spread_21(z);
 }
 
-// 1D Mitchell-Netravali filter function with B=1/3, C=1/3.
-// This filter is separable: W(x,y) = w(x) * w(y)
-// The support radius is strictly 2.0.
-float mitchell_1d(float x) {
-	x = fabsf(x);
-	if (x >= 2.0f) return 0.0f;
+// Stable LSD radix sort of key/value pairs, 8 bits per pass. Every thread histograms and scatters
+// one contiguous chunk of the input, so the passes are parallel but the order stays deterministic.
+void radix_sort_pairs(uint64_t* keys, int* values, int n, int key_bits) {
+	uint64_t* keys_tmp = malloc(n * sizeof(uint64_t));
+	int* values_tmp = malloc(n * sizeof(int));
+	uint64_t* keys_in = keys;
+	int* values_in = values;
 
-	// Hardcoded coefficients for B=1/3, C=1/3
-	// 0 <= x < 1: 1/6 * (7x^3 - 12x^2 + 16/3)
-	if (x < 1.0f) {
-		return (7.0f * x * x * x - 12.0f * x * x + 16.0f / 3.0f) * (1.0f / 6.0f);
+	int max_threads = 1;
+#ifdef _OPENMP
+	max_threads = omp_get_max_threads();
+#endif
+	size_t* histograms = malloc(max_threads * 256 * sizeof(size_t));
+
+	for (int shift = 0; shift < key_bits; shift += 8) {
+#ifdef _OPENMP
+#pragma omp parallel num_threads(max_threads)
+#endif
+		{
+			int thread = 0, threads = 1;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+			threads = omp_get_num_threads();
+#endif
+			int begin = (int)((int64_t)n * thread / threads);
+			int end = (int)((int64_t)n * (thread + 1) / threads);
+			size_t* histogram = &histograms[thread * 256];
+			memset(histogram, 0, 256 * sizeof(size_t));
+			for (int i = begin; i < end; ++i) { histogram[(keys_in[i] >> shift) & 0xff]++; }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+			{
+				// exclusive prefix sum in (digit, thread) order yields each thread's write offsets
+				size_t offset = 0;
+				for (int digit = 0; digit < 256; ++digit) {
+					for (int t = 0; t < threads; ++t) {
+						size_t count = histograms[t * 256 + digit];
+						histograms[t * 256 + digit] = offset;
+						offset += count;
+					}
+				}
+			}
+
+			for (int i = begin; i < end; ++i) {
+				size_t dst = histogram[(keys_in[i] >> shift) & 0xff]++;
+				keys_tmp[dst] = keys_in[i];
+				values_tmp[dst] = values_in[i];
+			}
+		}
+		uint64_t* swap_keys = keys_in;
+		keys_in = keys_tmp;
+		keys_tmp = swap_keys;
+		int* swap_values = values_in;
+		values_in = values_tmp;
+		values_tmp = swap_values;
 	}
-	// 1 <= x < 2: 1/6 * (-7/3x^3 + 12x^2 - 20x + 32/3)
-	else {
-		return ((-7.0f / 3.0f) * x * x * x + 12.0f * x * x - 20.0f * x + 32.0f / 3.0f) *
-			   (1.0f / 6.0f);
+
+	if (keys_in != keys) {
+		memcpy(keys, keys_in, n * sizeof(uint64_t));
+		memcpy(values, values_in, n * sizeof(int));
 	}
+	free(keys_in == keys ? keys_tmp : keys_in);
+	free(values_in == values ? values_tmp : values_in);
+	free(histograms);
 }
 
-// Calculates a weight based on the 2D Gaussian PDF.
-// This implements the formula: (1 / (2πσ²)) e^(-(x² + y²) / (2σ²))
-float gaussian_weight_2d(float offset_x, float offset_y, float sigma) {
-	float two_sigma_squared = 2.0f * sigma * sigma;
-	// normalization constant: (1 / (2πσ²))
-	float norm_const = 1.0f / ((float)M_PI * two_sigma_squared);
-	float r_squared = offset_x * offset_x + offset_y * offset_y;
-	return norm_const * expf(-r_squared / two_sigma_squared);
+// Length of the common prefix of the Morton codes of leaves i and j, or -1 if j is out of range.
+// Duplicate codes are made unique by appending the leaf index (Karras 2012, section 4).
+int lbvh_delta(const uint64_t* keys, int n, int i, int j) {
+	if (j < 0 || j >= n) return -1;
+	if (keys[i] == keys[j]) return 64 + __builtin_clz((unsigned int)(i ^ j));
+	return __builtin_clzll(keys[i] ^ keys[j]);
 }
 
-// Calculates the exact Fresnel reflectance amount using the dielectric Fresnel equations.
-// Determines how much light reflects vs. refracts.
-// `normal` must be flipped to point against the incident ray.
-// `ior_from` is the medium the ray is currently in, `ior_to` is the medium it is entering.
-float fresnel(Vec incident, Vec normal, float ior_from, float ior_to) {
-	// Normal opposes incident, so dot product is negative.
-	// -dot makes it positive. Clamp to 0.0f to avoid tiny precision errors.
-	float cos_i = fmaxf(0.0f, -vec_dot(incident, normal));
-	float eta = ior_from / ior_to;
-	// Snell's Law
-	float sin2_theta_t = eta * eta * (1.0f - cos_i * cos_i);
-	// total internal reflection
-	if (sin2_theta_t >= 1.0f) { return 1.0f; }
-
-	// Cosine of the transmitted angle
-	float cos_theta_t = sqrtf(fmaxf(0.0f, 1.0f - sin2_theta_t));
-	// Parallel (p) and perpendicular (s) polarization reflection components
-	float rs =
-		(ior_from * cos_i - ior_to * cos_theta_t) / (ior_from * cos_i + ior_to * cos_theta_t);
-	float rp =
-		(ior_from * cos_theta_t - ior_to * cos_i) / (ior_from * cos_theta_t + ior_to * cos_i);
-	// Unpolarized light assumes an equal mix of both polarizations
-	return (rs * rs + rp * rp) / 2.0f;
+// clang-format off
+Aabb lbvh_ref_bounds(const LbvhBuild* b, int ref) { return ref >= 0 ? b->nodes[ref].bounds : b->prim_bounds[b->sorted_prims[~ref]]; }
+float lbvh_ref_cost(const LbvhBuild* b, int ref) { return ref >= 0 ? b->nodes[ref].cost : BVH_INTERSECTION_COST * aabb_surface_area(lbvh_ref_bounds(b, ref)); }
+int lbvh_ref_prim_count(const LbvhBuild* b, int ref) { return ref >= 0 ? b->nodes[ref].prim_count : 1; }
+int lbvh_ref_output_count(const LbvhBuild* b, int ref) { return ref >= 0 ? b->nodes[ref].output_count : 1; }
+// clang-format on
+void lbvh_set_parent(LbvhBuild* b, int ref, int parent) {
+	if (ref >= 0) {
+		b->nodes[ref].parent = parent;
+	} else {
+		b->leaf_parents[~ref] = parent;
+	}
 }
 
-// Calculates the refraction direction using Snell's Law from 11.2.9
-// `normal` must be flipped to point AGAINST the incident ray.
-Vec refract(Vec incident, Vec normal, float ior_from, float ior_to) {
-	float eta = ior_from / ior_to;
-	float cos_i = fmaxf(0.0f, -vec_dot(incident, normal));
+// Finds the range of leaves covered by internal node i and the position where it is split
+// (Karras 2012, figure 4). Every internal node is independent, so they can be emitted in parallel.
+void lbvh_emit_internal_node(LbvhBuild* b, const uint64_t* keys, int n, int i) {
+	// direction of the range: towards the neighbor with the longer common prefix
+	int d = lbvh_delta(keys, n, i, i + 1) > lbvh_delta(keys, n, i, i - 1) ? 1 : -1;
 
-	float k = 1.0f - eta * eta * (1.0f - cos_i * cos_i);
+	// find the other end of the range with an exponential and then a binary search
+	int delta_min = lbvh_delta(keys, n, i, i - d);
+	int l_max = 2;
+	while (lbvh_delta(keys, n, i, i + l_max * d) > delta_min) { l_max *= 2; }
+	int l = 0;
+	for (int t = l_max / 2; t >= 1; t /= 2) {
+		if (lbvh_delta(keys, n, i, i + (l + t) * d) > delta_min) l += t;
+	}
+	int j = i + l * d;
 
-	assert(k >= 0.0f && "indicates total internal reflection happens, in which case the refract "
-						"function should not have been called");
-	// Floating-point safety fallback: If we slipped past the Fresnel TIR check due to float
-	// precision, do reflection to prevent NaNs.
-	if (k < 0.0f) { return reflect(incident, normal); }
+	// binary search for the split: the last leaf that shares more than delta_node bits with i
+	int delta_node = lbvh_delta(keys, n, i, j);
+	int s = 0;
+	for (int t = (l + 1) / 2;; t = (t + 1) / 2) {
+		if (lbvh_delta(keys, n, i, i + (s + t) * d) > delta_node) s += t;
+		if (t == 1) break;
+	}
+	int gamma = i + s * d + (d < 0 ? d : 0);
 
-	Vec refr_dir = vec_add(vec_scale(incident, eta), vec_scale(normal, eta * cos_i - sqrtf(k)));
-	return vec_normalize(refr_dir);
+	int first = d > 0 ? i : j, last = d > 0 ? j : i;
+	b->nodes[i].left = (first == gamma) ? ~gamma : gamma;
+	b->nodes[i].right = (last == gamma + 1) ? ~(gamma + 1) : gamma + 1;
+	lbvh_set_parent(b, b->nodes[i].left, i);
+	lbvh_set_parent(b, b->nodes[i].right, i);
 }
 
-// random float between 0.0 (inclusive) and 1.0 (exclusive)
-float random_float(pcg32_random_t* rng) {
-	// Shift out the bottom 8 bits to get a perfect 24-bit integer
-	// Multiply by 2^-24 (which is exactly 1.0f / 16777216.0f)
-	return (pcg32_random_r(rng) >> 8) * 0x1.0p-24f;
+// Recomputes an internal node from its children and decides whether the subtree is cheaper as a
+// single leaf, using the same SAH costs as the binned builder.
+void lbvh_update_node(LbvhBuild* b, int index) {
+	LbvhNode* node = &b->nodes[index];
+	node->bounds = aabb_union(lbvh_ref_bounds(b, node->left), lbvh_ref_bounds(b, node->right));
+	node->prim_count = lbvh_ref_prim_count(b, node->left) + lbvh_ref_prim_count(b, node->right);
+	float area = aabb_surface_area(node->bounds);
+	float split_cost = BVH_TRAVERSAL_COST * area + lbvh_ref_cost(b, node->left) +
+					   lbvh_ref_cost(b, node->right);
+	float leaf_cost = BVH_INTERSECTION_COST * node->prim_count * area;
+	node->collapse = node->prim_count <= BVH_MAX_LEAF_SIZE && leaf_cost <= split_cost;
+	node->cost = node->collapse ? leaf_cost : split_cost;
+	node->output_count = node->collapse ? 1
+										: 1 + lbvh_ref_output_count(b, node->left) +
+											  lbvh_ref_output_count(b, node->right);
 }
 
-// create orthonormal basis (local coordinate system) from a vector
-// 'n' is the normal vector, which will become the 'w' axis.
-void create_orthonormal_basis(Vec n, Vec* u, Vec* v, Vec* w) {
-	*w = n;
-	Vec a = (fabsf(w->x) > 0.9f) ? (Vec){0, 1, 0} : (Vec){1, 0, 0};
-	*v = vec_normalize(vec_cross(*w, a));
-	*u = vec_cross(*w, *v);
+// Recreates the treelet topology for leaf subset s from the optimal partitions, reusing the
+// treelet's internal nodes. Returns the reference of the subtree root.
+int lbvh_build_treelet(LbvhBuild* b, const int* leaves, const int* internals, int* next_internal,
+					   const int* partition, int s) {
+	if ((s & (s - 1)) == 0) {
+		int k = 0;
+		while (s != (1 << k)) { k++; }
+		return leaves[k];
+	}
+	int node = internals[(*next_internal)++];
+	int left = lbvh_build_treelet(b, leaves, internals, next_internal, partition, partition[s]);
+	int right = lbvh_build_treelet(b, leaves, internals, next_internal, partition, s ^ partition[s]);
+	b->nodes[node].left = left;
+	b->nodes[node].right = right;
+	lbvh_set_parent(b, left, node);
+	lbvh_set_parent(b, right, node);
+	lbvh_update_node(b, node);
+	return node;
 }
 
-// random direction on hemisphere with uniform distribution
-Vec sample_uniform_hemisphere(Vec normal, pcg32_random_t* rng) {
-	// Generate a random point on a unit sphere
-	float r1 = random_float(rng); // for z
-	float r2 = random_float(rng); // for phi
-
-	float z = 1.0f - 2.0f * r1;
+// Treelet restructuring (Karras & Aila 2013): forms a treelet of up to LBVH_TREELET_SIZE leaves
+// below root and replaces its topology with the one of lowest SAH cost, found by dynamic
+// programming over all subsets of the treelet leaves.
+void lbvh_restructure_treelet(LbvhBuild* b, int root) {
+	int leaves[LBVH_TREELET_SIZE] = {b->nodes[root].left, b->nodes[root].right};
+	int internals[LBVH_TREELET_SIZE - 1] = {root};
+	int leaf_count = 2, internal_count = 1;
+	// grow the treelet by expanding the leaf with the largest surface area
+	while (leaf_count < LBVH_TREELET_SIZE) {
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (int k = 0; k < leaf_count; ++k) {
+			if (leaves[k] < 0) continue; // primitives can't be expanded
+			float area = aabb_surface_area(b->nodes[leaves[k]].bounds);
+			if (area > largest_area) {
+				largest_area = area;
+				largest = k;
+			}
+		}
+		if (largest == -1) break;
+		int expanded = leaves[largest];
+		internals[internal_count++] = expanded;
+		leaves[largest] = b->nodes[expanded].left;
+		leaves[leaf_count++] = b->nodes[expanded].right;
+	}
+	if (leaf_count < 3) return; // only one possible topology
+
+	Aabb bounds[1 << LBVH_TREELET_SIZE];
+	float cost[1 << LBVH_TREELET_SIZE];
+	int prim_count[1 << LBVH_TREELET_SIZE], partition[1 << LBVH_TREELET_SIZE];
+	int full = (1 << leaf_count) - 1;
+	// subsets of s are always smaller than s, so ascending order processes them first
+	for (int s = 1; s <= full; ++s) {
+		int rest = s & (s - 1); // s without its lowest leaf
+		if (rest == 0) {
+			int k = 0;
+			while (s != (1 << k)) { k++; }
+			bounds[s] = lbvh_ref_bounds(b, leaves[k]);
+			prim_count[s] = lbvh_ref_prim_count(b, leaves[k]);
+			cost[s] = lbvh_ref_cost(b, leaves[k]);
+			continue;
+		}
+		bounds[s] = aabb_union(bounds[rest], bounds[s ^ rest]);
+		prim_count[s] = prim_count[rest] + prim_count[s ^ rest];
+		float area = aabb_surface_area(bounds[s]);
+
+		float best_cost = INFINITY;
+		int lowest = s & -s;
+		for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+			if (!(p & lowest)) continue; // visit each partition only once
+			float c = cost[p] + cost[s ^ p];
+			if (c < best_cost) {
+				best_cost = c;
+				partition[s] = p;
+			}
+		}
+		float split_cost = BVH_TRAVERSAL_COST * area + best_cost;
+		float leaf_cost = BVH_INTERSECTION_COST * prim_count[s] * area;
+		bool collapse = prim_count[s] <= BVH_MAX_LEAF_SIZE && leaf_cost <= split_cost;
+		cost[s] = collapse ? leaf_cost : split_cost;
+	}
+	if (cost[full] >= b->nodes[root].cost) return; // current topology is already optimal
+
+	int next_internal = 0;
+	lbvh_build_treelet(b, leaves, internals, &next_internal, partition, full);
+}
+
+// Computes bounds and costs from the leaves up. A thread is started at every leaf, the first one
+// to arrive at a node terminates and the second one processes it, so both children are complete.
+void lbvh_bottom_up(LbvhBuild* b, int n, bool restructure) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < n; ++i) {
+		int node = b->leaf_parents[i];
+		while (node >= 0) {
+			int visits;
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic capture
+#endif
+			visits = b->visit_counters[node]++;
+			if (visits == 0) break;
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+			lbvh_update_node(b, node);
+			if (restructure && b->nodes[node].prim_count >= LBVH_TREELET_SIZE) {
+				lbvh_restructure_treelet(b, node);
+			}
+			node = b->nodes[node].parent;
+		}
+	}
+}
+
+// Writes the primitives of a subtree to out in depth-first order, returns their count
+int lbvh_gather_prims(const LbvhBuild* b, int ref, int* out) {
+	if (ref < 0) {
+		*out = b->sorted_prims[~ref];
+		return 1;
+	}
+	int count = lbvh_gather_prims(b, b->nodes[ref].left, out);
+	return count + lbvh_gather_prims(b, b->nodes[ref].right, out + count);
+}
+
+// Converts the radix tree into the Bvh layout, where siblings are stored next to each other. The
+// output positions follow from the subtree sizes: a subtree's children are stored at child_offset,
+// followed by all descendants of the left child, followed by all descendants of the right child.
+void lbvh_emit_node(const LbvhBuild* b, Bvh* bvh, int ref, int out_index, int child_offset,
+					int prim_offset) {
+	BvhNode* out = &bvh->nodes[out_index];
+	if (ref < 0 || b->nodes[ref].collapse) {
+		out->bounds = lbvh_ref_bounds(b, ref);
+		out->left_first = prim_offset;
+		out->count = lbvh_gather_prims(b, ref, &bvh->prim_indices[prim_offset]);
+		return;
+	}
+	const LbvhNode* node = &b->nodes[ref];
+	*out = (BvhNode){.bounds = node->bounds, .left_first = child_offset, .count = 0};
+	int left_prims = lbvh_ref_prim_count(b, node->left);
+	int left_output = lbvh_ref_output_count(b, node->left);
+#ifdef _OPENMP
+#pragma omp task if (left_prims >= LBVH_TASK_MIN_PRIMS)
+#endif
+	lbvh_emit_node(b, bvh, node->left, child_offset, child_offset + 2, prim_offset);
+	lbvh_emit_node(b, bvh, node->right, child_offset + 1, child_offset + 1 + left_output,
+				   prim_offset + left_prims);
+}
+
+// Linear BVH build (Karras 2012): primitives are sorted along a Morton curve and the hierarchy is
+// derived from the sorted codes, with every step running in parallel. Optionally the tree is
+// refined with treelet restructuring, which recovers most of the SAH quality at a fraction of the
+// cost of a full SAH build.
+void bvh_build_lbvh(Bvh* bvh, const Aabb* prim_bounds, int prim_count, bool restructure) {
+	bvh_free(bvh);
+	if (prim_count <= 0) return;
+	bvh->nodes = malloc((2 * prim_count - 1) * sizeof(BvhNode));
+	bvh->prim_indices = malloc(prim_count * sizeof(int));
+	if (prim_count == 1) {
+		bvh->nodes[0] = (BvhNode){.bounds = prim_bounds[0], .left_first = 0, .count = 1};
+		bvh->prim_indices[0] = 0;
+		bvh->node_count = 1;
+		return;
+	}
+
+	// quantize the centroids relative to their bounds
+	float min_x = INFINITY, min_y = INFINITY, min_z = INFINITY;
+	float max_x = -INFINITY, max_y = -INFINITY, max_z = -INFINITY;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(min : min_x, min_y, min_z) reduction(max : max_x, max_y, max_z)
+#endif
+	for (int i = 0; i < prim_count; ++i) {
+		Vec c = aabb_center(prim_bounds[i]);
+		min_x = fminf(min_x, c.x), min_y = fminf(min_y, c.y), min_z = fminf(min_z, c.z);
+		max_x = fmaxf(max_x, c.x), max_y = fmaxf(max_y, c.y), max_z = fmaxf(max_z, c.z);
+	}
+	Vec origin = {min_x, min_y, min_z};
+	Vec extent = {max_x - min_x, max_y - min_y, max_z - min_z};
+	Vec inv_extent = {extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+					  extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+					  extent.z > 0.0f ? 1.0f / extent.z : 0.0f};
+	int bits_per_axis = prim_count <= LBVH_MORTON_30_MAX_PRIMS ? 10 : 21;
+
+	uint64_t* keys = malloc(prim_count * sizeof(uint64_t));
+	int* sorted_prims = malloc(prim_count * sizeof(int));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < prim_count; ++i) {
+		Vec p = vec_hadamard_prod(vec_sub(aabb_center(prim_bounds[i]), origin), inv_extent);
+		keys[i] = morton_code(p, bits_per_axis);
+		sorted_prims[i] = i;
+	}
+	radix_sort_pairs(keys, sorted_prims, prim_count, 3 * bits_per_axis);
+
+	LbvhBuild b = {
+		.nodes = malloc((prim_count - 1) * sizeof(LbvhNode)),
+		.leaf_parents = malloc(prim_count * sizeof(int)),
+		.sorted_prims = sorted_prims,
+		.prim_bounds = prim_bounds,
+		.visit_counters = calloc(prim_count - 1, sizeof(int)),
+	};
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < prim_count - 1; ++i) { lbvh_emit_internal_node(&b, keys, prim_count, i); }
+	b.nodes[0].parent = -1;
+	lbvh_bottom_up(&b, prim_count, restructure);
+
+	bvh->node_count = b.nodes[0].output_count;
+#ifdef _OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+	lbvh_emit_node(&b, bvh, 0, 0, 1, 0);
+
+	free(keys);
+	free(sorted_prims);
+	free(b.nodes);
+	free(b.leaf_parents);
+	free(b.visit_counters);
+}
+
+// Gathers up to WIDE_BVH_WIDTH descendants of a binary node by repeatedly replacing the interior
+// node with the largest surface area by its children, and turns them into one wide node.
+int wide_bvh_collapse(WideBvh* wide, const Bvh* bvh, int binary_index) {
+	int children[WIDE_BVH_WIDTH];
+	int child_count = 0;
+	const BvhNode* binary = &bvh->nodes[binary_index];
+	if (binary->count > 0) {
+		children[child_count++] = binary_index; // only happens if the root is a leaf
+	} else {
+		children[child_count++] = binary->left_first;
+		children[child_count++] = binary->left_first + 1;
+	}
+	while (child_count < WIDE_BVH_WIDTH) {
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (int i = 0; i < child_count; ++i) {
+			const BvhNode* child = &bvh->nodes[children[i]];
+			if (child->count > 0) continue;
+			float area = aabb_surface_area(child->bounds);
+			if (area > largest_area) {
+				largest_area = area;
+				largest = i;
+			}
+		}
+		if (largest == -1) break;
+		int expanded = children[largest];
+		children[largest] = bvh->nodes[expanded].left_first;
+		children[child_count++] = bvh->nodes[expanded].left_first + 1;
+	}
+
+	int wide_index = wide->node_count++;
+	for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+		Aabb bounds = aabb_empty();
+		int child = -1, count = 0;
+		if (i < child_count) {
+			const BvhNode* node = &bvh->nodes[children[i]];
+			bounds = node->bounds;
+			count = node->count;
+			child = count > 0 ? node->left_first : wide_bvh_collapse(wide, bvh, children[i]);
+		}
+		WideBvhNode* out = &wide->nodes[wide_index]; // may not be held across the recursion
+		out->min_x[i] = bounds.min.x, out->min_y[i] = bounds.min.y, out->min_z[i] = bounds.min.z;
+		out->max_x[i] = bounds.max.x, out->max_y[i] = bounds.max.y, out->max_z[i] = bounds.max.z;
+		out->child[i] = child;
+		out->count[i] = count;
+	}
+	return wide_index;
+}
+
+void wide_bvh_free(WideBvh* wide) {
+	free(wide->nodes);
+	*wide = (WideBvh){0};
+}
+
+void wide_bvh_build(WideBvh* wide, const Bvh* bvh) {
+	wide_bvh_free(wide);
+	if (bvh->node_count == 0) return;
+	wide->nodes = malloc(bvh->node_count * sizeof(WideBvhNode)); // upper bound
+	wide_bvh_collapse(wide, bvh, 0);
+}
+
+// Slab test of one ray against all children of a wide node, same semantics as intersect_aabb. The
+// fixed width loops are written branch free over the structure of arrays layout, so the compiler
+// turns every line into one SIMD instruction (SSE, AVX, NEON or SIMD128). Returns a bitmask of the
+// hit children, their entry distances are written to t_enter.
+int wide_bvh_intersect_children(const WideBvhNode* node, Vec origin, Vec inv_dir, float t_max,
+								float* t_enter) {
+	float t_exit[WIDE_BVH_WIDTH];
+	for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+		float tx1 = (node->min_x[i] - origin.x) * inv_dir.x;
+		float tx2 = (node->max_x[i] - origin.x) * inv_dir.x;
+		float ty1 = (node->min_y[i] - origin.y) * inv_dir.y;
+		float ty2 = (node->max_y[i] - origin.y) * inv_dir.y;
+		float tz1 = (node->min_z[i] - origin.z) * inv_dir.z;
+		float tz2 = (node->max_z[i] - origin.z) * inv_dir.z;
+		float enter = max_float(min_float(tx1, tx2), -INFINITY);
+		float exit = min_float(max_float(tx1, tx2), t_max);
+		enter = max_float(min_float(ty1, ty2), enter);
+		exit = min_float(max_float(ty1, ty2), exit);
+		enter = max_float(min_float(tz1, tz2), enter);
+		exit = min_float(max_float(tz1, tz2), exit);
+		t_enter[i] = enter;
+		t_exit[i] = exit;
+	}
+	int mask = 0;
+	for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+		// empty slots have inverted bounds, which produce an infinite slab instead of a miss
+		mask |= (t_exit[i] >= t_enter[i] && t_exit[i] > 0.0f && node->child[i] >= 0) << i;
+	}
+	return mask;
+}
+
+void compiled_scene_free(CompiledScene* compiled) {
+	// all float arrays of a shape type share one allocation
+	free(compiled->spheres.center_x);
+	free(compiled->spheres.material);
+	free(compiled->triangles.v0_x);
+	free(compiled->triangles.material);
+	free(compiled->materials);
+	free(compiled->sphere_offset);
+	*compiled = (CompiledScene){0};
+}
+
+// Returns the index of the material, adds it if it's not there yet. A linear search is fine for
+// the few distinct materials of a scene, and undetected duplicates (padding) only cost memory.
+int compile_material(CompiledScene* compiled, const Material* material) {
+	for (int i = 0; i < compiled->material_count; ++i) {
+		if (memcmp(&compiled->materials[i], material, sizeof(Material)) == 0) return i;
+	}
+	compiled->materials[compiled->material_count] = *material;
+	return compiled->material_count++;
+}
+
+// Writes the geometry of the primitives to the compiled arrays. Their layout only depends on the
+// BVH's primitive order, so this also updates moved primitives in place after a refit.
+void compile_scene_shapes(CompiledScene* compiled, const Scene* scene, const Bvh* bvh) {
+	SphereArrays* spheres = &compiled->spheres;
+	TriangleArrays* triangles = &compiled->triangles;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < scene->size; ++i) {
+		const Primitive* prim = &scene->primitives[bvh->prim_indices[i]];
+		switch (prim->shape.type) {
+		case SPHERE: {
+			const Sphere* sphere = &prim->shape.data.sphere;
+			int j = compiled->sphere_offset[i];
+			spheres->center_x[j] = sphere->center.x;
+			spheres->center_y[j] = sphere->center.y;
+			spheres->center_z[j] = sphere->center.z;
+			spheres->radius[j] = sphere->radius;
+			break;
+		}
+		case TRIANGLE: {
+			const Triangle* tri = &prim->shape.data.triangle;
+			int j = i - compiled->sphere_offset[i];
+			triangles->v0_x[j] = tri->v0.x, triangles->v0_y[j] = tri->v0.y;
+			triangles->v0_z[j] = tri->v0.z;
+			triangles->v1_x[j] = tri->v1.x, triangles->v1_y[j] = tri->v1.y;
+			triangles->v1_z[j] = tri->v1.z;
+			triangles->v2_x[j] = tri->v2.x, triangles->v2_y[j] = tri->v2.y;
+			triangles->v2_z[j] = tri->v2.z;
+			triangles->min_determinant[j] = tri->one_sided ? 0.0f : -INFINITY;
+			triangles->normal_x[j] = tri->normal.x, triangles->normal_y[j] = tri->normal.y;
+			triangles->normal_z[j] = tri->normal.z;
+			break;
+		}
+		}
+	}
+}
+
+void compile_scene(CompiledScene* compiled, const Scene* scene, const Bvh* bvh) {
+	compiled_scene_free(compiled);
+	int sphere_count = 0;
+	for (int i = 0; i < scene->size; ++i) sphere_count += scene->primitives[i].shape.type == SPHERE;
+	int triangle_count = scene->size - sphere_count;
+
+	// the batched kernels read up to BATCH_SIZE - 1 elements past the end, padding is zeroed
+	int sphere_stride = sphere_count + BATCH_SIZE - 1;
+	SphereArrays* spheres = &compiled->spheres;
+	float* sphere_data = calloc(4 * sphere_stride, sizeof(float));
+	spheres->center_x = sphere_data;
+	spheres->center_y = sphere_data + sphere_stride;
+	spheres->center_z = sphere_data + 2 * sphere_stride;
+	spheres->radius = sphere_data + 3 * sphere_stride;
+	spheres->material = malloc(sphere_count * sizeof(int));
+
+	int triangle_stride = triangle_count + BATCH_SIZE - 1;
+	TriangleArrays* triangles = &compiled->triangles;
+	float* triangle_data = calloc(13 * triangle_stride, sizeof(float));
+	float** triangle_arrays[13] = {
+		&triangles->v0_x,	  &triangles->v0_y,	  &triangles->v0_z,
+		&triangles->v1_x,	  &triangles->v1_y,	  &triangles->v1_z,
+		&triangles->v2_x,	  &triangles->v2_y,	  &triangles->v2_z,
+		&triangles->min_determinant,
+		&triangles->normal_x, &triangles->normal_y, &triangles->normal_z,
+	};
+	for (int i = 0; i < 13; ++i) *triangle_arrays[i] = triangle_data + i * triangle_stride;
+	triangles->material = malloc(triangle_count * sizeof(int));
+
+	compiled->materials = malloc(scene->size * sizeof(Material)); // upper bound
+	compiled->sphere_offset = malloc((scene->size + 1) * sizeof(int));
+
+	for (int i = 0; i < scene->size; ++i) {
+		compiled->sphere_offset[i] = spheres->count;
+		const Primitive* prim = &scene->primitives[bvh->prim_indices[i]];
+		int material = compile_material(compiled, &prim->material);
+		if (prim->shape.type == SPHERE) {
+			spheres->material[spheres->count++] = material;
+		} else {
+			triangles->material[triangles->count++] = material;
+		}
+	}
+	compiled->sphere_offset[scene->size] = spheres->count;
+	compile_scene_shapes(compiled, scene, bvh);
+}
+
+// Returns the number of nodes on the longest path from the root to a leaf
+int bvh_depth(const Bvh* bvh) {
+	if (bvh->node_count == 0) return 0;
+	struct { int node; int depth; }* stack = malloc(bvh->node_count * sizeof(*stack));
+	stack[0].node = 0, stack[0].depth = 1;
+	int stack_size = 1;
+	int max_depth = 0;
+	while (stack_size > 0) {
+		--stack_size;
+		const BvhNode* node = &bvh->nodes[stack[stack_size].node];
+		int depth = stack[stack_size].depth;
+		if (node->count > 0) {
+			if (depth > max_depth) max_depth = depth;
+			continue;
+		}
+		// every node is pushed once, so the stack never holds more than node_count entries
+		stack[stack_size].node = node->left_first, stack[stack_size++].depth = depth + 1;
+		stack[stack_size].node = node->left_first + 1, stack[stack_size++].depth = depth + 1;
+	}
+	free(stack);
+	return max_depth;
+}
+
+// Builds a BVH over the primitive bounds with the given builder. The traversal stacks hold
+// BVH_STACK_SIZE nodes, so LBVH trees that are too deep for them (many clustered primitives on a
+// long Morton code prefix) are replaced by a SAH build, which limits its depth.
+void build_bvh(BvhBuilder builder, Bvh* bvh, const Aabb* prim_bounds, int prim_count) {
+	switch (builder) {
+	case BVH_BUILDER_LBVH: bvh_build_lbvh(bvh, prim_bounds, prim_count, false); break;
+	case BVH_BUILDER_LBVH_TREELET: bvh_build_lbvh(bvh, prim_bounds, prim_count, true); break;
+	default: bvh_build(bvh, prim_bounds, prim_count); return;
+	}
+	if (bvh_depth(bvh) >= BVH_STACK_SIZE) bvh_build(bvh, prim_bounds, prim_count);
+}
+
+void blas_free(Blas* blas) {
+	bvh_free(&blas->bvh);
+	wide_bvh_free(&blas->wide_bvh);
+	compiled_scene_free(&blas->compiled);
+	blas->prim_count = 0;
+}
+
+Aabb* mesh_prim_bounds(const Scene* mesh) {
+	Aabb* prim_bounds = malloc(mesh->size * sizeof(Aabb));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < mesh->size; ++i) prim_bounds[i] = primitive_bounds(&mesh->primitives[i]);
+	return prim_bounds;
+}
+
+void build_blas(Blas* blas, const Scene* mesh, BvhBuilder builder) {
+	Aabb* prim_bounds = mesh_prim_bounds(mesh);
+	build_bvh(builder, &blas->bvh, prim_bounds, mesh->size);
+	free(prim_bounds);
+	wide_bvh_build(&blas->wide_bvh, &blas->bvh);
+	compile_scene(&blas->compiled, mesh, &blas->bvh);
+	blas->prim_count = mesh->size;
+	blas->built_sah_cost = bvh_sah_cost(&blas->bvh);
+}
+
+// Updates the Blas after the primitives of the mesh moved (same primitives, same order). The BVH is
+// refitted, unless its SAH cost degraded too far compared to the last full build, then it is
+// rebuilt. Returns true if it was rebuilt.
+bool refit_blas(Blas* blas, const Scene* mesh, BvhBuilder builder) {
+	Aabb* prim_bounds = mesh_prim_bounds(mesh);
+	bvh_refit(&blas->bvh, prim_bounds);
+	free(prim_bounds);
+	if (bvh_sah_cost(&blas->bvh) > BVH_REFIT_MAX_COST_RATIO * blas->built_sah_cost) {
+		build_blas(blas, mesh, builder);
+		return true;
+	}
+	// the wide nodes store copies of the binary bounds, collapsing again is cheap compared to the
+	// refit and may choose better children for the new bounds
+	wide_bvh_build(&blas->wide_bvh, &blas->bvh);
+	compile_scene_shapes(&blas->compiled, mesh, &blas->bvh);
+	return false;
+}
+
+void build_scene_bvh(TracyContext* ctx) {
+	build_blas(&ctx->scene_blas, &ctx->current_scene, ctx->bvh_builder);
+}
+
+bool refit_scene_bvh(TracyContext* ctx) {
+	return refit_blas(&ctx->scene_blas, &ctx->current_scene, ctx->bvh_builder);
+}
+
+void mesh_bvhs_free(TracyContext* ctx) {
+	for (int i = 0; i < ctx->mesh_blas_count; ++i) blas_free(&ctx->mesh_blas[i]);
+	free(ctx->mesh_blas);
+	ctx->mesh_blas = NULL;
+	ctx->mesh_blas_count = 0;
+}
+
+void build_mesh_bvhs(TracyContext* ctx) {
+	mesh_bvhs_free(ctx);
+	ctx->mesh_blas_count = ctx->current_instances.mesh_count;
+	ctx->mesh_blas = calloc(ctx->mesh_blas_count, sizeof(Blas));
+	for (int i = 0; i < ctx->mesh_blas_count; ++i) {
+		build_blas(&ctx->mesh_blas[i], &ctx->current_instances.meshes[i], ctx->bvh_builder);
+	}
+}
+
+void tlas_free(Tlas* tlas) {
+	bvh_free(&tlas->bvh);
+	free(tlas->instances);
+	*tlas = (Tlas){0};
+}
+
+// Builds the top level over the instances of current_instances. Only needs the bounds of the mesh
+// BVHs, so it is cheap compared to building the meshes and is redone whenever something moves.
+void build_scene_tlas(TracyContext* ctx) {
+	tlas_free(&ctx->scene_tlas);
+	int count = ctx->current_instances.instance_count;
+	if (count == 0) return;
+	ctx->scene_tlas.instances = malloc(count * sizeof(TlasInstance));
+	Aabb* instance_bounds = malloc(count * sizeof(Aabb));
+	for (int i = 0; i < count; ++i) {
+		const Instance* instance = &ctx->current_instances.instances[i];
+		const Blas* mesh = &ctx->mesh_blas[instance->mesh];
+		TlasInstance* tlas_instance = &ctx->scene_tlas.instances[i];
+		tlas_instance->world_to_object = transform_inverse(&instance->object_to_world);
+		tlas_instance->mesh = instance->mesh;
+		const Transform* t = &instance->object_to_world;
+		instance_bounds[i] =
+			mesh->prim_count > 0 ? transform_aabb(t, mesh->bvh.nodes[0].bounds) : aabb_empty();
+	}
+	build_bvh(ctx->bvh_builder, &ctx->scene_tlas.bvh, instance_bounds, count);
+	ctx->scene_tlas.instance_count = count;
+	free(instance_bounds);
+}
+
+// Tests the spheres and triangles of a leaf, each with a batched kernel over type-homogeneous arrays
+void intersect_leaf(const Blas* blas, const Ray* r, int first, int count,
+					HitCandidate* closest_hit) {
+	const CompiledScene* compiled = &blas->compiled;
+	int sphere_begin = compiled->sphere_offset[first];
+	int sphere_end = compiled->sphere_offset[first + count];
+	hit_test_spheres(r, &compiled->spheres, sphere_begin, sphere_end, closest_hit);
+	// all other primitives of the leaf are triangles
+	hit_test_triangles(r, &compiled->triangles, first - sphere_begin, first + count - sphere_end,
+					   closest_hit);
+}
+
+// Finds the closest hit by traversing the binary BVH front to back. Children are visited nearest
+// first and the entry distance of the farther child is kept on the stack, so that it can be skipped
+// once a closer hit has been found.
+bool intersect_bvh(const Blas* blas, const Ray* r, HitCandidate* closest_hit) {
+	const BvhNode* nodes = blas->bvh.nodes;
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+	if (intersect_aabb(r->origin, inv_dir, &nodes[0].bounds, closest_hit->t) == INFINITY) {
+		return false;
+	}
+
+	struct { int node; float t; } stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+	while (true) {
+		const BvhNode* node = &nodes[node_index];
+		if (node->count > 0) {
+			intersect_leaf(blas, r, node->left_first, node->count, closest_hit);
+		} else {
+			int near = node->left_first, far = node->left_first + 1;
+			float t_near = intersect_aabb(r->origin, inv_dir, &nodes[near].bounds, closest_hit->t);
+			float t_far = intersect_aabb(r->origin, inv_dir, &nodes[far].bounds, closest_hit->t);
+			if (t_far < t_near) {
+				int tmp_index = near;
+				near = far;
+				far = tmp_index;
+				float tmp_t = t_near;
+				t_near = t_far;
+				t_far = tmp_t;
+			}
+			if (t_near != INFINITY) {
+				if (t_far != INFINITY) {
+					assert(stack_size < BVH_STACK_SIZE);
+					stack[stack_size].node = far;
+					stack[stack_size++].t = t_far;
+				}
+				node_index = near;
+				continue;
+			}
+		}
+
+		// pop the next node that may still contain a closer hit
+		do {
+			if (stack_size == 0) return closest_hit->t != INFINITY;
+			--stack_size;
+		} while (stack[stack_size].t >= closest_hit->t);
+		node_index = stack[stack_size].node;
+	}
+}
+
+// Same as intersect_bvh, but on the wide BVH: all children of a node are tested at once and the hit
+// ones are pushed farthest first, so the nearest child is processed next.
+bool intersect_wide_bvh(const Blas* blas, const Ray* r, HitCandidate* closest_hit) {
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+
+	// leaves are pushed too (count > 0), so their primitives are also tested front to back
+	struct { int child; int count; float t; } stack[BVH_STACK_SIZE * WIDE_BVH_WIDTH];
+	stack[0].child = 0, stack[0].count = 0, stack[0].t = -INFINITY; // root
+	int stack_size = 1;
+	while (stack_size > 0) {
+		--stack_size;
+		if (stack[stack_size].t >= closest_hit->t) continue;
+		int child = stack[stack_size].child, count = stack[stack_size].count;
+		if (count > 0) {
+			intersect_leaf(blas, r, child, count, closest_hit);
+			continue;
+		}
+
+		const WideBvhNode* node = &blas->wide_bvh.nodes[child];
+		float t_enter[WIDE_BVH_WIDTH];
+		int mask = wide_bvh_intersect_children(node, r->origin, inv_dir, closest_hit->t, t_enter);
+		// insertion sort of the hit children by descending distance directly onto the stack
+		int first = stack_size;
+		for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			if (!(mask & (1 << i))) continue;
+			int j = stack_size++;
+			assert(stack_size <= BVH_STACK_SIZE * WIDE_BVH_WIDTH);
+			while (j > first && stack[j - 1].t < t_enter[i]) {
+				stack[j] = stack[j - 1];
+				--j;
+			}
+			stack[j].child = node->child[i];
+			stack[j].count = node->count[i];
+			stack[j].t = t_enter[i];
+		}
+	}
+	return closest_hit->t != INFINITY;
+}
+
+// Closest hit in one mesh, only hits closer than closest_hit->t are accepted
+void intersect_blas(const TracyContext* ctx, const Blas* blas, const Ray* r,
+					HitCandidate* closest_hit) {
+	if (blas->prim_count == 0) return;
+	if (blas->prim_count <= BRUTE_FORCE_MAX_PRIMS) {
+		intersect_leaf(blas, r, 0, blas->prim_count, closest_hit);
+	} else if (ctx->use_wide_bvh) {
+		intersect_wide_bvh(blas, r, closest_hit);
+	} else {
+		intersect_bvh(blas, r, closest_hit);
+	}
+}
+
+// The ray in the object space of an instance. The direction is not normalized, so the ray
+// parameter t is the same in both spaces and distances can be compared across instances.
+Ray instance_ray(const Ray* r, const TlasInstance* instance) {
+	return (Ray){transform_point(&instance->world_to_object, r->origin),
+				 transform_vector(&instance->world_to_object, r->dir)};
+}
+
+void intersect_instances(const TracyContext* ctx, const Ray* r, int first, int count,
+						 HitCandidate* closest_hit) {
+	for (int i = first; i < first + count; ++i) {
+		int instance_index = ctx->scene_tlas.bvh.prim_indices[i];
+		const TlasInstance* instance = &ctx->scene_tlas.instances[instance_index];
+		Ray object_ray = instance_ray(r, instance);
+		float t = closest_hit->t;
+		intersect_blas(ctx, &ctx->mesh_blas[instance->mesh], &object_ray, closest_hit);
+		if (closest_hit->t < t) closest_hit->instance = instance_index;
+	}
+}
+
+// Closest hit over all instances: the top level BVH is traversed front to back, at its leaves the
+// ray is transformed into the object space of each instance and traverses the instance's mesh BVH.
+void intersect_tlas(const TracyContext* ctx, const Ray* r, HitCandidate* closest_hit) {
+	const BvhNode* nodes = ctx->scene_tlas.bvh.nodes;
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+	struct { int node; float t; } stack[BVH_STACK_SIZE];
+	stack[0].node = 0;
+	stack[0].t = intersect_aabb(r->origin, inv_dir, &nodes[0].bounds, closest_hit->t);
+	int stack_size = stack[0].t != INFINITY;
+	while (stack_size > 0) {
+		--stack_size;
+		if (stack[stack_size].t >= closest_hit->t) continue;
+		const BvhNode* node = &nodes[stack[stack_size].node];
+		if (node->count > 0) {
+			intersect_instances(ctx, r, node->left_first, node->count, closest_hit);
+			continue;
+		}
+		int near = node->left_first, far = node->left_first + 1;
+		float t_near = intersect_aabb(r->origin, inv_dir, &nodes[near].bounds, closest_hit->t);
+		float t_far = intersect_aabb(r->origin, inv_dir, &nodes[far].bounds, closest_hit->t);
+		if (t_far < t_near) {
+			int tmp_index = near;
+			near = far;
+			far = tmp_index;
+			float tmp_t = t_near;
+			t_near = t_far;
+			t_far = tmp_t;
+		}
+		// the near child is pushed last, so it is processed next
+		assert(stack_size + 2 <= BVH_STACK_SIZE);
+		if (t_far != INFINITY) stack[stack_size].node = far, stack[stack_size++].t = t_far;
+		if (t_near != INFINITY) stack[stack_size].node = near, stack[stack_size++].t = t_near;
+	}
+}
+
+bool intersect_scene(const TracyContext* ctx, const Ray* r, HitInfo* closest_hit,
+					 const Material** material) {
+	HitCandidate candidate = {.t = INFINITY, .instance = -1};
+	closest_hit->t = INFINITY;
+	*material = NULL;
+	intersect_blas(ctx, &ctx->scene_blas, r, &candidate);
+	if (ctx->scene_tlas.instance_count > 0) intersect_tlas(ctx, r, &candidate);
+	if (candidate.t == INFINITY) return false;
+
+	// the hit is reconstructed in the space of the mesh that was hit
+	const Blas* blas = &ctx->scene_blas;
+	const TlasInstance* instance = NULL;
+	Ray object_ray = *r;
+	if (candidate.instance >= 0) {
+		instance = &ctx->scene_tlas.instances[candidate.instance];
+		blas = &ctx->mesh_blas[instance->mesh];
+		object_ray = instance_ray(r, instance);
+	}
+	int i = candidate.index;
+	if (candidate.type == SPHERE) {
+		const SphereArrays* spheres = &blas->compiled.spheres;
+		Vec center = vec_load(spheres->center_x, spheres->center_y, spheres->center_z, i);
+		finalize_sphere_hit(&object_ray, center, &candidate, closest_hit);
+		*material = &blas->compiled.materials[spheres->material[i]];
+	} else {
+		const TriangleArrays* triangles = &blas->compiled.triangles;
+		Vec normal = vec_load(triangles->normal_x, triangles->normal_y, triangles->normal_z, i);
+		finalize_triangle_hit(&object_ray, normal, &candidate, closest_hit);
+		*material = &blas->compiled.materials[triangles->material[i]];
+	}
+	closest_hit->light = -1;
+	if (candidate.type == TRIANGLE && instance == NULL && ctx->lights.count > 0) {
+		closest_hit->light = ctx->lights.triangle_lights[i];
+	}
+	if (instance != NULL) {
+		closest_hit->p = vec_add(r->origin, vec_scale(r->dir, candidate.t));
+		Vec n = transform_normal(&instance->world_to_object, closest_hit->n);
+		closest_hit->n = vec_normalize(n);
+	}
+	return true;
+}
+
+bool occluded_leaf(const Blas* blas, const Ray* r, int first, int count, float t_max) {
+	const CompiledScene* compiled = &blas->compiled;
+	int sphere_begin = compiled->sphere_offset[first];
+	int sphere_end = compiled->sphere_offset[first + count];
+	HitCandidate hit = {.t = t_max};
+	return hit_test_spheres(r, &compiled->spheres, sphere_begin, sphere_end, &hit) ||
+		   hit_test_triangles(r, &compiled->triangles, first - sphere_begin,
+							  first + count - sphere_end, &hit);
+}
+
+// Any hit traversal of the binary BVH for shadow rays. Since every hit terminates the traversal,
+// children are not sorted by distance.
+bool occluded_bvh(const Blas* blas, const Ray* r, float t_max) {
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+	int stack[BVH_STACK_SIZE];
+	stack[0] = 0; // root
+	int stack_size = 1;
+	while (stack_size > 0) {
+		const BvhNode* node = &blas->bvh.nodes[stack[--stack_size]];
+		if (intersect_aabb(r->origin, inv_dir, &node->bounds, t_max) == INFINITY) continue;
+		if (node->count > 0) {
+			if (occluded_leaf(blas, r, node->left_first, node->count, t_max)) return true;
+		} else {
+			assert(stack_size + 2 <= BVH_STACK_SIZE);
+			stack[stack_size++] = node->left_first + 1;
+			stack[stack_size++] = node->left_first;
+		}
+	}
+	return false;
+}
+
+// Any hit traversal of the wide BVH, children are pushed in slot order
+bool occluded_wide_bvh(const Blas* blas, const Ray* r, float t_max) {
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+	int stack[BVH_STACK_SIZE * WIDE_BVH_WIDTH];
+	stack[0] = 0; // root
+	int stack_size = 1;
+	while (stack_size > 0) {
+		const WideBvhNode* node = &blas->wide_bvh.nodes[stack[--stack_size]];
+		float t_enter[WIDE_BVH_WIDTH];
+		int mask = wide_bvh_intersect_children(node, r->origin, inv_dir, t_max, t_enter);
+		for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			if (!(mask & (1 << i))) continue;
+			if (node->count[i] > 0) {
+				if (occluded_leaf(blas, r, node->child[i], node->count[i], t_max)) return true;
+			} else {
+				assert(stack_size < BVH_STACK_SIZE * WIDE_BVH_WIDTH);
+				stack[stack_size++] = node->child[i];
+			}
+		}
+	}
+	return false;
+}
+
+bool occluded_blas(const TracyContext* ctx, const Blas* blas, const Ray* r, float t_max) {
+	if (blas->prim_count == 0) return false;
+	if (blas->prim_count <= BRUTE_FORCE_MAX_PRIMS) {
+		return occluded_leaf(blas, r, 0, blas->prim_count, t_max);
+	}
+	if (ctx->use_wide_bvh) return occluded_wide_bvh(blas, r, t_max);
+	return occluded_bvh(blas, r, t_max);
+}
+
+// Any hit traversal of the top level BVH, see intersect_tlas
+bool occluded_tlas(const TracyContext* ctx, const Ray* r, float t_max) {
+	Vec inv_dir = {1.0f / r->dir.x, 1.0f / r->dir.y, 1.0f / r->dir.z};
+	int stack[BVH_STACK_SIZE];
+	stack[0] = 0; // root
+	int stack_size = 1;
+	while (stack_size > 0) {
+		const BvhNode* node = &ctx->scene_tlas.bvh.nodes[stack[--stack_size]];
+		if (intersect_aabb(r->origin, inv_dir, &node->bounds, t_max) == INFINITY) continue;
+		if (node->count == 0) {
+			assert(stack_size + 2 <= BVH_STACK_SIZE);
+			stack[stack_size++] = node->left_first + 1;
+			stack[stack_size++] = node->left_first;
+			continue;
+		}
+		for (int i = node->left_first; i < node->left_first + node->count; ++i) {
+			int instance_index = ctx->scene_tlas.bvh.prim_indices[i];
+			const TlasInstance* instance = &ctx->scene_tlas.instances[instance_index];
+			Ray object_ray = instance_ray(r, instance);
+			const Blas* mesh = &ctx->mesh_blas[instance->mesh];
+			if (occluded_blas(ctx, mesh, &object_ray, t_max)) return true;
+		}
+	}
+	return false;
+}
+
+// Visibility query for shadow and connection rays: returns true if anything is hit at a distance
+// below t_max. Stops at the first hit found and does not compute any hit information.
+bool occluded_scene(const TracyContext* ctx, const Ray* r, float t_max) {
+	if (occluded_blas(ctx, &ctx->scene_blas, r, t_max)) return true;
+	return ctx->scene_tlas.instance_count > 0 && occluded_tlas(ctx, r, t_max);
+}
+
+// srgb response curve (4.1.9)
+float linear_to_srgb(float v) {
+	return (v <= 0.0031308f) ? (12.92f * v) : (1.055f * powf(v, 0.416666667f) - 0.055f);
+}
+Vec vec_linear_to_srgb(Vec v) {
+	return (Vec){linear_to_srgb(v.x), linear_to_srgb(v.y), linear_to_srgb(v.z)};
+}
+
+// for tone mapping we convert our color values to a single luminance value to combat
+// the problem of washing out our image described in 4.2.5
+float luminance(Vec rgb) {
+	return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+// simple reinhard tone mapping operator based on luminance
+Vec reinhard_luminance(Vec rgb_hdr) {
+	float l_hdr = luminance(rgb_hdr);
+	if (l_hdr <= 0.0f) return (Vec){0}; // Handle black so we don't divide by 0
+	float l_ldr = l_hdr / (1.0f + l_hdr);
+	Vec v = vec_scale(rgb_hdr, l_ldr / l_hdr);
+	return (Vec){fminf(v.x, 1.0f), fminf(v.y, 1.0f), fminf(v.z, 1.0f)};
+}
+// 0-1 to 0-255
+uint8_t quantize(float v) {
+	v = (v < 0.0f) ? 0.0f : (v > 1.0f) ? 1.0f : v; // clamp 0 1
+	return (uint8_t)(v * 255.999f);
+}
+
+// Synchronization of the parallel sections that run on every threading backend. OpenMP pragmas
+// don't apply on the thread pool, so these use the locks and atomics of the compiler directly.
+void mutex_init(Mutex* mutex) {
+#ifdef TRACY_THREAD_POOL
+	pthread_mutex_init(mutex, NULL);
+#elif defined(_OPENMP)
+	omp_init_lock(mutex);
+#else
+	(void)mutex;
+#endif
+}
+
+void mutex_destroy(Mutex* mutex) {
+#ifdef TRACY_THREAD_POOL
+	pthread_mutex_destroy(mutex);
+#elif defined(_OPENMP)
+	omp_destroy_lock(mutex);
+#else
+	(void)mutex;
+#endif
+}
+
+void mutex_lock(Mutex* mutex) {
+#ifdef TRACY_THREAD_POOL
+	pthread_mutex_lock(mutex);
+#elif defined(_OPENMP)
+	omp_set_lock(mutex);
+#else
+	(void)mutex;
+#endif
+}
+
+void mutex_unlock(Mutex* mutex) {
+#ifdef TRACY_THREAD_POOL
+	pthread_mutex_unlock(mutex);
+#elif defined(_OPENMP)
+	omp_unset_lock(mutex);
+#else
+	(void)mutex;
+#endif
+}
+
+void condition_init(Condition* condition) {
+#ifdef TRACY_THREAD_POOL
+	pthread_cond_init(condition, NULL);
+#else
+	(void)condition;
+#endif
+}
+
+void condition_destroy(Condition* condition) {
+#ifdef TRACY_THREAD_POOL
+	pthread_cond_destroy(condition);
+#else
+	(void)condition;
+#endif
+}
+
+// Releases the mutex while waiting. May return early, so callers check their predicate in a loop.
+void condition_wait(Condition* condition, Mutex* mutex) {
+#ifdef TRACY_THREAD_POOL
+	pthread_cond_wait(condition, mutex);
+#elif defined(_OPENMP)
+	(void)condition;
+	mutex_unlock(mutex);
+	sched_yield();
+	mutex_lock(mutex);
+#else
+	(void)condition;
+	(void)mutex;
+#endif
+}
+
+void condition_broadcast(Condition* condition) {
+#ifdef TRACY_THREAD_POOL
+	pthread_cond_broadcast(condition);
+#else
+	(void)condition;
+#endif
+}
+
+int atomic_load_int(const int* value) {
+#if defined(TRACY_THREAD_POOL) || defined(_OPENMP)
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+	return *value;
+#endif
+}
+
+double monotonic_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+void atomic_store_int(int* value, int new_value) {
+#if defined(TRACY_THREAD_POOL) || defined(_OPENMP)
+	__atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#else
+	*value = new_value;
+#endif
+}
+
+// Returns the value before the addition
+int atomic_fetch_add_int(int* value, int addend) {
+#if defined(TRACY_THREAD_POOL) || defined(_OPENMP)
+	return __atomic_fetch_add(value, addend, __ATOMIC_ACQ_REL);
+#else
+	int old = *value;
+	*value += addend;
+	return old;
+#endif
+}
+
+#ifdef TRACY_THREAD_POOL
+// Takes the next thread of the job and runs it. The job leaves the queue once all its threads are
+// taken. Called with the pool mutex held.
+void thread_pool_run_next(ThreadPool* pool, ParallelJob* job) {
+	int thread = job->next_thread++;
+	if (job->next_thread == job->threads) {
+		ParallelJob** link = &pool->queue_head;
+		ParallelJob* previous = NULL;
+		while (*link != job) {
+			previous = *link;
+			link = &previous->next;
+		}
+		*link = job->next;
+		if (pool->queue_tail == job) pool->queue_tail = previous;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	job->function(job->context, thread, job->threads);
+	pthread_mutex_lock(&pool->mutex);
+	// the joining thread may return and release the job as soon as this is broadcast
+	if (++job->finished == job->threads) pthread_cond_broadcast(&pool->job_finished);
+}
+
+void* thread_pool_worker(void* arg) {
+	ThreadPool* pool = arg;
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->shutdown) {
+		if (pool->queue_head != NULL) {
+			thread_pool_run_next(pool, pool->queue_head);
+		} else {
+			pthread_cond_wait(&pool->job_queued, &pool->mutex);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+// Starts the workers and pins them to the cores in turn, if any are given. If the system refuses
+// to start some of them (e.g. the pthread pool of the web build is exhausted), the pool just has
+// fewer workers.
+ThreadPool* thread_pool_create(int worker_count, const int* cores, int core_count) {
+	ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->job_queued, NULL);
+	pthread_cond_init(&pool->job_finished, NULL);
+	pool->workers = malloc(max_int(worker_count, 1) * sizeof(pthread_t));
+	for (int i = 0; i < worker_count; ++i) {
+		if (pthread_create(&pool->workers[i], NULL, thread_pool_worker, pool) != 0) break;
+		pool->worker_count++;
+#ifdef THREAD_AFFINITY
+		if (core_count > 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cores[i % core_count], &set);
+			pthread_setaffinity_np(pool->workers[i], sizeof(cpu_set_t), &set); // best effort
+		}
+#else
+		(void)cores;
+		(void)core_count;
+#endif
+	}
+	return pool;
+}
+
+// Stops the workers after their current job. Jobs that are still queued are completed by the
+// threads that join them.
+void thread_pool_destroy(ThreadPool* pool) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->job_queued);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->worker_count; ++i) pthread_join(pool->workers[i], NULL);
+	pthread_cond_destroy(&pool->job_queued);
+	pthread_cond_destroy(&pool->job_finished);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool);
+}
+
+// Queues the job, the workers start taking its threads right away. The job must stay valid until
+// thread_pool_join returns.
+void thread_pool_submit(ThreadPool* pool, ParallelJob* job) {
+	job->next_thread = job->finished = 0;
+	job->next = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->queue_tail != NULL) {
+		pool->queue_tail->next = job;
+	} else {
+		pool->queue_head = job;
+	}
+	pool->queue_tail = job;
+	pthread_cond_broadcast(&pool->job_queued);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// Waits until all threads of the job have finished. The threads that no worker has taken yet are
+// run by the calling thread, so a job completes even while all workers are busy with other jobs.
+void thread_pool_join(ThreadPool* pool, ParallelJob* job) {
+	pthread_mutex_lock(&pool->mutex);
+	while (job->next_thread < job->threads) thread_pool_run_next(pool, job);
+	while (job->finished < job->threads) pthread_cond_wait(&pool->job_finished, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int available_processors() {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+// contexts refined concurrently share the pool, so it must only be created once
+pthread_mutex_t thread_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Threads of a new pool with the current settings, automatic: one per pinned core or per processor
+int thread_pool_planned_threads() {
+	int threads = thread_count > 0 ? thread_count : thread_core_count;
+	return threads > 0 ? min_int(threads, MAX_THREAD_COUNT) : available_processors();
+}
+
+ThreadPool* get_thread_pool() {
+	pthread_mutex_lock(&thread_pool_mutex);
+	// one worker less than threads, the thread that joins a job works on it too
+	if (thread_pool == NULL) {
+		thread_pool =
+			thread_pool_create(thread_pool_planned_threads() - 1, thread_cores, thread_core_count);
+	}
+	ThreadPool* pool = thread_pool;
+	pthread_mutex_unlock(&thread_pool_mutex);
+	return pool;
+}
+
+// Threads of the running pool, or of the one the next job would start. Fewer workers may start
+// than planned, so this is only exact once the pool runs.
+int thread_pool_thread_count() {
+	pthread_mutex_lock(&thread_pool_mutex);
+	int threads =
+		thread_pool != NULL ? thread_pool->worker_count + 1 : thread_pool_planned_threads();
+	pthread_mutex_unlock(&thread_pool_mutex);
+	return threads;
+}
+
+// The next job starts a new pool with the current settings
+void restart_thread_pool() {
+	pthread_mutex_lock(&thread_pool_mutex);
+	if (thread_pool != NULL) thread_pool_destroy(thread_pool);
+	thread_pool = NULL;
+	pthread_mutex_unlock(&thread_pool_mutex);
+}
+#endif
+
+#ifdef THREAD_AFFINITY
+// Reads the cores of a NUMA node from sysfs, e.g. "0-7,16-23". Returns NULL if there is no such
+// node.
+int* numa_node_cores(int node, int* core_count) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE* file = fopen(path, "r");
+	if (file == NULL) return NULL;
+	int capacity = 64;
+	int* cores = malloc(capacity * sizeof(int));
+	*core_count = 0;
+	int first, last;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(file, "-%d", &last) != 1) last = first;
+		for (int core = max_int(first, 0); core <= min_int(last, CPU_SETSIZE - 1); ++core) {
+			if (*core_count == capacity) cores = realloc(cores, (capacity *= 2) * sizeof(int));
+			cores[(*core_count)++] = core;
+		}
+		if (fgetc(file) != ',') break;
+	}
+	fclose(file);
+	if (*core_count == 0) {
+		free(cores);
+		return NULL;
+	}
+	return cores;
+}
+#endif
+
+// Number of threads the parallel sections run on with the selected backend
+int parallel_thread_count() {
+#ifdef _OPENMP
+	if (thread_backend == THREAD_BACKEND_OPENMP) {
+		return thread_count > 0 ? thread_count : omp_get_max_threads();
+	}
+#endif
+#ifdef TRACY_THREAD_POOL
+	if (thread_backend == THREAD_BACKEND_POOL) return get_thread_pool()->worker_count + 1;
+#endif
+	return 1;
+}
+
+// Runs the function for the given number of threads on the selected backend and returns when all
+// of them have finished
+void parallel_run(ParallelFunction function, void* context, int threads) {
+#ifdef _OPENMP
+	if (thread_backend == THREAD_BACKEND_OPENMP) {
+#pragma omp parallel num_threads(threads)
+		function(context, omp_get_thread_num(), omp_get_num_threads());
+		return;
+	}
+#endif
+#ifdef TRACY_THREAD_POOL
+	if (thread_backend == THREAD_BACKEND_POOL && threads > 1) {
+		ParallelJob job = {.function = function, .context = context, .threads = threads};
+		ThreadPool* pool = get_thread_pool();
+		thread_pool_submit(pool, &job);
+		thread_pool_join(pool, &job);
+		return;
+	}
+#endif
+	for (int thread = 0; thread < threads; ++thread) function(context, thread, threads);
+}
+
+int float_accums_per_pixel(Accumulator accumulator) {
+	return accumulator == ACCUMULATOR_FLOAT_COMPENSATED ? 2 : 1;
+}
+
+void clear_accumulation_buffers(TracyContext* ctx) {
+	if (ctx->sample_count_buffer == NULL) return; // render_init was not called yet
+	// write zeros in radiance buffers
+	// no need to clear image_buffers as they are overwritten every time they are requested
+	int pixels = ctx->width * ctx->height;
+	if (ctx->buffer_accumulator == ACCUMULATOR_DOUBLE) {
+		memset(ctx->summed_weighted_radiance_buffer, 0, pixels * sizeof(DVec));
+		memset(ctx->summed_weights_buffer, 0, pixels * sizeof(double));
+	} else {
+		int accums = pixels * float_accums_per_pixel(ctx->buffer_accumulator);
+		memset(ctx->float_accum_buffer, 0, accums * sizeof(FloatAccum));
+	}
+	memset(ctx->sample_count_buffer, 0, pixels * sizeof(int));
+	if (ctx->moment_buffer != NULL) {
+		memset(ctx->moment_buffer, 0, pixels * sizeof(LuminanceMoments));
+		memset(ctx->converged_buffer, 0, pixels * sizeof(bool));
+	}
+}
+
+void initialize_buffers(TracyContext* ctx) {
+	// (Re)allocate buffer if dimensions or the accumulator change or not allocated yet
+	if (ctx->image_buffer_ldr == NULL || ctx->image_buffer_hdr == NULL ||
+		ctx->rng_buffer == NULL || ctx->sample_count_buffer == NULL ||
+		ctx->width != ctx->buffer_width ||
+		ctx->height != ctx->buffer_height || ctx->accumulator != ctx->buffer_accumulator ||
+		ctx->adaptive_sampling != (ctx->moment_buffer != NULL)) {
+
+		if (ctx->image_buffer_ldr != NULL) { free(ctx->image_buffer_ldr); }
+		if (ctx->image_buffer_hdr != NULL) { free(ctx->image_buffer_hdr); }
+		free(ctx->summed_weighted_radiance_buffer);
+		free(ctx->summed_weights_buffer);
+		free(ctx->float_accum_buffer);
+		if (ctx->rng_buffer) free(ctx->rng_buffer);
+		free(ctx->sample_count_buffer);
+		free(ctx->moment_buffer);
+		free(ctx->converged_buffer);
+
+		ctx->summed_weighted_radiance_buffer = NULL;
+		ctx->summed_weights_buffer = NULL;
+		ctx->float_accum_buffer = NULL;
+		if (ctx->accumulator == ACCUMULATOR_DOUBLE) {
+			ctx->summed_weighted_radiance_buffer = malloc(ctx->width * ctx->height * sizeof(DVec));
+			ctx->summed_weights_buffer = malloc(ctx->width * ctx->height * sizeof(double));
+		} else {
+			int accums = ctx->width * ctx->height * float_accums_per_pixel(ctx->accumulator);
+			ctx->float_accum_buffer = malloc(accums * sizeof(FloatAccum));
+		}
+		ctx->image_buffer_ldr = malloc(ctx->width * ctx->height * 4 * sizeof(uint8_t));
+		ctx->image_buffer_hdr = malloc(ctx->width * ctx->height * 3 * sizeof(float));
+		ctx->rng_buffer = malloc(ctx->width * ctx->height * sizeof(pcg32_random_t));
+		ctx->sample_count_buffer = malloc(ctx->width * ctx->height * sizeof(int));
+		ctx->moment_buffer = NULL;
+		ctx->converged_buffer = NULL;
+		if (ctx->adaptive_sampling) {
+			ctx->moment_buffer = malloc(ctx->width * ctx->height * sizeof(LuminanceMoments));
+			ctx->converged_buffer = malloc(ctx->width * ctx->height * sizeof(bool));
+		}
+
+		ctx->buffer_width = ctx->width;
+		ctx->buffer_height = ctx->height;
+		ctx->buffer_accumulator = ctx->accumulator;
+	}
+	clear_accumulation_buffers(ctx);
+}
+
+// 1D Box Filter
+float box_1d(float x) {
+	// half-open interval[-radius, radius). Ensures pixels on a boundary are not used for two
+	// pixels, although in praxis this doesn't make any difference.
+	return (x >= -BOX_RADIUS && x < BOX_RADIUS) ? 1.0f : 0.0f;
+}
+
+// 1D Mitchell-Netravali filter function with B=1/3, C=1/3.
+// This filter is separable: W(x,y) = w(x) * w(y)
+// The support radius is strictly 2.0.
+float mitchell_1d(float x) {
+	x = fabsf(x);
+	if (x >= 2.0f) return 0.0f;
+
+	// Hardcoded coefficients for B=1/3, C=1/3
+	// 0 <= x < 1: 1/6 * (7x^3 - 12x^2 + 16/3)
+	if (x < 1.0f) {
+		return (7.0f * x * x * x - 12.0f * x * x + 16.0f / 3.0f) * (1.0f / 6.0f);
+	}
+	// 1 <= x < 2: 1/6 * (-7/3x^3 + 12x^2 - 20x + 32/3)
+	else {
+		return ((-7.0f / 3.0f) * x * x * x + 12.0f * x * x - 20.0f * x + 32.0f / 3.0f) *
+			   (1.0f / 6.0f);
+	}
+}
+
+// Calculates a weight based on the 2D Gaussian PDF.
+// This implements the formula: (1 / (2πσ²)) e^(-(x² + y²) / (2σ²))
+float gaussian_weight_2d(float offset_x, float offset_y, float sigma) {
+	float two_sigma_squared = 2.0f * sigma * sigma;
+	// normalization constant: (1 / (2πσ²))
+	float norm_const = 1.0f / ((float)M_PI * two_sigma_squared);
+	float r_squared = offset_x * offset_x + offset_y * offset_y;
+	return norm_const * expf(-r_squared / two_sigma_squared);
+}
+
+// Calculates the exact Fresnel reflectance amount using the dielectric Fresnel equations.
+// Determines how much light reflects vs. refracts.
+// `normal` must be flipped to point against the incident ray.
+// `ior_from` is the medium the ray is currently in, `ior_to` is the medium it is entering.
+float fresnel(Vec incident, Vec normal, float ior_from, float ior_to) {
+	// Normal opposes incident, so dot product is negative.
+	// -dot makes it positive. Clamp to 0.0f to avoid tiny precision errors.
+	float cos_i = fmaxf(0.0f, -vec_dot(incident, normal));
+	float eta = ior_from / ior_to;
+	// Snell's Law
+	float sin2_theta_t = eta * eta * (1.0f - cos_i * cos_i);
+	// total internal reflection
+	if (sin2_theta_t >= 1.0f) { return 1.0f; }
+
+	// Cosine of the transmitted angle
+	float cos_theta_t = sqrtf(fmaxf(0.0f, 1.0f - sin2_theta_t));
+	// Parallel (p) and perpendicular (s) polarization reflection components
+	float rs =
+		(ior_from * cos_i - ior_to * cos_theta_t) / (ior_from * cos_i + ior_to * cos_theta_t);
+	float rp =
+		(ior_from * cos_theta_t - ior_to * cos_i) / (ior_from * cos_theta_t + ior_to * cos_i);
+	// Unpolarized light assumes an equal mix of both polarizations
+	return (rs * rs + rp * rp) / 2.0f;
+}
+
+// Calculates the refraction direction using Snell's Law from 11.2.9
+// `normal` must be flipped to point AGAINST the incident ray.
+Vec refract(Vec incident, Vec normal, float ior_from, float ior_to) {
+	float eta = ior_from / ior_to;
+	float cos_i = fmaxf(0.0f, -vec_dot(incident, normal));
+
+	float k = 1.0f - eta * eta * (1.0f - cos_i * cos_i);
+
+	assert(k >= 0.0f && "indicates total internal reflection happens, in which case the refract "
+						"function should not have been called");
+	// Floating-point safety fallback: If we slipped past the Fresnel TIR check due to float
+	// precision, do reflection to prevent NaNs.
+	if (k < 0.0f) { return reflect(incident, normal); }
+
+	Vec refr_dir = vec_add(vec_scale(incident, eta), vec_scale(normal, eta * cos_i - sqrtf(k)));
+	return vec_normalize(refr_dir);
+}
+
+// random float between 0.0 (inclusive) and 1.0 (exclusive)
+float random_float(pcg32_random_t* rng) {
+	// Shift out the bottom 8 bits to get a perfect 24-bit integer
+	// Multiply by 2^-24 (which is exactly 1.0f / 16777216.0f)
+	return (pcg32_random_r(rng) >> 8) * 0x1.0p-24f;
+}
+
+uint32_t reverse_bits(uint32_t x) {
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_bitreverse32)
+	return __builtin_bitreverse32(x);
+#endif
+#endif
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Integer hash in which every input bit affects every output bit (lowbias32 by Chris Wellons)
+uint32_t hash_uint32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Permutation that flips every bit of x depending on the seed and all bits below it (the hash of
+// Burley 2020, improved in pbrt-v4). On reversed bits it is an Owen scrambling of a fixed point
+// number in [0, 1), which flips every bit depending on all bits above it: each power of 2 of a
+// scrambled Sobol sequence still has one point in every stratum, but different seeds give
+// uncorrelated sequences.
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return x;
+}
+
+// Second dimension of the Sobol sequence with reversed bits, the first one is reverse_bits(index).
+// Its generator matrix is Pascal's triangle mod 2, so bit i of the result is the parity of the bits
+// j of index with i & j == i, summed up one bit of i at a time.
+uint32_t sobol_second_dimension_reversed(uint32_t index) {
+	index ^= (index >> 1) & 0x55555555u;
+	index ^= (index >> 2) & 0x33333333u;
+	index ^= (index >> 4) & 0x0f0f0f0fu;
+	index ^= (index >> 8) & 0x00ff00ffu;
+	index ^= (index >> 16) & 0x0000ffffu;
+	return index;
+}
+
+// Adds (sign 1) or removes (sign -1) a point of the blue noise mask to the energy of every pixel,
+// the gaussian of their distance on the torus (kernel, relative to the point)
+void blue_noise_splat(float* energy, const float* kernel, int point, float sign) {
+	const int mask = BLUE_NOISE_SIZE - 1;
+	int point_x = point & mask, point_y = point / BLUE_NOISE_SIZE;
+	for (int y = 0; y < BLUE_NOISE_SIZE; ++y) {
+		const float* kernel_row = &kernel[((y - point_y) & mask) * BLUE_NOISE_SIZE];
+		float* energy_row = &energy[y * BLUE_NOISE_SIZE];
+		for (int x = 0; x < BLUE_NOISE_SIZE; ++x) {
+			energy_row[x] += sign * kernel_row[(x - point_x) & mask];
+		}
+	}
+}
+
+// The point of the mask with the highest energy (the tightest cluster) if cluster, otherwise the
+// pixel without a point with the lowest energy (the largest void)
+int blue_noise_extreme(const float* energy, const bool* points, bool cluster) {
+	int best = -1;
+	for (int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; ++i) {
+		if (points[i] != cluster) continue;
+		if (best < 0 || (cluster ? energy[i] > energy[best] : energy[i] < energy[best])) best = i;
+	}
+	return best;
+}
+
+// Blue noise mask by the void-and-cluster method (Ulichney 1993): ranks the pixels so that those
+// below any rank are spread as evenly as possible, also across the edges of the tiled mask. The
+// largest void among the pixels without a point is also the tightest cluster of those pixels, so
+// the ranks above half the mask need no second energy. Returns the ranks as fixed point numbers in
+// [0, 1), the rotations of the pixels.
+uint32_t* generate_blue_noise() {
+	const int size = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+	float* kernel = malloc(size * sizeof(float));
+	for (int y = 0; y < BLUE_NOISE_SIZE; ++y) {
+		for (int x = 0; x < BLUE_NOISE_SIZE; ++x) {
+			int dx = min_int(x, BLUE_NOISE_SIZE - x), dy = min_int(y, BLUE_NOISE_SIZE - y);
+			float distance_squared = (float)(dx * dx + dy * dy);
+			kernel[y * BLUE_NOISE_SIZE + x] =
+				expf(-distance_squared / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+		}
+	}
+	float* energy = calloc(size, sizeof(float));
+	bool* points = calloc(size, sizeof(bool));
+	// a tenth of the pixels at random, spread by moving the tightest cluster to the largest void
+	// until the void is the point that was just removed
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, GLOBAL_SEED, 3);
+	int initial_points = 0;
+	while (initial_points < size / 10) {
+		int point = min_int((int)(random_float(&rng) * size), size - 1);
+		if (points[point]) continue;
+		points[point] = true;
+		blue_noise_splat(energy, kernel, point, 1.0f);
+		initial_points++;
+	}
+	for (int i = 0; i < size; ++i) {
+		int cluster = blue_noise_extreme(energy, points, true);
+		points[cluster] = false;
+		blue_noise_splat(energy, kernel, cluster, -1.0f);
+		int largest_void = blue_noise_extreme(energy, points, false);
+		points[largest_void] = true;
+		blue_noise_splat(energy, kernel, largest_void, 1.0f);
+		if (largest_void == cluster) break;
+	}
+
+	int* ranks = malloc(size * sizeof(int));
+	// the initial points get the lowest ranks, the tightest cluster the highest of them
+	float* removed_energy = malloc(size * sizeof(float));
+	bool* remaining_points = malloc(size * sizeof(bool));
+	memcpy(removed_energy, energy, size * sizeof(float));
+	memcpy(remaining_points, points, size * sizeof(bool));
+	for (int rank = initial_points - 1; rank >= 0; --rank) {
+		int cluster = blue_noise_extreme(removed_energy, remaining_points, true);
+		remaining_points[cluster] = false;
+		blue_noise_splat(removed_energy, kernel, cluster, -1.0f);
+		ranks[cluster] = rank;
+	}
+	// the other pixels fill the largest void in turn
+	for (int rank = initial_points; rank < size; ++rank) {
+		int largest_void = blue_noise_extreme(energy, points, false);
+		points[largest_void] = true;
+		blue_noise_splat(energy, kernel, largest_void, 1.0f);
+		ranks[largest_void] = rank;
+	}
+
+	uint32_t* mask = malloc(size * sizeof(uint32_t));
+	for (int i = 0; i < size; ++i) mask[i] = (uint32_t)(((uint64_t)ranks[i] << 32) / size);
+	free(kernel);
+	free(energy);
+	free(points);
+	free(ranks);
+	free(removed_energy);
+	free(remaining_points);
+	return mask;
+}
+
+// Cranley-Patterson rotation of the sample's pixel in the dimension with the given seed: the
+// blue noise mask, shifted by the seed. In every dimension the rotations of neighboring pixels
+// differ as much as possible, so their errors are high-frequency noise that the eye averages out.
+uint32_t blue_noise_rotation(const Sampler* sampler, uint32_t seed) {
+	const int mask = BLUE_NOISE_SIZE - 1;
+	int x = (sampler->x + (int)(seed >> 16)) & mask;
+	int y = (sampler->y + (int)(seed >> 24)) & mask;
+	return sampler->blue_noise[y * BLUE_NOISE_SIZE + x];
+}
+
+// Seed of the next dimension of the sample
+uint32_t sampler_next_seed(Sampler* sampler) {
+	return hash_uint32(sampler->seed ^ (sampler->dimension++ * 0x9e3779b9u));
+}
+
+// Random number in [0, 1) of the next dimension of the sample
+float sampler_1d(Sampler* sampler) {
+	if (sampler->type == SAMPLER_PCG) return random_float(sampler->rng);
+	uint32_t seed = sampler_next_seed(sampler);
+	// every dimension visits the samples in its own order (an Owen scrambling of the index keeps
+	// the powers of 2 together), otherwise all dimensions would be the same sequence
+	uint32_t index = reverse_bits(laine_karras_permutation(sampler->reversed_index, seed));
+	// the first Sobol dimension is reverse_bits(index), whose reversal cancels out when scrambling
+	// it. The seeds of the values only need to differ from the one of the index.
+	uint32_t x_seed = seed * 0x9e3779b9u;
+	uint32_t x = reverse_bits(laine_karras_permutation(index, x_seed));
+	if (sampler->type == SAMPLER_BLUE_NOISE) x += blue_noise_rotation(sampler, x_seed);
+	return (x >> 8) * 0x1.0p-24f;
+}
+
+// Pair of random numbers in [0, 1) of the next dimension of the sample, stratified together
+void sampler_2d(Sampler* sampler, float* u1, float* u2) {
+	if (sampler->type == SAMPLER_PCG) {
+		*u1 = random_float(sampler->rng);
+		*u2 = random_float(sampler->rng);
+		return;
+	}
+	uint32_t seed = sampler_next_seed(sampler);
+	uint32_t index = reverse_bits(laine_karras_permutation(sampler->reversed_index, seed));
+	uint32_t x_seed = seed * 0x9e3779b9u, y_seed = seed * 0x85ebca6bu;
+	uint32_t x = reverse_bits(laine_karras_permutation(index, x_seed));
+	uint32_t y = sobol_second_dimension_reversed(index);
+	y = reverse_bits(laine_karras_permutation(y, y_seed));
+	if (sampler->type == SAMPLER_BLUE_NOISE) {
+		x += blue_noise_rotation(sampler, x_seed);
+		y += blue_noise_rotation(sampler, y_seed);
+	}
+	*u1 = (x >> 8) * 0x1.0p-24f;
+	*u2 = (y >> 8) * 0x1.0p-24f;
+}
+
+// Moves the sampler to the dimensions of the given bounce, so that every bounce of every sample
+// takes its random numbers from the same dimensions, whichever decisions the earlier ones made
+void sampler_start_bounce(Sampler* sampler, int depth) {
+	sampler->dimension = SAMPLER_CAMERA_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+// create orthonormal basis (local coordinate system) from a vector
+// 'n' is the normal vector, which will become the 'w' axis.
+void create_orthonormal_basis(Vec n, Vec* u, Vec* v, Vec* w) {
+	*w = n;
+	Vec a = (fabsf(w->x) > 0.9f) ? (Vec){0, 1, 0} : (Vec){1, 0, 0};
+	*v = vec_normalize(vec_cross(*w, a));
+	*u = vec_cross(*w, *v);
+}
+
+// random direction on hemisphere with uniform distribution
+Vec sample_uniform_hemisphere(Vec normal, Sampler* sampler) {
+	// Generate a random point on a unit sphere
+	float r1, r2; // for z and phi
+	sampler_2d(sampler, &r1, &r2);
+
+	float z = 1.0f - 2.0f * r1;
 	float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
 	float phi = 2.0f * (float)M_PI * r2;
 
@@ -527,9 +2888,9 @@ Vec sample_uniform_hemisphere(Vec normal, pcg32_random_t* rng) {
 }
 
 // random direction on hemisphere proportional to cosine-weighted solid angle
-Vec sample_cosine_hemisphere(Vec normal, pcg32_random_t* rng) {
-	float r1 = random_float(rng);
-	float r2 = random_float(rng);
+Vec sample_cosine_hemisphere(Vec normal, Sampler* sampler) {
+	float r1, r2;
+	sampler_2d(sampler, &r1, &r2);
 
 	// Uniformly sample a disk
 	float r = sqrtf(r1);
@@ -547,6 +2908,363 @@ Vec sample_cosine_hemisphere(Vec normal, pcg32_random_t* rng) {
 	return sample_world;
 }
 
+void alias_table_free(AliasTable* table) {
+	free(table->probability);
+	free(table->alias);
+	*table = (AliasTable){0};
+}
+
+// Vose's method: every entry gets a share of 1 / count of the total weight, entries with less take
+// the rest from one with more (their alias) until all shares are filled
+void alias_table_build(AliasTable* table, const float* weights, int count) {
+	alias_table_free(table);
+	table->probability = malloc(count * sizeof(float));
+	table->alias = malloc(count * sizeof(int));
+	table->count = count;
+	double total = 0.0;
+	for (int i = 0; i < count; ++i) total += weights[i];
+	double* scaled = malloc(count * sizeof(double));
+	// small entries are stacked from the front of worklist, large ones from the back
+	int* worklist = malloc(count * sizeof(int));
+	int small_count = 0, large_first = count;
+	for (int i = 0; i < count; ++i) {
+		scaled[i] = weights[i] * count / total;
+		if (scaled[i] < 1.0) worklist[small_count++] = i;
+		else worklist[--large_first] = i;
+	}
+	while (small_count > 0 && large_first < count) {
+		int small = worklist[--small_count];
+		int large = worklist[large_first++];
+		table->probability[small] = (float)scaled[small];
+		table->alias[small] = large;
+		scaled[large] -= 1.0 - scaled[small];
+		if (scaled[large] < 1.0) worklist[small_count++] = large;
+		else worklist[--large_first] = large;
+	}
+	// the rest is 1 up to rounding errors
+	for (int i = 0; i < small_count; ++i) worklist[--large_first] = worklist[i];
+	for (int i = large_first; i < count; ++i) {
+		table->probability[worklist[i]] = 1.0f;
+		table->alias[worklist[i]] = worklist[i];
+	}
+	free(scaled);
+	free(worklist);
+}
+
+// Samples the table with one random number u in [0, 1): the integer part of u * count picks the
+// entry, the fraction decides between the entry and its alias
+int alias_table_sample(const AliasTable* table, float u) {
+	float scaled = u * table->count;
+	int i = min_int((int)scaled, table->count - 1);
+	return scaled - i < table->probability[i] ? i : table->alias[i];
+}
+
+float clamped_acos(float x) { return acosf(fminf(fmaxf(x, -1.0f), 1.0f)); }
+
+// The smallest cone that contains the cones of a and b, bounds and power are summed up
+LightBounds light_bounds_union(LightBounds a, LightBounds b) {
+	LightBounds result = {aabb_union(a.bounds, b.bounds), a.axis, -1.0f, a.power + b.power};
+	float theta_a = clamped_acos(a.cos_theta_o);
+	float theta_b = clamped_acos(b.cos_theta_o);
+	float theta_d = clamped_acos(vec_dot(a.axis, b.axis));
+	if (fminf(theta_d + theta_b, (float)M_PI) <= theta_a) {
+		result.cos_theta_o = a.cos_theta_o;
+		return result;
+	}
+	if (fminf(theta_d + theta_a, (float)M_PI) <= theta_b) {
+		result.axis = b.axis;
+		result.cos_theta_o = b.cos_theta_o;
+		return result;
+	}
+	float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+	Vec rotation_axis = vec_cross(a.axis, b.axis);
+	if (theta_o >= (float)M_PI || vec_length_squared(rotation_axis) == 0.0f) return result;
+	// rotate a's axis towards b's until the cone touches both
+	float theta_r = theta_o - theta_a;
+	Vec tangent = vec_cross(vec_normalize(rotation_axis), a.axis);
+	result.axis = vec_add(vec_scale(a.axis, cosf(theta_r)), vec_scale(tangent, sinf(theta_r)));
+	result.cos_theta_o = cosf(theta_o);
+	return result;
+}
+
+// Cosine of max(theta_a - theta_b, 0) from the cosines and sines of both angles
+float cos_subtract_clamped(float cos_a, float sin_a, float cos_b, float sin_b) {
+	if (cos_a >= cos_b) return 1.0f;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+
+float sin_from_cos(float cos_theta) { return sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta)); }
+
+// Upper bound of the light that the lights within the LightBounds send to a surface at p with
+// normal n, up to the common factors of all lights. Like the light itself it falls off with the
+// squared distance and the cosines at both ends, but every angle is reduced by the angle theta_b
+// that the bounds cover as seen from p. Returns 0 only if none of the lights can reach p. The
+// angles are only handled by their cosines and sines, as this runs for every node on the way down.
+float light_importance(const LightBounds* light, Vec p, Vec n) {
+	Vec center = aabb_center(light->bounds);
+	Vec to_point = vec_sub(p, center);
+	float distance_squared = vec_length_squared(to_point);
+	float radius_squared = vec_length_squared(vec_sub(light->bounds.max, center));
+	if (distance_squared <= radius_squared) return light->power / radius_squared; // any angle
+	float distance = sqrtf(distance_squared);
+	Vec dir = vec_scale(to_point, 1.0f / distance);
+	float sin_b = sqrtf(radius_squared) / distance;
+	float cos_b = sqrtf(1.0f - sin_b * sin_b);
+
+	// the angle between the cone of normals and dir, minus theta_b
+	float cos_w = vec_dot(light->axis, dir);
+	float cos_o = light->cos_theta_o;
+	float sin_w = sin_from_cos(cos_w), sin_o = sin_from_cos(cos_o);
+	float cos_x = cos_subtract_clamped(cos_w, sin_w, cos_o, sin_o);
+	float sin_x = cos_x == 1.0f ? 0.0f : sin_w * cos_o - cos_w * sin_o;
+	float cos_emitted = cos_subtract_clamped(cos_x, sin_x, cos_b, sin_b);
+	if (cos_emitted <= 0.0f) return 0.0f;
+
+	// the angle between the normal and the direction to the bounds, minus theta_b
+	float cos_i = -vec_dot(n, dir);
+	float cos_incident = cos_subtract_clamped(cos_i, sin_from_cos(cos_i), cos_b, sin_b);
+	if (cos_incident <= 0.0f) return 0.0f;
+	return light->power * cos_emitted * cos_incident / distance_squared;
+}
+
+void light_bvh_free(LightBvh* tree) {
+	bvh_free(&tree->bvh);
+	free(tree->node_bounds);
+	free(tree->parents);
+	free(tree->leaves);
+	*tree = (LightBvh){0};
+}
+
+// Builds a binned SAH BVH over the bounds of the lights and fits their cones and power bottom up
+void light_bvh_build(LightBvh* tree, const LightBounds* light_bounds, int count) {
+	light_bvh_free(tree);
+	Aabb* bounds = malloc(count * sizeof(Aabb));
+	for (int i = 0; i < count; ++i) bounds[i] = light_bounds[i].bounds;
+	bvh_build(&tree->bvh, bounds, count);
+	free(bounds);
+	const Bvh* bvh = &tree->bvh;
+	tree->node_bounds = malloc(bvh->node_count * sizeof(LightBounds));
+	tree->parents = malloc(bvh->node_count * sizeof(int));
+	tree->leaves = malloc(count * sizeof(int));
+	tree->parents[0] = -1;
+	// bvh_build stores the children after their parent
+	for (int i = bvh->node_count - 1; i >= 0; --i) {
+		const BvhNode* node = &bvh->nodes[i];
+		if (node->count == 0) {
+			int left = node->left_first;
+			tree->parents[left] = tree->parents[left + 1] = i;
+			tree->node_bounds[i] =
+				light_bounds_union(tree->node_bounds[left], tree->node_bounds[left + 1]);
+			continue;
+		}
+		for (int j = 0; j < node->count; ++j) {
+			int light = bvh->prim_indices[node->left_first + j];
+			tree->leaves[light] = i;
+			tree->node_bounds[i] = j == 0 ? light_bounds[light]
+										  : light_bounds_union(tree->node_bounds[i],
+															   light_bounds[light]);
+		}
+	}
+}
+
+void light_list_free(LightList* lights) {
+	free(lights->triangles);
+	free(lights->bounds);
+	free(lights->power_probability);
+	alias_table_free(&lights->power_table);
+	light_bvh_free(&lights->bvh);
+	free(lights->triangle_lights);
+	*lights = (LightList){0};
+}
+
+// Collects the emissive triangles of current_scene for next-event estimation. Like the top level it
+// is cheap and is redone whenever something moves.
+void build_light_list(TracyContext* ctx) {
+	light_list_free(&ctx->lights);
+	const Scene* scene = &ctx->current_scene;
+	LightList* lights = &ctx->lights;
+	int* primitive_lights = malloc(scene->size * sizeof(int));
+	lights->triangles = malloc(scene->size * sizeof(EmissiveTriangle));
+	lights->bounds = malloc(scene->size * sizeof(LightBounds));
+	lights->power_probability = malloc(scene->size * sizeof(float));
+	float total_power = 0.0f;
+	for (int i = 0; i < scene->size; ++i) {
+		const Primitive* primitive = &scene->primitives[i];
+		primitive_lights[i] = -1;
+		if (primitive->shape.type != TRIANGLE || primitive->material.type != EMISSIVE) continue;
+		const Triangle* tri = &primitive->shape.data.triangle;
+		Vec cross = vec_cross(vec_sub(tri->v1, tri->v0), vec_sub(tri->v2, tri->v0));
+		float area = 0.5f * vec_length(cross);
+		Vec radiance = vec_scale(primitive->material.data.emissive.radiosity, 1.0f / (float)M_PI);
+		float power = luminance(radiance) * area;
+		if (power <= 0.0f) continue; // degenerate or black, never contributes
+		Vec normal = vec_normalize(cross);
+		bool two_sided = primitive->material.thin_wall;
+		Aabb bounds = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), tri->v0), tri->v1), tri->v2);
+		primitive_lights[i] = lights->count;
+		lights->triangles[lights->count] =
+			(EmissiveTriangle){tri->v0, tri->v1, tri->v2, normal, radiance, area, two_sided};
+		lights->bounds[lights->count] =
+			(LightBounds){bounds, normal, two_sided ? -1.0f : 1.0f, power};
+		lights->power_probability[lights->count++] = power;
+		total_power += power;
+	}
+	if (lights->count == 0) {
+		free(primitive_lights);
+		light_list_free(lights);
+		return;
+	}
+	for (int i = 0; i < lights->count; ++i) lights->power_probability[i] /= total_power;
+	alias_table_build(&lights->power_table, lights->power_probability, lights->count);
+	if (lights->count >= LIGHT_BVH_MIN_LIGHTS) {
+		light_bvh_build(&lights->bvh, lights->bounds, lights->count);
+	}
+	// hits report the index of the triangle in the compiled scene, which is in BVH order
+	const Blas* blas = &ctx->scene_blas;
+	lights->triangle_lights = malloc(blas->compiled.triangles.count * sizeof(int));
+	for (int i = 0; i < blas->prim_count; ++i) {
+		int primitive = blas->bvh.prim_indices[i];
+		if (scene->primitives[primitive].shape.type != TRIANGLE) continue;
+		lights->triangle_lights[i - blas->compiled.sphere_offset[i]] = primitive_lights[primitive];
+	}
+	free(primitive_lights);
+}
+
+// Stretches the part [begin, begin + share) of [0, 1) that the random number u fell into back to
+// [0, 1), so that u can make the next choice
+float remap_random(float u, float begin, float share) {
+	return fminf((u - begin) / share, 0x1.fffffep-1f);
+}
+
+// Picks one of the lights for a surface at p with normal n: with the light BVH by the estimated
+// contribution, otherwise by power. Every choice on the way takes the random number u in [0, 1).
+// Returns its index and the probability of picking it in probability, or -1 if none of the lights
+// can reach p.
+int select_light(const LightList* lights, Vec p, Vec n, float u, float* probability) {
+	if (lights->bvh.bvh.node_count == 0) {
+		int light = alias_table_sample(&lights->power_table, u);
+		*probability = lights->power_probability[light];
+		return light;
+	}
+	const LightBvh* tree = &lights->bvh;
+	*probability = 1.0f;
+	const BvhNode* node = &tree->bvh.nodes[0];
+	while (node->count == 0) {
+		int left = node->left_first;
+		float importance_left = light_importance(&tree->node_bounds[left], p, n);
+		float importance_right = light_importance(&tree->node_bounds[left + 1], p, n);
+		float total = importance_left + importance_right;
+		if (total == 0.0f) return -1;
+		float share_left = importance_left / total;
+		if (u < share_left) {
+			u = remap_random(u, 0.0f, share_left);
+			*probability *= share_left;
+			node = &tree->bvh.nodes[left];
+		} else {
+			u = remap_random(u, share_left, 1.0f - share_left);
+			*probability *= importance_right / total;
+			node = &tree->bvh.nodes[left + 1];
+		}
+	}
+	// the lights of a leaf are picked in proportion to their own importance, by a running choice
+	// that replaces the current pick by each light with its share of the importance so far
+	const int* leaf_lights = &tree->bvh.prim_indices[node->left_first];
+	int light = -1;
+	float total = 0.0f, light_importance_picked = 0.0f;
+	for (int i = 0; i < node->count; ++i) {
+		float importance = light_importance(&lights->bounds[leaf_lights[i]], p, n);
+		if (importance == 0.0f) continue;
+		total += importance;
+		float share = importance / total;
+		if (u < share) {
+			u = remap_random(u, 0.0f, share);
+			light = leaf_lights[i];
+			light_importance_picked = importance;
+		} else {
+			u = remap_random(u, share, 1.0f - share);
+		}
+	}
+	if (light >= 0) *probability *= light_importance_picked / total;
+	return light;
+}
+
+// Probability that select_light picks light for a surface at p with normal n
+float light_selection_probability(const LightList* lights, int light, Vec p, Vec n) {
+	if (lights->bvh.bvh.node_count == 0) return lights->power_probability[light];
+	const LightBvh* tree = &lights->bvh;
+	int node = tree->leaves[light];
+	const BvhNode* leaf = &tree->bvh.nodes[node];
+	float total = 0.0f;
+	for (int i = 0; i < leaf->count; ++i) {
+		int leaf_light = tree->bvh.prim_indices[leaf->left_first + i];
+		total += light_importance(&lights->bounds[leaf_light], p, n);
+	}
+	float importance = light_importance(&lights->bounds[light], p, n);
+	if (importance == 0.0f) return 0.0f;
+	float probability = importance / total;
+	// the choices from the root to the leaf
+	for (int parent = tree->parents[node]; parent >= 0; parent = tree->parents[parent]) {
+		int left = tree->bvh.nodes[parent].left_first;
+		float importance_left = light_importance(&tree->node_bounds[left], p, n);
+		float importance_right = light_importance(&tree->node_bounds[left + 1], p, n);
+		float importance_node = node == left ? importance_left : importance_right;
+		probability *= importance_node / (importance_left + importance_right);
+		node = parent;
+	}
+	return probability;
+}
+
+// Samples a point uniformly by area on the light
+Vec sample_light_point(const EmissiveTriangle* light, Sampler* sampler) {
+	// uniform barycentric coordinates
+	float r1, r2;
+	sampler_2d(sampler, &r1, &r2);
+	r1 = sqrtf(r1);
+	Vec weighted_v0 = vec_scale(light->v0, 1.0f - r1);
+	Vec weighted_v1 = vec_scale(light->v1, r1 * (1.0f - r2));
+	return vec_add(vec_add(weighted_v0, weighted_v1), vec_scale(light->v2, r1 * r2));
+}
+
+// Solid angle density of reaching a point on light by next-event estimation from a surface at p
+// with normal n, which sees it at distance_squared under cos_light to the light's normal
+float light_pdf(const LightList* lights, int light, Vec p, Vec n, float distance_squared,
+				float cos_light) {
+	float probability = light_selection_probability(lights, light, p, n);
+	return probability * distance_squared / (cos_light * lights->triangles[light].area);
+}
+
+// Multiple importance sampling weight of a sample of the strategy with density pdf, combined with
+// the strategy with other_pdf (power heuristic)
+float power_heuristic(float pdf, float other_pdf) {
+	return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Next-event estimation at a diffuse hit with normal n: samples a point on the lights and traces a
+// shadow ray to it. Returns the incident radiance times cos_theta / pdf, weighted against cosine
+// sampling of the BRDF by multiple importance sampling.
+Vec sample_direct_light(const TracyContext* ctx, Vec p, Vec n, Sampler* sampler) {
+	float probability;
+	int index = select_light(&ctx->lights, p, n, sampler_1d(sampler), &probability);
+	if (index < 0) return (Vec){0};
+	const EmissiveTriangle* light = &ctx->lights.triangles[index];
+	Vec point = sample_light_point(light, sampler);
+	Vec to_light = vec_sub(point, p);
+	float distance_squared = vec_length_squared(to_light);
+	float distance = sqrtf(distance_squared);
+	Vec dir = vec_scale(to_light, 1.0f / distance);
+	float cos_theta = vec_dot(n, dir);
+	float cos_light = -vec_dot(light->normal, dir);
+	if (light->two_sided) cos_light = fabsf(cos_light);
+	if (cos_theta <= 0.0f || cos_light <= 0.0f) return (Vec){0}; // below the surface or the back
+
+	Ray shadow_ray = {vec_add(p, vec_scale(n, SELF_OCCLUSION_DELTA)), dir};
+	if (occluded_scene(ctx, &shadow_ray, distance * (1.0f - SHADOW_RAY_EPSILON))) return (Vec){0};
+
+	float pdf = probability * distance_squared / (cos_light * light->area);
+	float weight = power_heuristic(pdf, cos_theta / (float)M_PI);
+	return vec_scale(light->radiance, cos_theta * weight / pdf);
+}
+
 float clamp_survival_probability(float probability) {
 	// Clamp probability to ensure we don't divide by zero or kill too aggressively
 	if (probability < 0.1f) return 0.1f;
@@ -554,36 +3272,58 @@ float clamp_survival_probability(float probability) {
 	return probability;
 }
 
-Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
+Vec radiance_from_ray(const TracyContext* ctx, Ray r, Sampler* sampler) {
 	Vec throughput = {1.0f, 1.0f, 1.0f};
+	Vec radiance = {0}; // light found by next-event estimation so far
+	bool sample_lights = ctx->light_sampling && ctx->lights.count > 0;
+	// density of the direction of r if it was sampled from a diffuse BRDF, 0 after specular
+	// bounces (or without light sampling), whose hits of a light are not weighted
+	float brdf_pdf = 0.0f;
+	Vec brdf_p = {0}, brdf_n = {0}; // the diffuse hit that sampled r
 
-	for (int depth = 0; depth < max_depth; ++depth) {
+	for (int depth = 0; depth < ctx->max_depth; ++depth) {
+		sampler_start_bounce(sampler, depth);
 		HitInfo hit;
-		Primitive* hit_prim = NULL;
-		bool did_hit = intersect_scene(&r, &hit, &hit_prim);
+		const Material* material = NULL;
+		bool did_hit = intersect_scene(ctx, &r, &hit, &material);
 
-		if (!did_hit) { return (Vec){0}; }
+		if (!did_hit) { return radiance; }
 
 		// Handle thin walls (think of paper or leaves)
 		// If we hit the backface of a thin-walled object, treat it as a frontface
-		if (hit_prim->material.thin_wall && hit.inside) {
+		if (material->thin_wall && hit.inside) {
 			hit.n = vec_scale(hit.n, -1.0f);
 			hit.inside = false;
 		}
 
-		switch (hit_prim->material.type) {
+		switch (material->type) {
 		case EMISSIVE: {
-			if (hit.inside) return (Vec){0}; // Only emit light in front facing direction
+			if (hit.inside) return radiance; // Only emit light in front facing direction
 
-			Vec radiosity = hit_prim->material.data.emissive.radiosity;
-			Vec radiance = vec_scale(radiosity, 1.0f / (float)M_PI);
-			return vec_hadamard_prod(throughput, radiance);
+			Vec radiosity = material->data.emissive.radiosity;
+			Vec emitted = vec_scale(radiosity, 1.0f / (float)M_PI);
+			if (hit.light >= 0 && brdf_pdf > 0.0f) {
+				// also found by next-event estimation at the previous hit, weight both samples
+				float cos_light = fabsf(vec_dot(hit.n, r.dir));
+				float pdf =
+					light_pdf(&ctx->lights, hit.light, brdf_p, brdf_n, hit.t * hit.t, cos_light);
+				emitted = vec_scale(emitted, power_heuristic(brdf_pdf, pdf));
+			}
+			return vec_add(radiance, vec_hadamard_prod(throughput, emitted));
 		}
 		case DIFFUSE: {
-			if (hit.inside) return (Vec){0}; // If inside, return 0
+			if (hit.inside) return radiance; // If inside, no light is reflected
 
 			Vec normal = hit.n;
-			Vec albedo = hit_prim->material.data.diffuse.albedo;
+			Vec albedo = material->data.diffuse.albedo;
+
+			// direct light of the next bounce, the BRDF is albedo / PI
+			if (sample_lights && depth + 1 < ctx->max_depth) {
+				Vec direct = sample_direct_light(ctx, hit.p, normal, sampler);
+				Vec brdf = vec_scale(albedo, 1.0f / (float)M_PI);
+				Vec contribution = vec_hadamard_prod(throughput, vec_hadamard_prod(brdf, direct));
+				radiance = vec_add(radiance, contribution);
+			}
 
 			float survival_prob = 1.0f; // Default to 100% survival
 #ifdef ENABLE_RUSSIAN_ROULETTE
@@ -591,12 +3331,15 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 				// kill rays that carry few light
 				survival_prob = clamp_survival_probability(luminance(throughput) * 5.0f);
 				// Terminate based on survival probability
-				if (random_float(rng) > survival_prob) { return (Vec){0}; }
+				if (sampler_1d(sampler) > survival_prob) { return radiance; }
 			}
 #endif
 
 			r.origin = vec_add(hit.p, vec_scale(normal, SELF_OCCLUSION_DELTA));
-			r.dir = sample_cosine_hemisphere(normal, rng);
+			r.dir = sample_cosine_hemisphere(normal, sampler);
+			brdf_pdf = sample_lights ? vec_dot(normal, r.dir) / (float)M_PI : 0.0f;
+			brdf_p = hit.p;
+			brdf_n = normal;
 
 			// russian roulette bias correction: scale the albedo by the inverse probability to
 			// compensate for killed rays.
@@ -610,14 +3353,14 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 		}
 		case MIRROR: {
 			Vec normal = hit.inside ? vec_scale(hit.n, -1.0f) : hit.n; // if inside, flip normal
-			Vec rho = hit_prim->material.data.mirror.rho;
+			Vec rho = material->data.mirror.rho;
 
 			float survival_prob = 1.0f;
 #ifdef ENABLE_RUSSIAN_ROULETTE
 			if (depth >= RR_START_DEPTH) {
 				survival_prob = clamp_survival_probability(luminance(throughput) * 5.0f);
 				// Terminate based on survival probability
-				if (random_float(rng) > survival_prob) { return (Vec){0}; }
+				if (sampler_1d(sampler) > survival_prob) { return radiance; }
 			}
 #endif
 
@@ -625,6 +3368,7 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 			// instead we describe perfect reflection as L_r = L_i * rho, where rho is just a ratio
 			r.origin = vec_add(hit.p, vec_scale(normal, SELF_OCCLUSION_DELTA));
 			r.dir = reflect(r.dir, normal);
+			brdf_pdf = 0.0f;
 
 			// russian roulette bias correction
 			rho = vec_scale(rho, 1.0f / survival_prob);
@@ -632,7 +3376,7 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 			break;
 		}
 		case REFRACTIVE: {
-			RefractiveMaterial mat = hit_prim->material.data.refractive;
+			RefractiveMaterial mat = material->data.refractive;
 			// Setup IORs based on whether we are entering or exiting the geometry
 			float ior_from = hit.inside ? mat.interior_ior : mat.exterior_ior;
 			float ior_to = hit.inside ? mat.exterior_ior : mat.interior_ior;
@@ -641,14 +3385,15 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 
 			// Calculate how much light reflects using the Fresnel term.
 			float reflectance = fresnel(r.dir, normal, ior_from, ior_to);
+			brdf_pdf = 0.0f;
 
-			if (reflectance > random_float(rng)) {
+			if (reflectance > sampler_1d(sampler)) {
 				// reflection
 				r.origin = vec_add(hit.p, vec_scale(normal, SELF_OCCLUSION_DELTA));
 				r.dir = reflect(r.dir, normal);
 			} else {
 				// refraction
-				if (hit_prim->material.thin_wall) {
+				if (material->thin_wall) {
 					// Ray passing through thin geometry bends twice, cancelling the angle out, so
 					// we don't change the direciton
 					r.origin = vec_add(hit.p, vec_scale(r.dir, SELF_OCCLUSION_DELTA));
@@ -663,33 +3408,93 @@ Vec radiance_from_ray(Ray r, pcg32_random_t* rng) {
 		default: assert(false); // material type not implemented
 		}
 	}
-	return (Vec){0};
+	return radiance;
+}
+
+// Neumaier's variant of Kahan summation: adds value to sum and its rounding error to compensation,
+// also if value is larger than sum. value is a double sum of a tile buffer, the error of rounding
+// it to float is compensated as well.
+void neumaier_add(float* sum, float* compensation, double value) {
+	float addend = (float)value;
+	float t = *sum + addend;
+	float error = fabsf(*sum) >= fabsf(addend) ? (*sum - t) + addend : (addend - t) + *sum;
+	*compensation += error + (float)(value - addend);
+	*sum = t;
+}
+
+// Adds the summed weighted radiance and weights of a batch of samples to the pixel at index
+void accumulate(TracyContext* ctx, int index, DVec radiance, double weight) {
+	switch (ctx->buffer_accumulator) {
+	case ACCUMULATOR_DOUBLE:
+		ctx->summed_weighted_radiance_buffer[index].x += radiance.x;
+		ctx->summed_weighted_radiance_buffer[index].y += radiance.y;
+		ctx->summed_weighted_radiance_buffer[index].z += radiance.z;
+		ctx->summed_weights_buffer[index] += weight;
+		break;
+	case ACCUMULATOR_FLOAT: {
+		FloatAccum* accum = &ctx->float_accum_buffer[index];
+		accum->r += (float)radiance.x;
+		accum->g += (float)radiance.y;
+		accum->b += (float)radiance.z;
+		accum->weight += (float)weight;
+		break;
+	}
+	case ACCUMULATOR_FLOAT_COMPENSATED: {
+		FloatAccum* sum = &ctx->float_accum_buffer[2 * index];
+		FloatAccum* compensation = sum + 1;
+		neumaier_add(&sum->r, &compensation->r, radiance.x);
+		neumaier_add(&sum->g, &compensation->g, radiance.y);
+		neumaier_add(&sum->b, &compensation->b, radiance.z);
+		neumaier_add(&sum->weight, &compensation->weight, weight);
+		break;
+	}
+	}
+}
+
+// Returns the summed weighted radiance of the pixel at index and its summed weights in weight
+DVec accumulated_radiance(const TracyContext* ctx, int index, double* weight) {
+	switch (ctx->buffer_accumulator) {
+	case ACCUMULATOR_FLOAT: {
+		FloatAccum accum = ctx->float_accum_buffer[index];
+		*weight = accum.weight;
+		return (DVec){accum.r, accum.g, accum.b};
+	}
+	case ACCUMULATOR_FLOAT_COMPENSATED: {
+		FloatAccum sum = ctx->float_accum_buffer[2 * index];
+		FloatAccum compensation = ctx->float_accum_buffer[2 * index + 1];
+		*weight = (double)sum.weight + compensation.weight;
+		return (DVec){(double)sum.r + compensation.r, (double)sum.g + compensation.g,
+					  (double)sum.b + compensation.b};
+	}
+	default:
+		*weight = ctx->summed_weights_buffer[index];
+		return ctx->summed_weighted_radiance_buffer[index];
+	}
 }
 
-void write_image(bool update_ldr, bool update_hdr) {
+void write_image(TracyContext* ctx, bool update_ldr, bool update_hdr) {
 	// loop over pixels, do tone mapping and gamma correction
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			int radiance_index = y * width + x;
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) {
+			int radiance_index = y * ctx->width + x;
 
 			// Normalize the final color by dividing by the total sum of weights.
 			// If this were a continuous integral, the sum of weights would be 1.0 and this
 			// step unnecessary. But since we are doing a discrete sum, our total weight
 			// will not be exactly 1.0, so we manually keep track of it.
-			double weight = summed_weights_buffer[radiance_index];
+			double weight;
+			DVec summed = accumulated_radiance(ctx, radiance_index, &weight);
 			Vec radiance =
 				(weight > 0.0)
-					? vec_scale((Vec){(float)summed_weighted_radiance_buffer[radiance_index].x,
-									  (float)summed_weighted_radiance_buffer[radiance_index].y,
-									  (float)summed_weighted_radiance_buffer[radiance_index].z},
+					? vec_scale((Vec){(float)summed.x, (float)summed.y, (float)summed.z},
 								1.0f / (float)weight)
 					: (Vec){0};
 
 			if (update_hdr) {
 				int image_index = radiance_index * 3; // HDR has 3 components (RGB)
-				image_buffer_hdr[image_index + 0] = radiance.x;
-				image_buffer_hdr[image_index + 1] = radiance.y;
-				image_buffer_hdr[image_index + 2] = radiance.z;
+				ctx->image_buffer_hdr[image_index + 0] = radiance.x;
+				ctx->image_buffer_hdr[image_index + 1] = radiance.y;
+				ctx->image_buffer_hdr[image_index + 2] = radiance.z;
 			}
 
 			if (update_ldr) {
@@ -698,136 +3503,484 @@ void write_image(bool update_ldr, bool update_hdr) {
 				Vec ldr_color =
 					TONE_MAP ? vec_linear_to_srgb(reinhard_luminance(radiance)) : radiance;
 
-				image_buffer_ldr[image_index + 0] = quantize(ldr_color.x);
-				image_buffer_ldr[image_index + 1] = quantize(ldr_color.y);
-				image_buffer_ldr[image_index + 2] = quantize(ldr_color.z);
-				image_buffer_ldr[image_index + 3] = quantize(1.0f);
+				ctx->image_buffer_ldr[image_index + 0] = quantize(ldr_color.x);
+				ctx->image_buffer_ldr[image_index + 1] = quantize(ldr_color.y);
+				ctx->image_buffer_ldr[image_index + 2] = quantize(ldr_color.z);
+				ctx->image_buffer_ldr[image_index + 3] = quantize(1.0f);
+			}
+		}
+	}
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* tracy_update_image_ldr(TracyContext* ctx) {
+	write_image(ctx, true, false); // update only LDR buffer
+	return ctx->image_buffer_ldr;
+}
+
+EMSCRIPTEN_KEEPALIVE
+float* tracy_update_image_hdr(TracyContext* ctx) {
+	write_image(ctx, false, true); // update only HDR buffer
+	return ctx->image_buffer_hdr;
+}
+
+// Scatters rocks and mirror balls on a jittered grid, with random rotation around the vertical
+// axis and random (non-uniform for rocks) scale. Writes ROCK_FIELD_SIZE^2 instances.
+void generate_rock_field(Instance* instances) {
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, GLOBAL_SEED, 1);
+	float spacing = 30.0f / ROCK_FIELD_SIZE;
+	for (int z = 0; z < ROCK_FIELD_SIZE; ++z) {
+		for (int x = 0; x < ROCK_FIELD_SIZE; ++x) {
+			Instance* instance = &instances[z * ROCK_FIELD_SIZE + x];
+			instance->mesh = random_float(&rng) < 0.85f ? 0 : 1;
+			float angle = 2.0f * (float)M_PI * random_float(&rng);
+			float size = spacing * (0.15f + 0.2f * random_float(&rng));
+			Vec scale = {size, size, size};
+			if (instance->mesh == 0) scale.y *= 0.4f + 0.8f * random_float(&rng);
+			float c = cosf(angle), s = sinf(angle);
+			Vec position = {
+				spacing * (x + random_float(&rng)) - 15.0f,
+				instance->mesh == 0 ? 0.5f * scale.y : scale.y, // rocks are half buried
+				spacing * (z + random_float(&rng)) - 15.0f,
+			};
+			instance->object_to_world = (Transform){{
+				{c * scale.x, 0, s * scale.z, position.x},
+				{0, scale.y, 0, position.y},
+				{-s * scale.x, 0, c * scale.z, position.z},
+			}};
+		}
+	}
+}
+
+// Generates the lights of scene_many_lights: a grid of small ceiling panels facing down over a
+// large hall, in three colors and with strengths that differ by up to 20x. Every point is lit
+// mostly by the few panels above it.
+void generate_light_grid(Primitive* lights) {
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, GLOBAL_SEED, 2);
+	Vec colors[] = {{1.0f, 0.8f, 0.6f}, {0.6f, 0.8f, 1.0f}, {1.0f, 0.5f, 0.8f}};
+	float spacing = 40.0f / LIGHT_GRID_SIZE;
+	float h = 0.1f * spacing; // half the size of a panel
+	for (int z = 0; z < LIGHT_GRID_SIZE; ++z) {
+		for (int x = 0; x < LIGHT_GRID_SIZE; ++x) {
+			Vec c = {spacing * (x + 0.5f) - 20.0f, 3.0f, spacing * (z + 0.5f) - 20.0f};
+			Vec color = colors[min_int((int)(3.0f * random_float(&rng)), 2)];
+			float strength = 5.0f + 95.0f * random_float(&rng);
+			Material material = {.type = EMISSIVE,
+								 .data.emissive.radiosity = vec_scale(color, strength)};
+			Primitive* panel = &lights[2 * (z * LIGHT_GRID_SIZE + x)];
+			panel[0] = (Primitive){
+				.shape.type = TRIANGLE,
+				.shape.data.triangle = {{c.x - h, c.y, c.z + h}, {c.x + h, c.y, c.z - h},
+										{c.x + h, c.y, c.z + h}, .one_sided = true},
+				.material = material,
+			};
+			panel[1] = (Primitive){
+				.shape.type = TRIANGLE,
+				.shape.data.triangle = {{c.x - h, c.y, c.z + h}, {c.x - h, c.y, c.z - h},
+										{c.x + h, c.y, c.z - h}, .one_sided = true},
+				.material = material,
+			};
+		}
+	}
+}
+
+// Deep copy of the meshes and instances, so that the precomputed triangles and the moved instances
+// belong to one context
+SceneInstances scene_instances_copy(const SceneInstances* source) {
+	SceneInstances copy = *source;
+	copy.meshes = malloc(source->mesh_count * sizeof(Scene));
+	for (int i = 0; i < source->mesh_count; ++i) {
+		Scene mesh = source->meshes[i];
+		copy.meshes[i] = (Scene){malloc(mesh.size * sizeof(Primitive)), mesh.size};
+		// memcpy must not be called with NULL, which empty meshes and instance lists may be
+		if (mesh.size > 0) {
+			memcpy(copy.meshes[i].primitives, mesh.primitives, mesh.size * sizeof(Primitive));
+		}
+	}
+	copy.instances = malloc(source->instance_count * sizeof(Instance));
+	if (source->instance_count > 0) {
+		memcpy(copy.instances, source->instances, source->instance_count * sizeof(Instance));
+	}
+	return copy;
+}
+
+void scene_instances_free(SceneInstances* instances) {
+	for (int i = 0; i < instances->mesh_count; ++i) free(instances->meshes[i].primitives);
+	free(instances->meshes);
+	free(instances->instances);
+	*instances = (SceneInstances){0};
+}
+
+void precompute_triangles(const Scene* scene) {
+	for (int i = 0; i < scene->size; ++i) {
+		if (scene->primitives[i].shape.type == TRIANGLE) {
+			precompute_triangle(&scene->primitives[i].shape.data.triangle);
+		}
+	}
+}
+
+EMSCRIPTEN_KEEPALIVE
+TracyContext* tracy_create() {
+	TracyContext* ctx = calloc(1, sizeof(TracyContext));
+	ctx->built_scene_id = -1;
+	ctx->bvh_builder = BVH_BUILDER_SAH;
+	ctx->use_wide_bvh = true;
+	ctx->light_sampling = true;
+	ctx->sampler = SAMPLER_SOBOL;
+	ctx->tile_size = DEFAULT_TILE_SIZE;
+	ctx->refine_deadline = INFINITY;
+	return ctx;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_destroy(TracyContext* ctx) {
+	tracy_cancel_refine(ctx);
+	tracy_wait_refine(ctx);
+	free(ctx->image_buffer_ldr);
+	free(ctx->image_buffer_hdr);
+	free(ctx->summed_weighted_radiance_buffer);
+	free(ctx->summed_weights_buffer);
+	free(ctx->float_accum_buffer);
+	free(ctx->rng_buffer);
+	free(ctx->sample_count_buffer);
+	free(ctx->moment_buffer);
+	free(ctx->converged_buffer);
+	free(ctx->blue_noise);
+	free(ctx->scene_primitives);
+	scene_instances_free(&ctx->current_instances);
+	blas_free(&ctx->scene_blas);
+	mesh_bvhs_free(ctx);
+	tlas_free(&ctx->scene_tlas);
+	light_list_free(&ctx->lights);
+	free(ctx);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_render_init(TracyContext* ctx, int p_scene_id, int p_max_depth, int p_width,
+					   int p_height, int p_filter_type, double p_cam_angle_x, double p_cam_angle_y,
+					   double p_cam_dist, double p_focus_x, double p_focus_y, double p_focus_z) {
+	tracy_wait_refine(ctx);
+
+	int num_available_scenes = sizeof(all_scenes) / sizeof(Scene);
+	int scene_id = (p_scene_id >= 0 && p_scene_id < num_available_scenes) ? p_scene_id : -1;
+	// the bottom levels only depend on the scene and the builder, camera and instance moves only
+	// rebuild the top level
+	if (scene_id != ctx->built_scene_id || ctx->bvh_builder != ctx->built_bvh_builder) {
+		// primitives and instances may be moved, so the context gets its own copy of the scene.
+		// It's only copied on a scene change, so that moved primitives and instances stay.
+		if (scene_id != ctx->built_scene_id) {
+			Scene scene = scene_id >= 0 ? all_scenes[scene_id] : (Scene){0};
+			free(ctx->scene_primitives);
+			ctx->scene_primitives = malloc(scene.size * sizeof(Primitive));
+			// the empty scene has no primitives to copy from
+			if (scene.size > 0) {
+				memcpy(ctx->scene_primitives, scene.primitives, scene.size * sizeof(Primitive));
 			}
+			ctx->current_scene = (Scene){ctx->scene_primitives, scene.size};
+			SceneInstances instances =
+				scene_id >= 0 ? all_scene_instances[scene_id] : (SceneInstances){0};
+			scene_instances_free(&ctx->current_instances);
+			ctx->current_instances = scene_instances_copy(&instances);
+			if (scene_id == SCENE_ROCK_FIELD) generate_rock_field(ctx->current_instances.instances);
+			if (scene_id == SCENE_MANY_LIGHTS) {
+				generate_light_grid(&ctx->scene_primitives[LIGHT_GRID_FIRST]);
+			}
+		}
+		precompute_triangles(&ctx->current_scene);
+		for (int i = 0; i < ctx->current_instances.mesh_count; ++i) {
+			precompute_triangles(&ctx->current_instances.meshes[i]);
+		}
+		build_scene_bvh(ctx);
+		build_mesh_bvhs(ctx);
+		ctx->built_scene_id = scene_id;
+		ctx->built_bvh_builder = ctx->bvh_builder;
+	}
+	build_scene_tlas(ctx);
+	build_light_list(ctx);
+
+	ctx->max_depth = p_max_depth;
+	ctx->width = p_width;
+	ctx->height = p_height;
+	ctx->filter_type = (FilterType)p_filter_type;
+	initialize_buffers(ctx);
+	ctx->render_sampler = ctx->sampler;
+	if (ctx->render_sampler == SAMPLER_BLUE_NOISE && ctx->blue_noise == NULL) {
+		ctx->blue_noise = generate_blue_noise();
+	}
+
+	Vec focus_point = {(float)p_focus_x, (float)p_focus_y, (float)p_focus_z};
+	// Calculate Camera Position using spherical coordinates around the focus point
+	float cam_x = (float)(p_focus_x + p_cam_dist * sin(p_cam_angle_y) * cos(p_cam_angle_x));
+	float cam_y = (float)(p_focus_y + p_cam_dist * sin(p_cam_angle_x));
+	float cam_z = (float)(p_focus_z + p_cam_dist * cos(p_cam_angle_y) * cos(p_cam_angle_x));
+	ctx->camera_origin = (Vec){cam_x, cam_y, cam_z};
+
+	// Create the cameras coordinate system (basis vectors) 5.1.6
+	ctx->forward = vec_normalize(vec_sub(focus_point, ctx->camera_origin));
+	Vec world_up = {0, 1.0f, 0};
+	ctx->right = vec_normalize(vec_cross(ctx->forward, world_up));
+	ctx->up = vec_normalize(vec_cross(ctx->right, ctx->forward));
+
+	// Initialize RNG state for every pixel once using a fixed global seed and independent PCG
+	// sequences (Stream IDs) per pixel.
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) {
+			int index = y * ctx->width + x;
+			// PCG Stream IDs must be strictly odd numbers
+			uint64_t unique_stream_id = (((uint64_t)index) << 1) | 1;
+			pcg32_srandom_r(&ctx->rng_buffer[index], GLOBAL_SEED, unique_stream_id);
 		}
 	}
 }
 
 EMSCRIPTEN_KEEPALIVE
-uint8_t* update_image_ldr() {
-	write_image(true, false); // update only LDR buffer
-	return image_buffer_ldr;
+void tracy_set_bvh_builder(TracyContext* ctx, int p_builder) {
+	if (p_builder < BVH_BUILDER_SAH || p_builder > BVH_BUILDER_LBVH_TREELET) return;
+	ctx->bvh_builder = (BvhBuilder)p_builder;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_accumulator(TracyContext* ctx, int p_accumulator) {
+	if (p_accumulator < ACCUMULATOR_DOUBLE || p_accumulator > ACCUMULATOR_FLOAT_COMPENSATED) return;
+	ctx->accumulator = (Accumulator)p_accumulator;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_wide_bvh(TracyContext* ctx, bool p_enabled) {
+	ctx->use_wide_bvh = p_enabled;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_light_sampling(TracyContext* ctx, bool p_enabled) {
+	ctx->light_sampling = p_enabled;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_sampler(TracyContext* ctx, int p_sampler) {
+	if (p_sampler < SAMPLER_PCG || p_sampler > SAMPLER_BLUE_NOISE) return;
+	ctx->sampler = (SamplerType)p_sampler;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_adaptive_sampling(TracyContext* ctx, bool p_enabled) {
+	ctx->adaptive_sampling = p_enabled;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_convergence_threshold(TracyContext* ctx, float p_threshold) {
+	ctx->convergence_threshold = fmaxf(p_threshold, 0.0f);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int tracy_get_instance_count(const TracyContext* ctx) {
+	return ctx->current_instances.instance_count;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_instance_transform(TracyContext* ctx, int p_instance, const float* p_transform) {
+	if (p_instance < 0 || p_instance >= ctx->current_instances.instance_count) return;
+	memcpy(ctx->current_instances.instances[p_instance].object_to_world.m, p_transform,
+		   12 * sizeof(float));
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_refine_grain(TracyContext* ctx, int p_samples) {
+	ctx->refine_grain = max_int(p_samples, 0);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_deterministic(TracyContext* ctx, bool p_enabled) { ctx->deterministic = p_enabled; }
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_tile_size(TracyContext* ctx, int p_size) {
+	ctx->tile_size = max_int(p_size, MIN_TILE_SIZE);
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool render_set_thread_backend(int p_backend) {
+	bool available = p_backend == THREAD_BACKEND_SERIAL;
+#ifdef _OPENMP
+	available = available || p_backend == THREAD_BACKEND_OPENMP;
+#endif
+#ifdef TRACY_THREAD_POOL
+	available = available || p_backend == THREAD_BACKEND_POOL;
+#endif
+	if (available) thread_backend = (ThreadBackend)p_backend;
+	return available;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_thread_count(int p_threads) {
+	int threads = min_int(max_int(p_threads, 0), MAX_THREAD_COUNT);
+	if (threads == thread_count) return;
+	thread_count = threads;
+#ifdef TRACY_THREAD_POOL
+	restart_thread_pool();
+#endif
+}
+
+EMSCRIPTEN_KEEPALIVE
+int render_get_thread_count() {
+#ifdef TRACY_THREAD_POOL
+	// doesn't start the pool, that is left to the first render
+	if (thread_backend == THREAD_BACKEND_POOL) return thread_pool_thread_count();
+#endif
+	return parallel_thread_count();
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool render_set_thread_affinity(const int* p_cores, int p_core_count) {
+#ifdef THREAD_AFFINITY
+	// a cpu_set_t only holds the cores below CPU_SETSIZE
+	for (int i = 0; p_cores != NULL && i < p_core_count; ++i) {
+		if (p_cores[i] < 0 || p_cores[i] >= CPU_SETSIZE) return false;
+	}
+	free(thread_cores);
+	thread_cores = NULL;
+	thread_core_count = 0;
+	if (p_cores != NULL && p_core_count > 0) {
+		thread_cores = malloc(p_core_count * sizeof(int));
+		memcpy(thread_cores, p_cores, p_core_count * sizeof(int));
+		thread_core_count = p_core_count;
+	}
+	restart_thread_pool();
+	return true;
+#else
+	(void)p_cores;
+	(void)p_core_count;
+	return false;
+#endif
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool render_set_numa_node(int p_node) {
+#ifdef THREAD_AFFINITY
+	if (p_node < 0) return render_set_thread_affinity(NULL, 0);
+	int core_count;
+	int* cores = numa_node_cores(p_node, &core_count);
+	if (cores == NULL) return false;
+	free(thread_cores);
+	thread_cores = cores;
+	thread_core_count = core_count;
+	restart_thread_pool();
+	return true;
+#else
+	(void)p_node;
+	return false;
+#endif
+}
+
+EMSCRIPTEN_KEEPALIVE
+int tracy_get_primitive_count(const TracyContext* ctx) {
+	return ctx->current_scene.size;
 }
 
 EMSCRIPTEN_KEEPALIVE
-float* update_image_hdr() {
-	write_image(false, true); // update only HDR buffer
-	return image_buffer_hdr;
+bool tracy_set_sphere(TracyContext* ctx, int p_primitive, float p_x, float p_y, float p_z,
+					  float p_radius) {
+	if (p_primitive < 0 || p_primitive >= ctx->current_scene.size) return false;
+	Shape* shape = &ctx->current_scene.primitives[p_primitive].shape;
+	if (shape->type != SPHERE) return false;
+	shape->data.sphere = (Sphere){{p_x, p_y, p_z}, p_radius};
+	return true;
 }
 
 EMSCRIPTEN_KEEPALIVE
-void render_init(int p_scene_id, int p_max_depth, int p_width, int p_height, int p_filter_type,
-				 double p_cam_angle_x, double p_cam_angle_y, double p_cam_dist, double p_focus_x,
-				 double p_focus_y, double p_focus_z) {
-
-	int num_available_scenes = sizeof(all_scenes) / sizeof(Scene);
-	current_scene = (p_scene_id >= 0 && p_scene_id < num_available_scenes) ? all_scenes[p_scene_id]
-																		   : (Scene){0};
-	// Precompute triangle edges
-	for (int i = 0; i < current_scene.size; ++i) {
-		if (current_scene.primitives[i].shape.type == TRIANGLE) {
-			precompute_triangle(&current_scene.primitives[i].shape.data.triangle);
-		}
-	}
-
-	max_depth = p_max_depth;
-	width = p_width;
-	height = p_height;
-	filter_type = (FilterType)p_filter_type;
-	initialize_buffers();
-
-	Vec focus_point = {(float)p_focus_x, (float)p_focus_y, (float)p_focus_z};
-	// Calculate Camera Position using spherical coordinates around the focus point
-	float cam_x = (float)(p_focus_x + p_cam_dist * sin(p_cam_angle_y) * cos(p_cam_angle_x));
-	float cam_y = (float)(p_focus_y + p_cam_dist * sin(p_cam_angle_x));
-	float cam_z = (float)(p_focus_z + p_cam_dist * cos(p_cam_angle_y) * cos(p_cam_angle_x));
-	camera_origin = (Vec){cam_x, cam_y, cam_z};
-
-	// Create the cameras coordinate system (basis vectors) 5.1.6
-	forward = vec_normalize(vec_sub(focus_point, camera_origin));
-	Vec world_up = {0, 1.0f, 0};
-	right = vec_normalize(vec_cross(forward, world_up));
-	up = vec_normalize(vec_cross(right, forward));
-
-	// Initialize RNG state for every pixel once using a fixed global seed and independent PCG
-	// sequences (Stream IDs) per pixel.
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			int index = y * width + x;
-			// PCG Stream IDs must be strictly odd numbers
-			uint64_t unique_stream_id = (((uint64_t)index) << 1) | 1;
-			pcg32_srandom_r(&rng_buffer[index], GLOBAL_SEED, unique_stream_id);
-		}
-	}
+bool tracy_set_triangle(TracyContext* ctx, int p_primitive, const float* p_vertices) {
+	if (p_primitive < 0 || p_primitive >= ctx->current_scene.size) return false;
+	Shape* shape = &ctx->current_scene.primitives[p_primitive].shape;
+	if (shape->type != TRIANGLE) return false;
+	Triangle* tri = &shape->data.triangle;
+	tri->v0 = (Vec){p_vertices[0], p_vertices[1], p_vertices[2]};
+	tri->v1 = (Vec){p_vertices[3], p_vertices[4], p_vertices[5]};
+	tri->v2 = (Vec){p_vertices[6], p_vertices[7], p_vertices[8]};
+	precompute_triangle(tri);
+	return true;
 }
 
 EMSCRIPTEN_KEEPALIVE
-void render_refine(unsigned int n_samples) {
+void tracy_update_scene(TracyContext* ctx) {
+	tracy_wait_refine(ctx);
+	refit_scene_bvh(ctx);
+	build_scene_tlas(ctx);
+	build_light_list(ctx);
+	clear_accumulation_buffers(ctx);
+}
 
-	const float aspect_ratio = (float)width / height;
+// Samples per work item if no grain is set: as many as possible while leaving enough work items
+// to balance the load between the threads. The batches of a tile are summed separately, so the
+// grain changes the rounding of the result, the deterministic mode assumes a fixed thread count.
+int automatic_refine_grain(int n_samples, int tile_count, bool deterministic) {
+	int threads = deterministic ? DETERMINISTIC_GRAIN_THREADS : parallel_thread_count();
+	int grain = (int)((int64_t)n_samples * tile_count / (REFINE_ITEMS_PER_THREAD * threads));
+	return max_int(min_int(grain, n_samples), 1);
+}
+
+// Renders the given number of samples for every pixel of the tile and splats the radiance into the
+// tile buffer
+void render_tile(const TracyContext* ctx, Tile tile, int samples, float filter_radius,
+				 TileBuffer* buffer) {
+	const float aspect_ratio = (float)ctx->width / ctx->height;
 	const float fov_y = 30.0f * 3.141f / 180.0f;
 	const float fov_scale = tanf(fov_y / 2.0f); // 5.1.4
 
-	float filter_radius;
-	if (filter_type == FILTER_BOX) {
-		filter_radius = BOX_RADIUS;
-	} else if (filter_type == FILTER_GAUSSIAN) {
-		filter_radius = GAUSS_RADIUS;
-	} else if (filter_type == FILTER_MITCHELL) {
-		filter_radius = MITCHELL_RADIUS;
-	} else {
-		assert(false); // filter not implemented
-	}
-
-	for (size_t sample_index = 0; sample_index < n_samples; ++sample_index) {
-		// We do Sample Splatting: A single ray distributes weighted radiance to all neighboring
-		// pixels within the filter radius (e.g. 2x2 block).
-
-		// Optimization: To make this thread-safe without slow floating-point atomics, accumulate
-		// into thread-local tile buffers (with padding/ghost zones) and merge them once the tile is
-		// done.
-
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
-#endif
-		// loop over pixels, calculate radiance
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
+	for (int sample = 0; sample < samples; ++sample) {
+		for (int y = tile.y0; y < tile.y1; ++y) {
+			for (int x = tile.x0; x < tile.x1; ++x) {
 				if (x == 560 && y == 90) {
 					// use for setting breakpoint
 					// volatile tells the compiler not to remove it
 					__asm__ __volatile__("nop");
 				}
 
-				// Use the persistent RNG state for this pixel
-				pcg32_random_t* rng_state = &rng_buffer[y * width + x];
+				// converged pixels of adaptive sampling get no more samples
+				int pixel = y * ctx->width + x;
+				if (ctx->converged_buffer != NULL && ctx->converged_buffer[pixel]) continue;
+
+				// Use the persistent RNG state for this pixel, or its sequence continued at the
+				// number of samples it has so far
+				bool blue_noise = ctx->render_sampler == SAMPLER_BLUE_NOISE;
+				Sampler sampler = {
+					.type = ctx->render_sampler,
+					.rng = &ctx->rng_buffer[pixel],
+					// the blue noise pixels share one sequence and only differ by the rotation
+					.seed = hash_uint32((uint32_t)(blue_noise ? 0 : pixel) ^ (uint32_t)GLOBAL_SEED),
+					.reversed_index = reverse_bits(ctx->sample_count_buffer[pixel] + sample),
+					.blue_noise = ctx->blue_noise,
+					.x = x,
+					.y = y,
+				};
 
 				// Sample splatting strategy:
 				// Pick a specific point on the continuous film plane within this pixel.
 				// We jitter by[-0.5, 0.5) to cover the pixel area evenly.
-				// TODO: Use a better more uniform distribution
-				float jitter_x = random_float(rng_state) - 0.5f;
-				float jitter_y = random_float(rng_state) - 0.5f;
+				float jitter_x, jitter_y;
+				sampler_2d(&sampler, &jitter_x, &jitter_y);
+				jitter_x -= 0.5f;
+				jitter_y -= 0.5f;
 
 				float film_x = x + (0.5f + jitter_x);
 				float film_y = y + (0.5f + jitter_y);
 
 				// 5.2.2
 				// Map coordinates to the view plane (-1;1)
-				float world_x = (2.0f * film_x / width - 1.0f);
-				float world_y = 1.0f - 2.0f * film_y / height;
+				float world_x = (2.0f * film_x / ctx->width - 1.0f);
+				float world_y = 1.0f - 2.0f * film_y / ctx->height;
 
 				// Calculate the direction for the ray for this sample
-				Vec right_comp = vec_scale(right, world_x * fov_scale * aspect_ratio);
-				Vec up_comp = vec_scale(up, world_y * fov_scale);
-				Vec dir = vec_normalize(vec_add(forward, vec_add(right_comp, up_comp)));
+				Vec right_comp = vec_scale(ctx->right, world_x * fov_scale * aspect_ratio);
+				Vec up_comp = vec_scale(ctx->up, world_y * fov_scale);
+				Vec dir = vec_normalize(vec_add(ctx->forward, vec_add(right_comp, up_comp)));
 
-				Ray r = {camera_origin, dir};
-				Vec radiance = radiance_from_ray(r, rng_state);
+				Ray r = {ctx->camera_origin, dir};
+				Vec radiance = radiance_from_ray(ctx, r, &sampler);
+				if (ctx->moment_buffer != NULL) {
+					double sample_luminance = luminance(radiance);
+					ctx->moment_buffer[pixel].sum += sample_luminance;
+					ctx->moment_buffer[pixel].sum_squares += sample_luminance * sample_luminance;
+				}
 
 				// Distribute (Splat) the radiance to all neighboring pixels within filter range.
 				// Determine the integer range of pixels where the pixel center (x + 0.5) falls
@@ -839,7 +3992,7 @@ void render_refine(unsigned int n_samples) {
 
 				// with box filtering only the original pixel should be covered (at least with
 				// radius 0.5 or lower)
-				if (filter_type == FILTER_BOX && BOX_RADIUS <= 0.5f) {
+				if (ctx->filter_type == FILTER_BOX && BOX_RADIUS <= 0.5f) {
 					assert(min_nx == x && max_nx == x + 1 && min_ny == y && max_ny == y + 1);
 				}
 
@@ -848,46 +4001,30 @@ void render_refine(unsigned int n_samples) {
 						// Boundary check: ensure we don't write outside valid memory.
 						// Note: Pixels at the very edge will receive less weight (fewer samples),
 						// resulting in higher variance/noise at borders, but correct average.
-						if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
+						if (nx >= 0 && nx < ctx->width && ny >= 0 && ny < ctx->height) {
 							// Calculate weight based on distance from sample to neighbor pixel
 							// center
 							float dist_x = (x - nx) + jitter_x;
 							float dist_y = (y - ny) + jitter_y;
 
 							float weight;
-							if (filter_type == FILTER_BOX) {
+							if (ctx->filter_type == FILTER_BOX) {
 								weight = box_1d(dist_x) * box_1d(dist_y);
-							} else if (filter_type == FILTER_GAUSSIAN) {
+							} else if (ctx->filter_type == FILTER_GAUSSIAN) {
 								weight = gaussian_weight_2d(dist_x, dist_y, GAUSS_SIGMA);
-							} else if (filter_type == FILTER_MITCHELL) {
+							} else if (ctx->filter_type == FILTER_MITCHELL) {
 								weight = mitchell_1d(dist_x) * mitchell_1d(dist_y);
 							} else {
 								assert(false); // filter not implemented
 							}
 
-							int index = ny * width + nx;
+							// the tile buffer's border covers the filter reach, so this is in range
+							int index = (ny - buffer->y) * buffer->stride + (nx - buffer->x);
 							Vec weighted_rad = vec_scale(radiance, weight);
-
-							// clang-format off
-							#ifdef _OPENMP
-							// Atomics are required here because multiple threads may splat
-							// to the same neighbor pixel simultaneously.
-							#pragma omp atomic
-							summed_weighted_radiance_buffer[index].x += (double)weighted_rad.x;
-							#pragma omp atomic
-							summed_weighted_radiance_buffer[index].y += (double)weighted_rad.y;
-							#pragma omp atomic
-							summed_weighted_radiance_buffer[index].z += (double)weighted_rad.z;
-
-							#pragma omp atomic
-							summed_weights_buffer[index] += (double)weight;
-							#else
-							summed_weighted_radiance_buffer[index].x += (double)weighted_rad.x;
-							summed_weighted_radiance_buffer[index].y += (double)weighted_rad.y;
-							summed_weighted_radiance_buffer[index].z += (double)weighted_rad.z;
-							summed_weights_buffer[index] += (double)weight;
-							#endif
-							// clang-format on
+							buffer->radiance[index].x += (double)weighted_rad.x;
+							buffer->radiance[index].y += (double)weighted_rad.y;
+							buffer->radiance[index].z += (double)weighted_rad.z;
+							buffer->weights[index] += (double)weight;
 						}
 					}
 				}
@@ -895,3 +4032,629 @@ void render_refine(unsigned int n_samples) {
 		}
 	}
 }
+
+// Pixels of the ghost border (outside the tile, within the filter reach) are stored per tile in
+// rows above the tile, rows below the tile and columns left and right of the tile, in this order.
+int ghost_border_size(const TracyContext* ctx, int reach) {
+	return 2 * reach * (ctx->tile_size + 2 * reach) + 2 * reach * ctx->tile_size;
+}
+
+int ghost_border_index(Tile tile, int reach, int x, int y) {
+	int padded_width = tile.x1 - tile.x0 + 2 * reach;
+	int height = tile.y1 - tile.y0;
+	if (y < tile.y0) return (y - tile.y0 + reach) * padded_width + (x - tile.x0 + reach);
+	if (y >= tile.y1) return (reach + y - tile.y1) * padded_width + (x - tile.x0 + reach);
+	int columns = 2 * reach * padded_width;
+	if (x < tile.x0) return columns + (y - tile.y0) * reach + (x - tile.x0 + reach);
+	return columns + height * reach + (y - tile.y0) * reach + (x - tile.x1);
+}
+
+// Adds a rendered tile buffer to the accumulation buffers. Only this thread writes the pixels of
+// the tile during the parallel phase of render_refine. The ghost border belongs to neighboring
+// tiles, so it is collected in the tile's ghost buffer and gathered by the neighbors afterwards.
+void merge_tile(TracyContext* ctx, Tile tile, int reach, const TileBuffer* buffer,
+				DVec* ghost_radiance, double* ghost_weights) {
+	for (int y = max_int(tile.y0 - reach, 0); y < min_int(tile.y1 + reach, ctx->height); ++y) {
+		for (int x = max_int(tile.x0 - reach, 0); x < min_int(tile.x1 + reach, ctx->width); ++x) {
+			int tile_index = (y - buffer->y) * buffer->stride + (x - buffer->x);
+			DVec radiance = buffer->radiance[tile_index];
+			double weight = buffer->weights[tile_index];
+			if (x >= tile.x0 && x < tile.x1 && y >= tile.y0 && y < tile.y1) {
+				accumulate(ctx, y * ctx->width + x, radiance, weight);
+			} else {
+				int index = ghost_border_index(tile, reach, x, y);
+				ghost_radiance[index].x += radiance.x;
+				ghost_radiance[index].y += radiance.y;
+				ghost_radiance[index].z += radiance.z;
+				ghost_weights[index] += weight;
+			}
+		}
+	}
+}
+
+Tile get_tile(const TracyContext* ctx, int tile_x, int tile_y) {
+	Tile tile = {.x0 = tile_x * ctx->tile_size, .y0 = tile_y * ctx->tile_size};
+	tile.x1 = min_int(tile.x0 + ctx->tile_size, ctx->width);
+	tile.y1 = min_int(tile.y0 + ctx->tile_size, ctx->height);
+	return tile;
+}
+
+// Adds the ghost borders of the neighbors that overlap the tile, always in the same order
+void gather_ghost_borders(TracyContext* ctx, int tile_x, int tile_y, int tiles_x, int tiles_y,
+						  int reach, const DVec* ghost_radiance, const double* ghost_weights) {
+	Tile tile = get_tile(ctx, tile_x, tile_y);
+	int ghost_size = ghost_border_size(ctx, reach);
+	for (int neighbor_y = tile_y - 1; neighbor_y <= tile_y + 1; ++neighbor_y) {
+		for (int neighbor_x = tile_x - 1; neighbor_x <= tile_x + 1; ++neighbor_x) {
+			bool outside = neighbor_x < 0 || neighbor_x >= tiles_x || neighbor_y < 0 ||
+						   neighbor_y >= tiles_y;
+			if (outside || (neighbor_x == tile_x && neighbor_y == tile_y)) continue;
+			Tile neighbor = get_tile(ctx, neighbor_x, neighbor_y);
+			int offset = (neighbor_y * tiles_x + neighbor_x) * ghost_size;
+			int y_begin = max_int(tile.y0, neighbor.y0 - reach);
+			int y_end = min_int(tile.y1, neighbor.y1 + reach);
+			int x_begin = max_int(tile.x0, neighbor.x0 - reach);
+			int x_end = min_int(tile.x1, neighbor.x1 + reach);
+			for (int y = y_begin; y < y_end; ++y) {
+				for (int x = x_begin; x < x_end; ++x) {
+					int ghost_index = offset + ghost_border_index(neighbor, reach, x, y);
+					accumulate(ctx, y * ctx->width + x, ghost_radiance[ghost_index],
+							   ghost_weights[ghost_index]);
+				}
+			}
+		}
+	}
+}
+
+void work_deque_push(WorkDeque* deque, TileWork work) {
+	mutex_lock(&deque->lock);
+	if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+	deque->items[deque->bottom++] = work;
+	mutex_unlock(&deque->lock);
+}
+
+// Takes the item at the bottom (owner) or at the top (thief), returns false if the deque is empty
+bool work_deque_take(WorkDeque* deque, bool steal, TileWork* work) {
+	mutex_lock(&deque->lock);
+	bool found = deque->top < deque->bottom;
+	if (found) *work = steal ? deque->items[deque->top++] : deque->items[--deque->bottom];
+	mutex_unlock(&deque->lock);
+	return found;
+}
+
+// Orders the tiles along a Morton curve, so that consecutive tiles are close to each other
+int* morton_ordered_tiles(int tiles_x, int tiles_y) {
+	int tile_count = tiles_x * tiles_y;
+	uint64_t* keys = malloc(tile_count * sizeof(uint64_t));
+	int* tiles = malloc(tile_count * sizeof(int));
+	for (int i = 0; i < tile_count; ++i) {
+		keys[i] = (morton_spread_21(i % tiles_x) << 1) | morton_spread_21(i / tiles_x);
+		tiles[i] = i;
+	}
+	radix_sort_pairs(keys, tiles, tile_count, 64);
+	free(keys);
+	return tiles;
+}
+
+// Wakes the threads waiting in refine_wait_for_work
+void refine_notify_work(RefineJob* job) {
+	mutex_lock(&job->idle_lock);
+	atomic_fetch_add_int(&job->work_generation, 1);
+	condition_broadcast(&job->work_changed);
+	mutex_unlock(&job->idle_lock);
+}
+
+// Waits until a running thread queued or finished an item, or left, after the generation was read.
+// The items in progress belong to running threads, so this never waits for a thread that is not
+// started yet.
+void refine_wait_for_work(RefineJob* job, int generation) {
+	mutex_lock(&job->idle_lock);
+	while (atomic_load_int(&job->work_generation) == generation &&
+		   atomic_load_int(&job->remaining_items) > 0) {
+		condition_wait(&job->work_changed, &job->idle_lock);
+	}
+	mutex_unlock(&job->idle_lock);
+}
+
+// First parallel phase of render_refine: renders the work items, taking them from the own deque
+// first and stealing from the others when it runs empty
+void refine_render_tiles(void* context, int thread, int threads) {
+	(void)threads;
+	RefineJob* job = context;
+	WorkDeque* own = &job->deques[thread % job->deque_count];
+
+	// We do Sample Splatting: A single ray distributes weighted radiance to all neighboring pixels
+	// within the filter radius (e.g. 2x2 block).
+
+	// To make this thread-safe without floating-point atomics, every thread accumulates its tile
+	// into a private tile buffer with a border (ghost zone) of the filter reach. The border is
+	// gathered by the neighboring tiles at the end, in a fixed order, so the result does not
+	// depend on which thread rendered which tile.
+	TileBuffer buffer = {
+		.radiance = malloc(job->tile_buffer_size * sizeof(DVec)),
+		.weights = malloc(job->tile_buffer_size * sizeof(double)),
+		.stride = job->tile_stride,
+	};
+	TracyContext* ctx = job->ctx;
+	while (atomic_load_int(&job->remaining_items) > 0) {
+		// a cancelled refine stops between work items, the finished ones stay in the image
+		if (atomic_load_int(&ctx->refine_cancelled)) break;
+		if (ctx->refine_deadline < INFINITY && monotonic_seconds() >= ctx->refine_deadline) break;
+		int generation = atomic_load_int(&job->work_generation);
+		TileWork work = {0};
+		bool found = work_deque_take(own, false, &work);
+		for (int i = 1; i < job->deque_count && !found; ++i) {
+			WorkDeque* victim = &job->deques[(thread + i) % job->deque_count];
+			found = work_deque_take(victim, true, &work);
+		}
+		if (!found) {
+			// the remaining items are in progress, their next batches may be queued
+			refine_wait_for_work(job, generation);
+			continue;
+		}
+
+		int tile_index = job->tiles[work.tile];
+		Tile tile = get_tile(ctx, tile_index % job->tiles_x, tile_index / job->tiles_x);
+		buffer.x = tile.x0 - job->filter_reach;
+		buffer.y = tile.y0 - job->filter_reach;
+		memset(buffer.radiance, 0, job->tile_buffer_size * sizeof(DVec));
+		memset(buffer.weights, 0, job->tile_buffer_size * sizeof(double));
+		int tile_samples = job->tile_samples[tile_index];
+		int samples = min_int(job->grain, tile_samples - work.batch * job->grain);
+		render_tile(ctx, tile, samples, job->filter_radius, &buffer);
+		// the batches of a tile run one after another, no other thread writes these pixels
+		for (int y = tile.y0; y < tile.y1; ++y) {
+			int* counts = &ctx->sample_count_buffer[y * ctx->width];
+			const bool* converged =
+				ctx->converged_buffer != NULL ? &ctx->converged_buffer[y * ctx->width] : NULL;
+			for (int x = tile.x0; x < tile.x1; ++x) {
+				if (converged == NULL || !converged[x]) counts[x] += samples;
+			}
+		}
+		merge_tile(ctx, tile, job->filter_reach, &buffer,
+				   &job->ghost_radiance[tile_index * job->ghost_size],
+				   &job->ghost_weights[tile_index * job->ghost_size]);
+
+		if ((work.batch + 1) * job->grain < tile_samples) {
+			work_deque_push(own, (TileWork){work.tile, work.batch + 1});
+		}
+		atomic_fetch_add_int(&job->remaining_items, -1);
+		refine_notify_work(job);
+		int completed = atomic_fetch_add_int(&ctx->refine_completed, 1) + 1;
+		if (ctx->progress_callback != NULL) {
+			ctx->progress_callback(completed, ctx->refine_total, ctx->progress_user_data);
+		}
+	}
+	// the waiting threads check the cancellation and the deadline themselves
+	refine_notify_work(job);
+	free(buffer.radiance);
+	free(buffer.weights);
+}
+
+// Second parallel phase of render_refine, after all tiles are rendered: gathers the ghost borders
+void refine_gather_tiles(void* context, int thread, int threads) {
+	(void)thread;
+	(void)threads;
+	RefineJob* job = context;
+	int i;
+	while ((i = atomic_fetch_add_int(&job->next_gather_tile, 1)) < job->tile_count) {
+		gather_ghost_borders(job->ctx, i % job->tiles_x, i / job->tiles_x, job->tiles_x,
+							 job->tiles_y, job->filter_reach, job->ghost_radiance,
+							 job->ghost_weights);
+	}
+}
+
+// Relative standard error of the pixel's mean luminance, estimated from the variance of its
+// samples, or INFINITY while it has too few samples for an estimate (adaptive sampling)
+double pixel_relative_error(const TracyContext* ctx, int pixel) {
+	int n = ctx->sample_count_buffer[pixel];
+	if (n < ADAPTIVE_MIN_SAMPLES) return INFINITY;
+	LuminanceMoments moments = ctx->moment_buffer[pixel];
+	double mean = moments.sum / n;
+	double variance = fmax(moments.sum_squares / n - mean * mean, 0.0) * n / (n - 1);
+	return sqrt(variance / n) / (mean + ADAPTIVE_DARK_LUMINANCE);
+}
+
+// A pixel converged if its error and the errors of its neighbors are below the threshold. Paths
+// that are rarely found, like caustics, may not have hit a pixel at all in its first samples and
+// leave it without variance, but rarely miss all of its neighbors as well.
+bool pixel_converged(const TracyContext* ctx, int x, int y) {
+	if (ctx->convergence_threshold <= 0.0f) return false;
+	for (int neighbor_y = max_int(y - 1, 0); neighbor_y <= min_int(y + 1, ctx->height - 1);
+		 ++neighbor_y) {
+		for (int neighbor_x = max_int(x - 1, 0); neighbor_x <= min_int(x + 1, ctx->width - 1);
+			 ++neighbor_x) {
+			double error = pixel_relative_error(ctx, neighbor_y * ctx->width + neighbor_x);
+			if (!(error < ctx->convergence_threshold)) return false;
+		}
+	}
+	return true;
+}
+
+// Adaptive sampling: stops the pixels whose error is below the convergence threshold and shares the
+// samples of the refine (n_samples for every other pixel) between the tiles in proportion to the
+// mean error of their other pixels. Tiles with pixels that have no error estimate yet get
+// n_samples. Only depends on the buffers, so the deterministic mode stays deterministic.
+void distribute_adaptive_samples(TracyContext* ctx, RefineJob* job) {
+	double* summed_errors = calloc(job->tile_count, sizeof(double));
+	int* active_pixels = calloc(job->tile_count, sizeof(int));
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) {
+			int pixel = y * ctx->width + x;
+			int tile = (y / ctx->tile_size) * job->tiles_x + x / ctx->tile_size;
+			ctx->converged_buffer[pixel] = pixel_converged(ctx, x, y);
+			if (ctx->converged_buffer[pixel]) continue;
+			summed_errors[tile] += pixel_relative_error(ctx, pixel);
+			active_pixels[tile]++;
+		}
+	}
+	double total_error = 0.0;
+	int64_t estimated_pixels = 0;
+	for (int tile = 0; tile < job->tile_count; ++tile) {
+		if (active_pixels[tile] == 0 || isinf(summed_errors[tile])) continue;
+		total_error += summed_errors[tile];
+		estimated_pixels += active_pixels[tile];
+	}
+	for (int tile = 0; tile < job->tile_count; ++tile) {
+		int samples = job->n_samples;
+		if (active_pixels[tile] == 0) {
+			samples = 0;
+		} else if (!isinf(summed_errors[tile]) && total_error > 0.0) {
+			double mean_error = summed_errors[tile] / active_pixels[tile];
+			double share = job->n_samples * (double)estimated_pixels * mean_error / total_error;
+			samples = (int)fmin(share + 0.5, (double)ADAPTIVE_MAX_FACTOR * job->n_samples);
+		}
+		job->tile_samples[tile] = samples;
+	}
+	free(summed_errors);
+	free(active_pixels);
+}
+
+// Body of tracy_render_refine and tracy_render_refine_async
+void run_refine(TracyContext* ctx, unsigned int n_samples) {
+	float filter_radius;
+	if (ctx->filter_type == FILTER_BOX) {
+		filter_radius = BOX_RADIUS;
+	} else if (ctx->filter_type == FILTER_GAUSSIAN) {
+		filter_radius = GAUSS_RADIUS;
+	} else if (ctx->filter_type == FILTER_MITCHELL) {
+		filter_radius = MITCHELL_RADIUS;
+	} else {
+		assert(false); // filter not implemented
+	}
+	RefineJob job = {.ctx = ctx, .n_samples = (int)n_samples, .filter_radius = filter_radius};
+	// Samples are splatted to at most this many pixels away from their own pixel. The jitter is in
+	// [-0.5, 0.5), so the neighbors are those with |offset| < filter_radius + 0.5.
+	job.filter_reach = (int)ceilf(filter_radius + 0.5f) - 1;
+
+	job.tiles_x = (ctx->width + ctx->tile_size - 1) / ctx->tile_size;
+	job.tiles_y = (ctx->height + ctx->tile_size - 1) / ctx->tile_size;
+	job.tile_count = job.tiles_x * job.tiles_y;
+	job.tile_stride = ctx->tile_size + 2 * job.filter_reach;
+	job.tile_buffer_size = job.tile_stride * job.tile_stride;
+	job.ghost_size = ghost_border_size(ctx, job.filter_reach);
+	job.ghost_radiance = calloc(job.tile_count * job.ghost_size, sizeof(DVec));
+	job.ghost_weights = calloc(job.tile_count * job.ghost_size, sizeof(double));
+
+	job.tile_samples = malloc(job.tile_count * sizeof(int));
+	if (ctx->moment_buffer != NULL) {
+		distribute_adaptive_samples(ctx, &job);
+	} else {
+		for (int tile = 0; tile < job.tile_count; ++tile) job.tile_samples[tile] = job.n_samples;
+	}
+
+	// Work items are (tile, batch of samples) pairs. The batches of a tile must run in order,
+	// because they advance the same per-pixel RNG states, so only the first batch of every tile is
+	// queued initially and finishing a batch queues the next one.
+	int threads = parallel_thread_count();
+	job.grain = ctx->refine_grain > 0
+					? ctx->refine_grain
+					: automatic_refine_grain(n_samples, job.tile_count, ctx->deterministic);
+	job.remaining_items = 0;
+	for (int tile = 0; tile < job.tile_count; ++tile) {
+		job.remaining_items += (job.tile_samples[tile] + job.grain - 1) / job.grain;
+	}
+	atomic_store_int(&ctx->refine_total, job.remaining_items);
+	job.tiles = morton_ordered_tiles(job.tiles_x, job.tiles_y);
+
+	// every thread starts with a contiguous range of the Morton ordered tiles, so it works on one
+	// region of the image. Thieves steal from the far end of the range.
+	job.deque_count = threads;
+	job.deques = malloc(threads * sizeof(WorkDeque));
+	for (int thread = 0; thread < threads; ++thread) {
+		int begin = (int)((int64_t)job.tile_count * thread / threads);
+		int end = (int)((int64_t)job.tile_count * (thread + 1) / threads);
+		WorkDeque* deque = &job.deques[thread];
+		deque->items = malloc((end - begin + 1) * sizeof(TileWork));
+		deque->top = deque->bottom = 0;
+		mutex_init(&deque->lock);
+		for (int i = end - 1; i >= begin; --i) {
+			if (job.tile_samples[job.tiles[i]] > 0) work_deque_push(deque, (TileWork){i, 0});
+		}
+	}
+
+	// two parallel sections per call, no fork/join or barrier per sample pass
+	mutex_init(&job.idle_lock);
+	condition_init(&job.work_changed);
+	parallel_run(refine_render_tiles, &job, threads);
+	parallel_run(refine_gather_tiles, &job, threads);
+	condition_destroy(&job.work_changed);
+	mutex_destroy(&job.idle_lock);
+
+	for (int thread = 0; thread < threads; ++thread) {
+		mutex_destroy(&job.deques[thread].lock);
+		free(job.deques[thread].items);
+	}
+	free(job.deques);
+	free(job.tiles);
+	free(job.tile_samples);
+	free(job.ghost_radiance);
+	free(job.ghost_weights);
+}
+
+// Starts the progress and cancellation of a new refine
+void reset_refine_progress(TracyContext* ctx) {
+	ctx->refine_completed = 0;
+	ctx->refine_total = 0;
+	ctx->refine_cancelled = 0;
+	ctx->refine_deadline = INFINITY;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_wait_refine(TracyContext* ctx) {
+#ifdef TRACY_THREAD_POOL
+	if (ctx->refine_thread_started) pthread_join(ctx->refine_thread, NULL);
+	ctx->refine_thread_started = false;
+#else
+	(void)ctx;
+#endif
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_render_refine(TracyContext* ctx, unsigned int n_samples) {
+	tracy_wait_refine(ctx);
+	reset_refine_progress(ctx);
+	run_refine(ctx, n_samples);
+}
+
+#ifdef TRACY_THREAD_POOL
+void* refine_thread_main(void* context) {
+	TracyContext* ctx = context;
+	run_refine(ctx, ctx->refine_thread_samples);
+	atomic_store_int(&ctx->refining, 0);
+	return NULL;
+}
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_render_refine_async(TracyContext* ctx, unsigned int n_samples) {
+	tracy_wait_refine(ctx);
+	reset_refine_progress(ctx);
+#ifdef TRACY_THREAD_POOL
+	ctx->refine_thread_samples = n_samples;
+	ctx->refining = 1;
+	if (pthread_create(&ctx->refine_thread, NULL, refine_thread_main, ctx) == 0) {
+		ctx->refine_thread_started = true;
+		return;
+	}
+	ctx->refining = 0;
+#endif
+	// without threads, the refine is finished when this returns
+	run_refine(ctx, n_samples);
+}
+
+int64_t summed_sample_counts(const TracyContext* ctx) {
+	int64_t sum = 0;
+	for (int i = 0; i < ctx->width * ctx->height; ++i) sum += ctx->sample_count_buffer[i];
+	return sum;
+}
+
+EMSCRIPTEN_KEEPALIVE
+float tracy_render_refine_for(TracyContext* ctx, double p_budget_ms) {
+	tracy_wait_refine(ctx);
+	reset_refine_progress(ctx);
+	int64_t samples_before = summed_sample_counts(ctx);
+	double start = monotonic_seconds();
+	ctx->refine_deadline = start + p_budget_ms * 1e-3;
+	// The first pass renders one sample per pixel and measures how long that takes, the following
+	// passes render as many samples as should fit into the remaining time. Few passes keep the
+	// per-pass overhead low, the deadline check per work item stops the last pass in time.
+	double sample_seconds = 0.0;
+	double now = start;
+	while (now < ctx->refine_deadline && !atomic_load_int(&ctx->refine_cancelled)) {
+		int samples = 1;
+		if (sample_seconds > 0.0) {
+			samples = max_int(1, (int)fmin((ctx->refine_deadline - now) / sample_seconds, 1e6));
+		}
+		ctx->refine_completed = 0;
+		run_refine(ctx, samples);
+		if (atomic_load_int(&ctx->refine_total) == 0) break; // all pixels converged
+		double pass_end = monotonic_seconds();
+		sample_seconds = (pass_end - now) / samples;
+		now = pass_end;
+	}
+	ctx->refine_deadline = INFINITY;
+	return (float)(summed_sample_counts(ctx) - samples_before) / (ctx->width * ctx->height);
+}
+
+EMSCRIPTEN_KEEPALIVE
+const int* tracy_get_sample_counts(const TracyContext* ctx) { return ctx->sample_count_buffer; }
+
+EMSCRIPTEN_KEEPALIVE
+float tracy_get_estimated_error(const TracyContext* ctx) {
+	if (ctx->moment_buffer == NULL) return INFINITY;
+	double sum = 0.0;
+	for (int i = 0; i < ctx->width * ctx->height; ++i) sum += pixel_relative_error(ctx, i);
+	return (float)(sum / (ctx->width * ctx->height));
+}
+
+EMSCRIPTEN_KEEPALIVE
+float tracy_get_converged_fraction(const TracyContext* ctx) {
+	if (ctx->moment_buffer == NULL || ctx->convergence_threshold <= 0.0f) return 0.0f;
+	int converged = 0;
+	for (int y = 0; y < ctx->height; ++y) {
+		for (int x = 0; x < ctx->width; ++x) converged += pixel_converged(ctx, x, y);
+	}
+	return (float)converged / (ctx->width * ctx->height);
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool tracy_is_refining(const TracyContext* ctx) {
+#ifdef TRACY_THREAD_POOL
+	return atomic_load_int(&ctx->refining) != 0;
+#else
+	(void)ctx;
+	return false;
+#endif
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_cancel_refine(TracyContext* ctx) { atomic_store_int(&ctx->refine_cancelled, 1); }
+
+EMSCRIPTEN_KEEPALIVE
+float tracy_get_refine_progress(const TracyContext* ctx) {
+	int total = atomic_load_int(&ctx->refine_total);
+	if (total == 0) return tracy_is_refining(ctx) ? 0.0f : 1.0f;
+	return (float)atomic_load_int(&ctx->refine_completed) / total;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void tracy_set_progress_callback(TracyContext* ctx, TracyProgressCallback p_callback,
+								 void* p_user_data) {
+	ctx->progress_callback = p_callback;
+	ctx->progress_user_data = p_user_data;
+}
+
+// The functions without a context work on the default context
+TracyContext* get_default_context() {
+	if (default_context == NULL) default_context = tracy_create();
+	return default_context;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_init(int p_scene_id, int p_max_depth, int p_width, int p_height, int p_filter_type,
+				 double p_cam_angle_x, double p_cam_angle_y, double p_cam_dist, double p_focus_x,
+				 double p_focus_y, double p_focus_z) {
+	tracy_render_init(get_default_context(), p_scene_id, p_max_depth, p_width, p_height,
+					  p_filter_type, p_cam_angle_x, p_cam_angle_y, p_cam_dist, p_focus_x, p_focus_y,
+					  p_focus_z);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_bvh_builder(int p_builder) {
+	tracy_set_bvh_builder(get_default_context(), p_builder);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_accumulator(int p_accumulator) {
+	tracy_set_accumulator(get_default_context(), p_accumulator);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_wide_bvh(bool p_enabled) { tracy_set_wide_bvh(get_default_context(), p_enabled); }
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_light_sampling(bool p_enabled) {
+	tracy_set_light_sampling(get_default_context(), p_enabled);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_sampler(int p_sampler) {
+	tracy_set_sampler(get_default_context(), p_sampler);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_adaptive_sampling(bool p_enabled) {
+	tracy_set_adaptive_sampling(get_default_context(), p_enabled);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_convergence_threshold(float p_threshold) {
+	tracy_set_convergence_threshold(get_default_context(), p_threshold);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_refine_grain(int p_samples) {
+	tracy_set_refine_grain(get_default_context(), p_samples);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_deterministic(bool p_enabled) {
+	tracy_set_deterministic(get_default_context(), p_enabled);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_tile_size(int p_size) { tracy_set_tile_size(get_default_context(), p_size); }
+
+EMSCRIPTEN_KEEPALIVE
+int render_get_instance_count() { return tracy_get_instance_count(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_instance_transform(int p_instance, const float* p_transform) {
+	tracy_set_instance_transform(get_default_context(), p_instance, p_transform);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int render_get_primitive_count() { return tracy_get_primitive_count(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+bool render_set_sphere(int p_primitive, float p_x, float p_y, float p_z, float p_radius) {
+	return tracy_set_sphere(get_default_context(), p_primitive, p_x, p_y, p_z, p_radius);
+}
+
+EMSCRIPTEN_KEEPALIVE
+bool render_set_triangle(int p_primitive, const float* p_vertices) {
+	return tracy_set_triangle(get_default_context(), p_primitive, p_vertices);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_update_scene() { tracy_update_scene(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+void render_refine(unsigned int p_n_samples) {
+	tracy_render_refine(get_default_context(), p_n_samples);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_refine_async(unsigned int p_n_samples) {
+	tracy_render_refine_async(get_default_context(), p_n_samples);
+}
+
+EMSCRIPTEN_KEEPALIVE
+float render_refine_for(double p_budget_ms) {
+	return tracy_render_refine_for(get_default_context(), p_budget_ms);
+}
+
+EMSCRIPTEN_KEEPALIVE
+const int* render_get_sample_counts() { return tracy_get_sample_counts(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+float render_get_estimated_error() { return tracy_get_estimated_error(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+float render_get_converged_fraction() {
+	return tracy_get_converged_fraction(get_default_context());
+}
+
+EMSCRIPTEN_KEEPALIVE
+void render_wait_refine() { tracy_wait_refine(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+bool render_is_refining() { return tracy_is_refining(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+void render_cancel_refine() { tracy_cancel_refine(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+float render_get_refine_progress() { return tracy_get_refine_progress(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+void render_set_progress_callback(TracyProgressCallback p_callback, void* p_user_data) {
+	tracy_set_progress_callback(get_default_context(), p_callback, p_user_data);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* update_image_ldr() { return tracy_update_image_ldr(get_default_context()); }
+
+EMSCRIPTEN_KEEPALIVE
+float* update_image_hdr() { return tracy_update_image_hdr(get_default_context()); }
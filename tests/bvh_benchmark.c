@@ -0,0 +1,245 @@
+// BVH benchmark: compares build time, tree quality (SAH cost) and trace throughput of the BVH
+// builders, of the binary vs. wide BVH traversal and of shadow ray queries on the built-in scenes
+// and on a generated terrain mesh with ~1M triangles. For instanced scenes it also reports the
+// build time of the top level alone, which is all that is rebuilt when instances move. Finally the
+// terrain is animated, comparing BVH refits against full rebuilds.
+//
+// Like the unit tests, this is a white-box benchmark that includes the implementation directly, so
+// it can time the individual stages without extending the public API.
+//
+// Usage: bvh-bench [terrain_resolution]   (the terrain has 2 * resolution^2 triangles)
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "../src/tracy.c"
+#include <time.h>
+
+#define DEFAULT_TERRAIN_RESOLUTION 708 // 2 * 708^2 = ~1M triangles
+#define BUILD_REPETITIONS 3
+#define TRACE_RAYS 1000000
+#define ANIMATION_FRAMES 8
+
+const char* builder_names[] = {"sah", "lbvh", "lbvh+treelet"};
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Rolling hills made of overlapping sine waves, 20x20 m, with 2 * resolution^2 triangles
+Primitive* generate_terrain(int resolution, int* prim_count) {
+	*prim_count = 2 * resolution * resolution;
+	Primitive* prims = malloc(*prim_count * sizeof(Primitive));
+	Vec* vertices = malloc((resolution + 1) * (resolution + 1) * sizeof(Vec));
+	for (int z = 0; z <= resolution; ++z) {
+		for (int x = 0; x <= resolution; ++x) {
+			float fx = 20.0f * x / resolution - 10.0f, fz = 20.0f * z / resolution - 10.0f;
+			float height = 0.8f * sinf(0.7f * fx) * cosf(0.5f * fz) + 0.2f * sinf(3.1f * fx + fz);
+			vertices[z * (resolution + 1) + x] = (Vec){fx, height, fz};
+		}
+	}
+	for (int z = 0; z < resolution; ++z) {
+		for (int x = 0; x < resolution; ++x) {
+			Vec v00 = vertices[z * (resolution + 1) + x];
+			Vec v10 = vertices[z * (resolution + 1) + x + 1];
+			Vec v01 = vertices[(z + 1) * (resolution + 1) + x];
+			Vec v11 = vertices[(z + 1) * (resolution + 1) + x + 1];
+			Primitive* quad = &prims[2 * (z * resolution + x)];
+			quad[0] = (Primitive){.shape.type = TRIANGLE,
+								  .shape.data.triangle = {v00, v01, v11, .one_sided = true},
+								  .material = MAT_WHITE};
+			quad[1] = (Primitive){.shape.type = TRIANGLE,
+								  .shape.data.triangle = {v00, v11, v10, .one_sided = true},
+								  .material = MAT_WHITE};
+		}
+	}
+	free(vertices);
+	return prims;
+}
+
+// Incoherent rays, similar to the secondary rays of a path tracer: random origins inside the scene
+// bounds and uniformly distributed directions.
+Ray* generate_rays(Aabb bounds, int count) {
+	Ray* rays = malloc(count * sizeof(Ray));
+	pcg32_random_t rng;
+	pcg32_srandom_r(&rng, GLOBAL_SEED, 1);
+	Sampler sampler = {.type = SAMPLER_PCG, .rng = &rng};
+	Vec extent = vec_sub(bounds.max, bounds.min);
+	for (int i = 0; i < count; ++i) {
+		Vec offset = {random_float(&rng), random_float(&rng), random_float(&rng)};
+		rays[i].origin = vec_add(bounds.min, vec_hadamard_prod(offset, extent));
+		rays[i].dir = sample_uniform_hemisphere((Vec){0, 1, 0}, &sampler);
+		if (random_float(&rng) < 0.5f) rays[i].dir.y = -rays[i].dir.y;
+	}
+	return rays;
+}
+
+// Returns the throughput in rays per second
+double trace_rays(const TracyContext* ctx, const Ray* rays, int count, int* hits) {
+	int hit_count = 0;
+	double start = now_seconds();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+ : hit_count)
+#endif
+	for (int i = 0; i < count; ++i) {
+		HitInfo hit;
+		const Material* material;
+		hit_count += intersect_scene(ctx, &rays[i], &hit, &material);
+	}
+	*hits = hit_count;
+	return count / (now_seconds() - start);
+}
+
+// Shadow rays with a fixed maximum distance, returns the throughput in rays per second
+double trace_shadow_rays(const TracyContext* ctx, const Ray* rays, int count, float t_max,
+						 int* occluded) {
+	int occluded_count = 0;
+	double start = now_seconds();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+ : occluded_count)
+#endif
+	for (int i = 0; i < count; ++i) {
+		occluded_count += occluded_scene(ctx, &rays[i], t_max);
+	}
+	*occluded = occluded_count;
+	return count / (now_seconds() - start);
+}
+
+// Bounds of the whole scene, including the instances
+Aabb scene_bounds(const TracyContext* ctx) {
+	const Blas* blas = &ctx->scene_blas;
+	const Tlas* tlas = &ctx->scene_tlas;
+	Aabb bounds = blas->prim_count > 0 ? blas->bvh.nodes[0].bounds : aabb_empty();
+	if (tlas->instance_count > 0) bounds = aabb_union(bounds, tlas->bvh.nodes[0].bounds);
+	return bounds;
+}
+
+void run_benchmark(TracyContext* ctx, const char* name, Scene scene, SceneInstances instances) {
+	ctx->current_scene = scene;
+	ctx->current_instances = instances;
+	precompute_triangles(&ctx->current_scene);
+	int flattened_prim_count = scene.size;
+	for (int i = 0; i < instances.mesh_count; ++i) precompute_triangles(&instances.meshes[i]);
+	for (int i = 0; i < instances.instance_count; ++i) {
+		flattened_prim_count += instances.meshes[instances.instances[i].mesh].size;
+	}
+
+	Ray* rays = NULL;
+	for (int builder = BVH_BUILDER_SAH; builder <= BVH_BUILDER_LBVH_TREELET; ++builder) {
+		ctx->bvh_builder = (BvhBuilder)builder;
+		double build_time = INFINITY, tlas_build_time = INFINITY;
+		for (int i = 0; i < BUILD_REPETITIONS; ++i) {
+			double start = now_seconds();
+			build_scene_bvh(ctx);
+			build_mesh_bvhs(ctx);
+			double tlas_start = now_seconds();
+			build_scene_tlas(ctx);
+			build_time = fmin(build_time, now_seconds() - start);
+			tlas_build_time = fmin(tlas_build_time, now_seconds() - tlas_start);
+		}
+		Aabb bounds = scene_bounds(ctx);
+		if (rays == NULL) rays = generate_rays(bounds, TRACE_RAYS);
+
+		int hits, wide_hits;
+		ctx->use_wide_bvh = false;
+		double binary_throughput = trace_rays(ctx, rays, TRACE_RAYS, &hits);
+		ctx->use_wide_bvh = true;
+		double wide_throughput = trace_rays(ctx, rays, TRACE_RAYS, &wide_hits);
+		if (hits != wide_hits) printf("ERROR: binary and wide BVH disagree\n");
+		// shadow rays up to a quarter of the scene diagonal, traced with the wide BVH
+		float shadow_t_max = 0.25f * vec_length(vec_sub(bounds.max, bounds.min));
+		int occluded;
+		double shadow_throughput =
+			trace_shadow_rays(ctx, rays, TRACE_RAYS, shadow_t_max, &occluded);
+
+		printf("%-16s %9d prims  %-13s build %9.2f ms  SAH %7.2f  binary %6.2f Mrays/s  "
+			   "wide%d %6.2f Mrays/s  (%d hits)  occluded %6.2f Mrays/s  (%d hits)\n",
+			   name, flattened_prim_count, builder_names[builder], build_time * 1e3,
+			   bvh_sah_cost(&ctx->scene_blas.bvh), binary_throughput * 1e-6, WIDE_BVH_WIDTH,
+			   wide_throughput * 1e-6, hits, shadow_throughput * 1e-6, occluded);
+		if (instances.instance_count > 0) {
+			printf("%-16s %9d instances of %d meshes, top level build %7.2f ms\n", name,
+				   instances.instance_count, instances.mesh_count, tlas_build_time * 1e3);
+		}
+	}
+	free(rays);
+	blas_free(&ctx->scene_blas);
+	mesh_bvhs_free(ctx);
+	tlas_free(&ctx->scene_tlas);
+	ctx->current_instances = (SceneInstances){0};
+}
+
+// A wave moving over the primitives, with growing amplitude so that the refitted BVH degrades
+Vec animate_point(Vec p, int frame) {
+	p.y += 0.3f * frame * sinf(0.8f * p.x + 0.5f * frame) * cosf(0.6f * p.z);
+	return p;
+}
+
+void animate_primitives(Primitive* prims, const Primitive* rest, int prim_count, int frame) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < prim_count; ++i) {
+		prims[i] = rest[i];
+		Shape* shape = &prims[i].shape;
+		if (shape->type == SPHERE) {
+			shape->data.sphere.center = animate_point(shape->data.sphere.center, frame);
+		} else {
+			Triangle* tri = &shape->data.triangle;
+			tri->v0 = animate_point(tri->v0, frame);
+			tri->v1 = animate_point(tri->v1, frame);
+			tri->v2 = animate_point(tri->v2, frame);
+			precompute_triangle(tri);
+		}
+	}
+}
+
+// Per frame of an animation: time and SAH cost of refitting the BVH compared to a full rebuild
+void run_refit_benchmark(TracyContext* ctx, const char* name, Primitive* prims, int prim_count) {
+	Primitive* rest = malloc(prim_count * sizeof(Primitive));
+	memcpy(rest, prims, prim_count * sizeof(Primitive));
+	ctx->current_scene = (Scene){prims, prim_count};
+	ctx->bvh_builder = BVH_BUILDER_SAH;
+	build_scene_bvh(ctx);
+	Blas rebuilt = {0};
+	for (int frame = 1; frame <= ANIMATION_FRAMES; ++frame) {
+		animate_primitives(prims, rest, prim_count, frame);
+		double start = now_seconds();
+		bool refit_rebuilt = refit_scene_bvh(ctx);
+		double refit_time = now_seconds() - start;
+		start = now_seconds();
+		build_blas(&rebuilt, &ctx->current_scene, ctx->bvh_builder);
+		double rebuild_time = now_seconds() - start;
+		printf("%-16s frame %d  refit %9.2f ms  SAH %7.2f  rebuild %9.2f ms  SAH %7.2f%s\n", name,
+			   frame, refit_time * 1e3, bvh_sah_cost(&ctx->scene_blas.bvh), rebuild_time * 1e3,
+			   bvh_sah_cost(&rebuilt.bvh), refit_rebuilt ? "  (refit degraded, rebuilt)" : "");
+	}
+	blas_free(&rebuilt);
+	blas_free(&ctx->scene_blas);
+	free(rest);
+}
+
+int main(int argc, char** argv) {
+	int resolution = argc > 1 ? atoi(argv[1]) : DEFAULT_TERRAIN_RESOLUTION;
+#ifdef _OPENMP
+	printf("OpenMP threads: %d\n", omp_get_max_threads());
+#endif
+
+	const char* scene_names[] = {"cornell",   "caustics",   "glass_sphere",
+								 "cyberpunk", "rock_field", "many_lights"};
+	// the context doesn't own the scenes, they are shared with the benchmark
+	TracyContext* ctx = tracy_create();
+	generate_rock_field(rock_field_instances);
+	generate_light_grid(&scene_many_lights[LIGHT_GRID_FIRST]);
+	for (int i = 0; i < (int)(sizeof(all_scenes) / sizeof(Scene)); ++i) {
+		run_benchmark(ctx, scene_names[i], all_scenes[i], all_scene_instances[i]);
+	}
+
+	int terrain_size;
+	Primitive* terrain = generate_terrain(resolution, &terrain_size);
+	run_benchmark(ctx, "terrain", (Scene){terrain, terrain_size}, (SceneInstances){0});
+	run_refit_benchmark(ctx, "terrain", terrain, terrain_size);
+	free(terrain);
+	tracy_destroy(ctx);
+	return 0;
+}
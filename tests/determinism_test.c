@@ -0,0 +1,86 @@
+// Determinism test: renders every scene with 1, 2, 7 and the automatic number of threads on every
+// compiled in thread backend, in deterministic mode, and checks that all HDR images are bitwise
+// identical to the single threaded one. Also with adaptive sampling, whose distribution of the
+// samples must not depend on the threads either.
+//
+// Usage: determinism-test   (exits with 1 if any image differs)
+
+#include "tracy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_WIDTH 96
+#define TEST_HEIGHT 64
+#define TEST_MAX_DEPTH 6
+#define TEST_FILTER 2	 // Mitchell, it has the widest ghost borders
+#define TEST_TILE_SIZE 16 // more tiles than threads, so that the tiles are distributed
+#define TEST_CONVERGENCE_THRESHOLD 0.05f
+
+const char* scene_names[] = {"cornell",   "caustics",   "glass_sphere",
+							 "cyberpunk", "rock_field", "many_lights"};
+// angle x, angle y, distance, focus point, the same views as the web example
+const double scene_cameras[][6] = {
+	{0.0, 0.0, 5.5, 0.0, 1.25, 0.0},  {0.0, 0.0, 2.5, 0.0, 0.4, 0.0},
+	{0.2, 0.0, 6.0, 0.0, 1.25, 0.0},  {0.2, 0.2, 12.0, 0.0, 1.3, 0.0},
+	{0.35, 0.3, 14.0, 0.0, 0.3, 0.0}, {0.15, 0.0, 9.0, 0.0, 1.0, 0.0},
+};
+const char* backend_names[] = {"single threaded", "OpenMP", "thread pool"};
+const int thread_counts[] = {1, 2, 7, 0}; // 0: automatic
+
+// Renders in two calls, so that the RNG states carried from one call to the next are covered too.
+// With adaptive sampling a third call distributes the samples by the errors after the first 16.
+// Returns a copy of the HDR image.
+float* render_scene(int scene, bool adaptive) {
+	const double* c = scene_cameras[scene];
+	render_set_adaptive_sampling(adaptive);
+	render_init(scene, TEST_MAX_DEPTH, TEST_WIDTH, TEST_HEIGHT, TEST_FILTER, c[0], c[1], c[2], c[3],
+				c[4], c[5]);
+	render_refine(12);
+	render_refine(4);
+	if (adaptive) render_refine(8);
+	size_t size = TEST_WIDTH * TEST_HEIGHT * 3 * sizeof(float);
+	float* image = malloc(size);
+	memcpy(image, update_image_hdr(), size);
+	return image;
+}
+
+int main() {
+	render_set_deterministic(true);
+	render_set_tile_size(TEST_TILE_SIZE);
+	int scene_count = sizeof(scene_names) / sizeof(scene_names[0]);
+	render_set_convergence_threshold(TEST_CONVERGENCE_THRESHOLD);
+	int failures = 0;
+	for (int scene = 0; scene < scene_count; ++scene) {
+		for (int adaptive = 0; adaptive < 2; ++adaptive) {
+			render_set_thread_backend(0);
+			render_set_thread_count(1);
+			float* reference = render_scene(scene, adaptive);
+			for (int backend = 0; backend < 3; ++backend) {
+				if (!render_set_thread_backend(backend)) continue; // not compiled in
+				for (int i = 0; i < (int)(sizeof(thread_counts) / sizeof(int)); ++i) {
+					render_set_thread_count(thread_counts[i]);
+					int threads = render_get_thread_count();
+					if (backend == 0 && thread_counts[i] != 1) continue; // always one thread
+					float* image = render_scene(scene, adaptive);
+					size_t size = TEST_WIDTH * TEST_HEIGHT * 3 * sizeof(float);
+					bool identical = memcmp(image, reference, size) == 0;
+					printf("%-13s %-8s %-15s %3d threads  %s\n", scene_names[scene],
+						   adaptive ? "adaptive" : "uniform", backend_names[backend], threads,
+						   identical ? "identical" : "DIFFERENT");
+					if (!identical) ++failures;
+					free(image);
+				}
+			}
+			free(reference);
+		}
+	}
+	render_set_adaptive_sampling(false);
+	render_set_thread_count(0);
+	if (failures > 0) {
+		printf("%d renders differ from the single threaded render\n", failures);
+		return 1;
+	}
+	printf("all renders are identical\n");
+	return 0;
+}
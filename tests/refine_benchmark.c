@@ -0,0 +1,100 @@
+// Refine benchmark: measures the sample throughput of render_refine on every scene with 1 to 64
+// threads, to show how the multithreaded accumulation scales. Thread counts beyond the number of
+// cores are still run, but only measure the oversubscription overhead. Then compares the
+// reconstruction filters, the work item grain sizes, also for interactive refines of 1 sample per
+// call, and the tile sizes with all threads.
+//
+// Like the BVH benchmark, this includes the implementation directly.
+//
+// Usage: refine-bench [max_threads] [numa_node]   (default 64, powers of two up to this are
+// measured; with a NUMA node the thread pool workers are pinned to its cores)
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "../src/tracy.c"
+#include <time.h>
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 480
+#define BENCH_MAX_DEPTH 6
+#define BENCH_SAMPLES 4 // per pixel and measurement
+#define BENCH_REPETITIONS 3
+
+const char* scene_names[] = {"cornell",   "caustics",   "glass_sphere",
+							 "cyberpunk", "rock_field", "many_lights"};
+// angle x, angle y, distance, focus point, the same views as the web example
+const double scene_cameras[][6] = {
+	{0.0, 0.0, 5.5, 0.0, 1.25, 0.0},  {0.0, 0.0, 2.5, 0.0, 0.4, 0.0},
+	{0.2, 0.0, 6.0, 0.0, 1.25, 0.0},  {0.2, 0.2, 12.0, 0.0, 1.3, 0.0},
+	{0.35, 0.3, 14.0, 0.0, 0.3, 0.0}, {0.15, 0.0, 9.0, 0.0, 1.0, 0.0},
+};
+const char* filter_names[] = {"box", "gaussian", "mitchell"};
+const char* backend_names[] = {"single threaded", "OpenMP", "thread pool"};
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Returns the throughput in samples (camera rays) per second, best of BENCH_REPETITIONS. Renders
+// BENCH_SAMPLES samples per pixel in calls of samples_per_call.
+double measure_refine(int scene, int filter, int samples_per_call) {
+	const double* c = scene_cameras[scene];
+	double best_time = INFINITY;
+	for (int i = 0; i < BENCH_REPETITIONS; ++i) {
+		render_init(scene, BENCH_MAX_DEPTH, BENCH_WIDTH, BENCH_HEIGHT, filter, c[0], c[1], c[2],
+					c[3], c[4], c[5]);
+		double start = now_seconds();
+		for (int j = 0; j < BENCH_SAMPLES; j += samples_per_call) render_refine(samples_per_call);
+		best_time = fmin(best_time, now_seconds() - start);
+	}
+	return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_SAMPLES / best_time;
+}
+
+int main(int argc, char** argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+	if (argc > 2 && !render_set_numa_node(atoi(argv[2]))) {
+		printf("can't pin to NUMA node %s, the threads are not pinned\n", argv[2]);
+	}
+	printf("%s, %d threads by default\n", backend_names[thread_backend], render_get_thread_count());
+	if (thread_backend == THREAD_BACKEND_SERIAL) max_threads = 1;
+
+	for (int scene = 0; scene < (int)(sizeof(scene_names) / sizeof(char*)); ++scene) {
+		double single_thread_throughput = 0.0;
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			render_set_thread_count(threads);
+			double throughput = measure_refine(scene, FILTER_MITCHELL, BENCH_SAMPLES);
+			if (threads == 1) single_thread_throughput = throughput;
+			double speedup = throughput / single_thread_throughput;
+			printf("%-12s %3d threads  %8.3f Msamples/s  speedup %6.2f  efficiency %4.0f%%\n",
+				   scene_names[scene], threads, throughput * 1e-6, speedup,
+				   100.0 * speedup / threads);
+		}
+	}
+	render_set_thread_count(0);
+
+	for (int filter = FILTER_BOX; filter <= FILTER_MITCHELL; ++filter) {
+		printf("cornell  %-9s  %8.3f Msamples/s\n", filter_names[filter],
+			   measure_refine(0, filter, BENCH_SAMPLES) * 1e-6);
+	}
+
+	// grain sizes, refining BENCH_SAMPLES samples at once or one per call
+	int grains[] = {0, 1, 2, 4};
+	for (int i = 0; i < (int)(sizeof(grains) / sizeof(int)); ++i) {
+		render_set_refine_grain(grains[i]);
+		printf("cornell  grain %d%s  %8.3f Msamples/s  (%d spp per call)  %8.3f Msamples/s  (1 spp "
+			   "per call)\n",
+			   grains[i], grains[i] == 0 ? " (auto)" : "       ",
+			   measure_refine(0, FILTER_MITCHELL, BENCH_SAMPLES) * 1e-6, BENCH_SAMPLES,
+			   measure_refine(0, FILTER_MITCHELL, 1) * 1e-6);
+	}
+	render_set_refine_grain(0);
+
+	int tile_sizes[] = {8, 16, 32, 64};
+	for (int i = 0; i < (int)(sizeof(tile_sizes) / sizeof(int)); ++i) {
+		render_set_tile_size(tile_sizes[i]);
+		printf("cornell  tile size %2d  %8.3f Msamples/s\n", tile_sizes[i],
+			   measure_refine(0, FILTER_MITCHELL, BENCH_SAMPLES) * 1e-6);
+	}
+	return 0;
+}
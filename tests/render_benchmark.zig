@@ -48,7 +48,7 @@ fn writeScores(scores: []const f32, timings: []const f64, filepath: []const u8,
     try bw.flush();
 }
 
-pub fn runRender(allocator: std.mem.Allocator, scene: []const u8, iterations: u32, p: RenderParams) !void {
+pub fn runRender(allocator: std.mem.Allocator, scene: []const u8, iterations: u32, p: RenderParams, reference: []const u8) !void {
     const variant_label = if (config.russianroulette) "rr" else "std";
     const out_dir = "tests/img/exr/zig_render/";
 
@@ -76,6 +76,9 @@ pub fn runRender(allocator: std.mem.Allocator, scene: []const u8, iterations: u3
     defer allocator.free(scores);
     var timings = try allocator.alloc(f64, iterations);
     defer allocator.free(timings);
+    const ref_fp = try allocator.dupeZ(u8, reference);
+    defer allocator.free(ref_fp);
+
     var i: usize = 0;
     var timer = try std.time.Timer.start();
     while (i < iterations) : (i += 1) {
@@ -92,11 +95,6 @@ pub fn runRender(allocator: std.mem.Allocator, scene: []const u8, iterations: u3
             return error.ExrSaveFailed;
         }
 
-        const ref_fp_slice = try std.fmt.allocPrint(allocator, "mitsuba_scenes/{s}/scene.exr", .{scene});
-        defer allocator.free(ref_fp_slice);
-        const ref_fp = try allocator.dupeZ(u8, ref_fp_slice);
-        defer allocator.free(ref_fp);
-
         scores[i] = try rmse.computeScore(out_fp, ref_fp);
     }
 
@@ -111,12 +109,12 @@ pub fn main() !void {
     var gpa = std.heap.GeneralPurposeAllocator(.{}){};
     const allocator = gpa.allocator();
 
-    // Get CLI args: [program_name, scene, iterations]
+    // Get CLI args: [program_name, scene, iterations, cam_params, reference (optional)]
     const args = try std.process.argsAlloc(allocator);
     defer std.process.argsFree(allocator, args);
 
-    if (args.len < 3) {
-        std.debug.print("Usage: render_bench <scene> <iterations> <cam_params>\n", .{});
+    if (args.len < 4) {
+        std.debug.print("Usage: render_bench <scene> <iterations> <cam_params> [reference_exr]\n", .{});
         return;
     }
     const scene = args[1];
@@ -126,6 +124,9 @@ pub fn main() !void {
     const parsed = try std.json.parseFromSlice(RenderParams, allocator, json_str, .{});
     defer parsed.deinit();
     const p = parsed.value;
+    // the Mitsuba ground truth of the scene, unless another reference is given
+    const reference = if (args.len > 4) args[4] else try std.fmt.allocPrint(allocator, "mitsuba_scenes/{s}/scene.exr", .{scene});
+    defer if (args.len <= 4) allocator.free(reference);
     // Pass these directly to your runRender function
-    try runRender(allocator, scene, iterations, p);
+    try runRender(allocator, scene, iterations, p, reference);
 }
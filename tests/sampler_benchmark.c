@@ -0,0 +1,130 @@
+// Sampler benchmark: measures how noisy the image looks at 1, 2 and 4 samples per pixel with each
+// sampler, at the size of the web example's preview, against a reference rendered with many
+// samples. The error is taken on the radiance clamped to the displayed range: after the tone curve,
+// its bias at low sample counts (the average of the curve of noisy values is darker than the curve
+// of their average) would hide the differences. Besides the plain RMSE it reports the RMSE of the
+// error blurred by a gaussian of BENCH_BLUR_SIGMA pixels: the eye averages neighboring pixels, so
+// errors that cancel out between neighbors (blue noise) are less visible.
+//
+// Like the other benchmarks, this includes the implementation directly.
+//
+// Usage: sampler-bench [reference_samples]   (default 1024)
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "../src/tracy.c"
+#include <time.h>
+
+#define BENCH_WIDTH 160
+#define BENCH_HEIGHT 120
+#define BENCH_MAX_DEPTH 6
+#define BENCH_BLUR_SIGMA 1.5f
+#define BENCH_BLUR_RADIUS 4 // pixels, about 3 sigma
+
+const char* scene_names[] = {"cornell",   "caustics",   "glass_sphere",
+							 "cyberpunk", "rock_field", "many_lights"};
+// angle x, angle y, distance, focus point, the same views as the web example
+const double scene_cameras[][6] = {
+	{0.0, 0.0, 5.5, 0.0, 1.25, 0.0},  {0.0, 0.0, 2.5, 0.0, 0.4, 0.0},
+	{0.2, 0.0, 6.0, 0.0, 1.25, 0.0},  {0.2, 0.2, 12.0, 0.0, 1.3, 0.0},
+	{0.35, 0.3, 14.0, 0.0, 0.3, 0.0}, {0.15, 0.0, 9.0, 0.0, 1.0, 0.0},
+};
+const char* sampler_names[] = {"pcg", "sobol", "blue noise"};
+const int sample_counts[] = {1, 2, 4};
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Renders the scene with the sampler and returns the radiance clamped to [0, 1], rgb
+float* render_display_image(int scene, int sampler, int samples) {
+	const double* c = scene_cameras[scene];
+	render_set_sampler(sampler);
+	render_init(scene, BENCH_MAX_DEPTH, BENCH_WIDTH, BENCH_HEIGHT, FILTER_BOX, c[0], c[1], c[2],
+				c[3], c[4], c[5]);
+	render_refine(samples);
+	const float* hdr = update_image_hdr();
+	float* image = malloc(BENCH_WIDTH * BENCH_HEIGHT * 3 * sizeof(float));
+	for (int i = 0; i < BENCH_WIDTH * BENCH_HEIGHT * 3; ++i) image[i] = fminf(hdr[i], 1.0f);
+	return image;
+}
+
+// Separable gaussian blur of an rgb image, the borders are clamped
+void blur(float* image) {
+	float weights[2 * BENCH_BLUR_RADIUS + 1];
+	float total = 0.0f;
+	for (int i = -BENCH_BLUR_RADIUS; i <= BENCH_BLUR_RADIUS; ++i) {
+		float variance = BENCH_BLUR_SIGMA * BENCH_BLUR_SIGMA;
+		weights[i + BENCH_BLUR_RADIUS] = expf(-(float)(i * i) / (2.0f * variance));
+		total += weights[i + BENCH_BLUR_RADIUS];
+	}
+	float* temp = malloc(BENCH_WIDTH * BENCH_HEIGHT * 3 * sizeof(float));
+	for (int pass = 0; pass < 2; ++pass) {
+		const float* source = pass == 0 ? image : temp;
+		float* target = pass == 0 ? temp : image;
+		for (int y = 0; y < BENCH_HEIGHT; ++y) {
+			for (int x = 0; x < BENCH_WIDTH; ++x) {
+				for (int channel = 0; channel < 3; ++channel) {
+					float sum = 0.0f;
+					for (int i = -BENCH_BLUR_RADIUS; i <= BENCH_BLUR_RADIUS; ++i) {
+						int sx = pass == 0 ? min_int(max_int(x + i, 0), BENCH_WIDTH - 1) : x;
+						int sy = pass == 1 ? min_int(max_int(y + i, 0), BENCH_HEIGHT - 1) : y;
+						sum += weights[i + BENCH_BLUR_RADIUS] *
+							   source[(sy * BENCH_WIDTH + sx) * 3 + channel];
+					}
+					target[(y * BENCH_WIDTH + x) * 3 + channel] = sum / total;
+				}
+			}
+		}
+	}
+	free(temp);
+}
+
+double rms(const float* image) {
+	double sum = 0.0;
+	for (int i = 0; i < BENCH_WIDTH * BENCH_HEIGHT * 3; ++i) sum += (double)image[i] * image[i];
+	return sqrt(sum / (BENCH_WIDTH * BENCH_HEIGHT * 3));
+}
+
+int main(int argc, char** argv) {
+	int reference_samples = argc > 1 ? atoi(argv[1]) : 1024;
+	int scene_count = sizeof(scene_names) / sizeof(scene_names[0]);
+	int sampler_count = sizeof(sampler_names) / sizeof(sampler_names[0]);
+	int count_count = sizeof(sample_counts) / sizeof(sample_counts[0]);
+	// blurred error of every sampler and sample count, summed over the scenes
+	double blurred_sums[3][3] = {{0}};
+
+	for (int scene = 0; scene < scene_count; ++scene) {
+		double start = now_seconds();
+		float* reference = render_display_image(scene, SAMPLER_SOBOL, reference_samples);
+		printf("%s: reference of %d samples per pixel in %.1f s\n", scene_names[scene],
+			   reference_samples, now_seconds() - start);
+		for (int sampler = 0; sampler < sampler_count; ++sampler) {
+			for (int i = 0; i < count_count; ++i) {
+				float* error = render_display_image(scene, sampler, sample_counts[i]);
+				for (int j = 0; j < BENCH_WIDTH * BENCH_HEIGHT * 3; ++j) error[j] -= reference[j];
+				double plain = rms(error);
+				blur(error);
+				double blurred = rms(error);
+				blurred_sums[sampler][i] += blurred;
+				printf("  %-10s %d spp  RMSE %.4f  blurred RMSE %.4f\n", sampler_names[sampler],
+					   sample_counts[i], plain, blurred);
+				free(error);
+			}
+		}
+		free(reference);
+	}
+
+	printf("blurred RMSE summed over the scenes, relative to pcg\n");
+	for (int sampler = 0; sampler < sampler_count; ++sampler) {
+		printf("  %-10s", sampler_names[sampler]);
+		for (int i = 0; i < count_count; ++i) {
+			double relative = blurred_sums[sampler][i] / blurred_sums[0][i];
+			printf("  %d spp %5.2f", sample_counts[i], relative);
+		}
+		printf("\n");
+	}
+	render_set_sampler(SAMPLER_SOBOL);
+	return 0;
+}
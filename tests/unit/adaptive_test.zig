@@ -0,0 +1,69 @@
+const std = @import("std");
+const testing = std.testing;
+
+// Import the C implementation to access the internal adaptive sampling functions
+const c = @cImport({
+    @cInclude("../src/tracy.c");
+});
+
+// Context with adaptive sampling over the empty scene (every sample is black), tiles of 32 pixels
+fn adaptiveContext(width: c_int, height: c_int, threshold: f32) *c.TracyContext {
+    const ctx: *c.TracyContext = c.tracy_create();
+    c.tracy_set_adaptive_sampling(ctx, true);
+    c.tracy_set_convergence_threshold(ctx, threshold);
+    c.tracy_render_init(ctx, -1, 1, width, height, c.FILTER_BOX, 0.0, 0.0, 5.0, 0.0, 0.0, 0.0);
+    return ctx;
+}
+
+// Gives the pixel 16 samples of mean luminance 1 and the given variance
+fn setMoments(ctx: *c.TracyContext, pixel: usize, variance: f64) void {
+    ctx.sample_count_buffer[pixel] = 16;
+    ctx.moment_buffer[pixel] = .{ .sum = 16.0, .sum_squares = 16.0 * (1.0 + variance) };
+}
+
+test "adaptive: the relative error is the standard error of the mean luminance" {
+    const ctx = adaptiveContext(4, 4, 0.0);
+    defer c.tracy_destroy(ctx);
+    try testing.expect(std.math.isInf(c.pixel_relative_error(ctx, 0)));
+    setMoments(ctx, 0, 0.25);
+    // unbiased variance 0.25 * 16 / 15 of 16 samples, relative to the luminance 1 (and the offset)
+    const expected = @sqrt(0.25 * 16.0 / 15.0 / 16.0) / (1.0 + c.ADAPTIVE_DARK_LUMINANCE);
+    try testing.expectApproxEqRel(expected, c.pixel_relative_error(ctx, 0), 1e-12);
+}
+
+test "adaptive: tiles get samples in proportion to their error" {
+    const ctx = adaptiveContext(64, 32, 0.0);
+    defer c.tracy_destroy(ctx);
+    // the left tile has ten times the standard error of the right one
+    for (0..32) |y| {
+        for (0..64) |x| setMoments(ctx, y * 64 + x, if (x < 32) 1.0 else 0.01);
+    }
+    c.tracy_render_refine(ctx, 16);
+    // 2 * 16 samples per pixel shared 10 : 1
+    try testing.expectEqual(@as(c_int, 16 + 29), ctx.sample_count_buffer[0]);
+    try testing.expectEqual(@as(c_int, 16 + 3), ctx.sample_count_buffer[63]);
+}
+
+test "adaptive: converged pixels get no more samples" {
+    const ctx = adaptiveContext(8, 8, 0.01);
+    defer c.tracy_destroy(ctx);
+    c.tracy_render_refine(ctx, 16);
+    // black pixels have no variance
+    try testing.expectEqual(@as(f32, 1.0), c.tracy_get_converged_fraction(ctx));
+    try testing.expectEqual(@as(f32, 0.0), c.tracy_get_estimated_error(ctx));
+    c.tracy_render_refine(ctx, 16);
+    for (0..64) |pixel| try testing.expectEqual(@as(c_int, 16), ctx.sample_count_buffer[pixel]);
+    // returns before the time is up
+    try testing.expectEqual(@as(f32, 0.0), c.tracy_render_refine_for(ctx, 60000.0));
+}
+
+test "adaptive: a pixel only converges with its neighbors" {
+    const ctx = adaptiveContext(8, 8, 0.05);
+    defer c.tracy_destroy(ctx);
+    for (0..64) |pixel| setMoments(ctx, pixel, 0.0);
+    setMoments(ctx, 3 * 8 + 3, 1.0);
+    try testing.expect(!c.pixel_converged(ctx, 2, 2));
+    try testing.expect(!c.pixel_converged(ctx, 4, 4));
+    try testing.expect(c.pixel_converged(ctx, 5, 5));
+    try testing.expectEqual(@as(f32, 55.0 / 64.0), c.tracy_get_converged_fraction(ctx));
+}
@@ -0,0 +1,376 @@
+const std = @import("std");
+const testing = std.testing;
+
+// Import C definitions
+const c = @cImport({
+    @cInclude("../src/tracy.c");
+});
+
+// Fills the slice with a regular grid of small spheres and triangles (8 per row, 64 per layer), so
+// that most rays pass through many BVH nodes and have several candidate primitives of both types.
+// Every primitive gets one of four materials.
+fn createPrimitiveGrid(prims: []c.Primitive) void {
+    for (prims, 0..) |*p, i| {
+        const center = c.Vec{
+            .x = @floatFromInt(i % 8),
+            .y = @floatFromInt((i / 8) % 8),
+            .z = @floatFromInt(i / 64),
+        };
+        p.* = std.mem.zeroes(c.Primitive);
+        p.material.type = c.DIFFUSE;
+        p.material.data.diffuse.albedo = .{ .x = @floatFromInt(i % 4), .y = 0, .z = 0 };
+        if (i % 3 == 2) {
+            p.shape.type = c.TRIANGLE;
+            p.shape.data.triangle = .{
+                .v0 = c.vec_add(center, .{ .x = -0.3, .y = -0.3, .z = 0 }),
+                .v1 = c.vec_add(center, .{ .x = 0.3, .y = -0.3, .z = 0.1 }),
+                .v2 = c.vec_add(center, .{ .x = 0, .y = 0.3, .z = -0.1 }),
+            };
+            c.precompute_triangle(&p.shape.data.triangle);
+        } else {
+            p.shape.type = c.SPHERE;
+            p.shape.data.sphere = .{ .center = center, .radius = 0.3 };
+        }
+    }
+}
+
+// Reference result: test every primitive and keep the closest one
+const BruteForceHit = struct { t: f32, index: usize };
+fn bruteForceClosest(r: *const c.Ray, prims: []c.Primitive) BruteForceHit {
+    var closest = BruteForceHit{ .t = std.math.inf(f32), .index = 0 };
+    for (prims, 0..) |*p, i| {
+        var hit: c.HitInfo = undefined;
+        if (c.intersect_primitive(r, p, &hit) and hit.t < closest.t) closest = .{ .t = hit.t, .index = i };
+    }
+    return closest;
+}
+
+const builders = [_]c.BvhBuilder{ c.BVH_BUILDER_SAH, c.BVH_BUILDER_LBVH, c.BVH_BUILDER_LBVH_TREELET };
+
+fn randomRay(random: std.Random) c.Ray {
+    return c.Ray{
+        .origin = .{
+            .x = random.float(f32) * 16.0 - 4.0,
+            .y = random.float(f32) * 16.0 - 4.0,
+            .z = random.float(f32) * 12.0 - 4.0,
+        },
+        .dir = c.vec_normalize(.{
+            .x = random.float(f32) * 2.0 - 1.0,
+            .y = random.float(f32) * 2.0 - 1.0,
+            .z = random.float(f32) * 2.0 - 1.0,
+        }),
+    };
+}
+
+test "bvh: every primitive is referenced by exactly one leaf" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+
+    for (builders) |builder| {
+        ctx.bvh_builder = builder;
+        c.build_scene_bvh(ctx);
+        defer c.blas_free(&ctx.scene_blas);
+        try expectEveryPrimitiveOnce(ctx, prims.len);
+    }
+}
+
+fn expectEveryPrimitiveOnce(ctx: *const c.TracyContext, comptime prim_count: usize) !void {
+    var seen = [_]u32{0} ** prim_count;
+    var i: usize = 0;
+    while (i < @as(usize, @intCast(ctx.scene_blas.bvh.node_count))) : (i += 1) {
+        const node = ctx.scene_blas.bvh.nodes[i];
+        if (node.count == 0) continue;
+        var j: usize = 0;
+        while (j < @as(usize, @intCast(node.count))) : (j += 1) {
+            const prim_index: usize = @intCast(ctx.scene_blas.bvh.prim_indices[@as(usize, @intCast(node.left_first)) + j]);
+            seen[prim_index] += 1;
+        }
+    }
+    for (seen) |count| try testing.expectEqual(@as(u32, 1), count);
+}
+
+test "bvh: closest hit matches brute force" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+
+    for (builders) |builder| {
+        ctx.bvh_builder = builder;
+        c.build_scene_bvh(ctx);
+        defer c.blas_free(&ctx.scene_blas);
+
+        // Both traversals must find exactly the same hits
+        for ([_]bool{ false, true }) |wide| {
+            ctx.use_wide_bvh = wide;
+            var prng = std.Random.DefaultPrng.init(42);
+            const random = prng.random();
+
+            for (0..1000) |_| {
+                const r = randomRay(random);
+                var hit: c.HitInfo = undefined;
+                var material: [*c]const c.Material = null;
+                const did_hit = c.intersect_scene(ctx, &r, &hit, &material);
+
+                const expected = bruteForceClosest(&r, &prims);
+                try testing.expectEqual(expected.t != std.math.inf(f32), did_hit);
+                if (did_hit) {
+                    try testing.expectEqual(expected.t, hit.t);
+                    const albedo = prims[expected.index].material.data.diffuse.albedo;
+                    try testing.expectEqual(albedo.x, material.*.data.diffuse.albedo.x);
+                }
+            }
+        }
+    }
+}
+
+test "bvh: occlusion matches brute force" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+    c.build_scene_bvh(ctx);
+    defer c.blas_free(&ctx.scene_blas);
+
+    for ([_]bool{ false, true }) |wide| {
+        ctx.use_wide_bvh = wide;
+        var prng = std.Random.DefaultPrng.init(42);
+        const random = prng.random();
+
+        for (0..1000) |_| {
+            const r = randomRay(random);
+            const t_max = random.float(f32) * 8.0;
+            const expected = bruteForceClosest(&r, &prims).t < t_max;
+            try testing.expectEqual(expected, c.occluded_scene(ctx, &r, t_max));
+        }
+    }
+}
+
+fn expectClosestHitsMatchBruteForce(ctx: *c.TracyContext, prims: []c.Primitive) !void {
+    for ([_]bool{ false, true }) |wide| {
+        ctx.use_wide_bvh = wide;
+        var prng = std.Random.DefaultPrng.init(42);
+        const random = prng.random();
+
+        for (0..1000) |_| {
+            const r = randomRay(random);
+            var hit: c.HitInfo = undefined;
+            var material: [*c]const c.Material = null;
+            const expected = bruteForceClosest(&r, prims);
+            try testing.expectEqual(expected.t != std.math.inf(f32), c.intersect_scene(ctx, &r, &hit, &material));
+            if (expected.t != std.math.inf(f32)) try testing.expectEqual(expected.t, hit.t);
+        }
+    }
+}
+
+fn aabbContains(outer: c.Aabb, inner: c.Aabb) bool {
+    return outer.min.x <= inner.min.x and outer.min.y <= inner.min.y and outer.min.z <= inner.min.z and
+        outer.max.x >= inner.max.x and outer.max.y >= inner.max.y and outer.max.z >= inner.max.z;
+}
+
+test "bvh: refit after moving primitives keeps the topology and matches brute force" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+
+    for (builders) |builder| {
+        ctx.bvh_builder = builder;
+        createPrimitiveGrid(&prims);
+        c.build_scene_bvh(ctx);
+        defer c.blas_free(&ctx.scene_blas);
+        const node_count = ctx.scene_blas.bvh.node_count;
+
+        // small random moves, the tree stays good enough to be refitted
+        var prng = std.Random.DefaultPrng.init(5);
+        const random = prng.random();
+        for (&prims) |*p| {
+            const offset = c.Vec{
+                .x = random.float(f32) * 0.4 - 0.2,
+                .y = random.float(f32) * 0.4 - 0.2,
+                .z = random.float(f32) * 0.4 - 0.2,
+            };
+            if (p.shape.type == c.SPHERE) {
+                p.shape.data.sphere.center = c.vec_add(p.shape.data.sphere.center, offset);
+            } else {
+                const tri = &p.shape.data.triangle;
+                tri.v0 = c.vec_add(tri.v0, offset);
+                tri.v1 = c.vec_add(tri.v1, offset);
+                tri.v2 = c.vec_add(tri.v2, offset);
+                c.precompute_triangle(tri);
+            }
+        }
+        try testing.expect(!c.refit_scene_bvh(ctx));
+        try testing.expectEqual(node_count, ctx.scene_blas.bvh.node_count);
+
+        // every node encloses its children or primitives
+        const bvh = ctx.scene_blas.bvh;
+        for (0..@intCast(bvh.node_count)) |i| {
+            const node = bvh.nodes[i];
+            const first: usize = @intCast(node.left_first);
+            if (node.count == 0) {
+                try testing.expect(aabbContains(node.bounds, bvh.nodes[first].bounds));
+                try testing.expect(aabbContains(node.bounds, bvh.nodes[first + 1].bounds));
+            } else for (0..@intCast(node.count)) |j| {
+                const prim_bounds = c.primitive_bounds(&prims[@intCast(bvh.prim_indices[first + j])]);
+                try testing.expect(aabbContains(node.bounds, prim_bounds));
+            }
+        }
+        try expectClosestHitsMatchBruteForce(ctx, &prims);
+    }
+}
+
+test "bvh: refit rebuilds a degraded tree" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+    c.build_scene_bvh(ctx);
+    defer c.blas_free(&ctx.scene_blas);
+
+    // shuffling the spheres puts the primitives of every leaf far apart
+    var prng = std.Random.DefaultPrng.init(9);
+    const random = prng.random();
+    var i: usize = prims.len;
+    while (i > 1) : (i -= 1) {
+        const j = random.uintLessThan(usize, i);
+        if (prims[i - 1].shape.type != c.SPHERE or prims[j].shape.type != c.SPHERE) continue;
+        std.mem.swap(c.Vec, &prims[i - 1].shape.data.sphere.center, &prims[j].shape.data.sphere.center);
+    }
+    try testing.expect(c.refit_scene_bvh(ctx));
+    try expectClosestHitsMatchBruteForce(ctx, &prims);
+}
+
+test "wide bvh: every primitive is referenced by exactly one leaf slot" {
+    var prims: [256]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = prims.len };
+    c.build_scene_bvh(ctx);
+    defer c.blas_free(&ctx.scene_blas);
+
+    var seen = [_]u32{0} ** prims.len;
+    for (0..@intCast(ctx.scene_blas.wide_bvh.node_count)) |n| {
+        const node = &ctx.scene_blas.wide_bvh.nodes[n];
+        for (0..c.WIDE_BVH_WIDTH) |i| {
+            if (node.count[i] == 0) continue;
+            const first: usize = @intCast(node.child[i]);
+            for (0..@intCast(node.count[i])) |j| seen[@intCast(ctx.scene_blas.bvh.prim_indices[first + j])] += 1;
+        }
+    }
+    for (seen) |count| try testing.expectEqual(@as(u32, 1), count);
+}
+
+test "bvh: depth counts the nodes on the longest path to a leaf" {
+    // root with a leaf (1) and an interior node (2), whose children are both leaves (3, 4)
+    var nodes = [_]c.BvhNode{
+        .{ .bounds = c.aabb_empty(), .left_first = 1, .count = 0 },
+        .{ .bounds = c.aabb_empty(), .left_first = 0, .count = 1 },
+        .{ .bounds = c.aabb_empty(), .left_first = 3, .count = 0 },
+        .{ .bounds = c.aabb_empty(), .left_first = 1, .count = 1 },
+        .{ .bounds = c.aabb_empty(), .left_first = 2, .count = 1 },
+    };
+    var bvh = c.Bvh{ .nodes = &nodes, .prim_indices = null, .node_count = nodes.len };
+    try testing.expectEqual(@as(c_int, 3), c.bvh_depth(&bvh));
+    bvh.node_count = 0;
+    try testing.expectEqual(@as(c_int, 0), c.bvh_depth(&bvh));
+}
+
+test "lbvh: morton code interleaves x, y, z bits" {
+    // 10 bits per axis: x occupies bits 2, 5, ..., 29, y bits 1, 4, ..., 28 and z bits 0, 3, ..., 27
+    try testing.expectEqual(@as(u64, 0x24924924), c.morton_code(.{ .x = 1, .y = 0, .z = 0 }, 10));
+    try testing.expectEqual(@as(u64, 0x12492492), c.morton_code(.{ .x = 0, .y = 1, .z = 0 }, 10));
+    try testing.expectEqual(@as(u64, 0x09249249), c.morton_code(.{ .x = 0, .y = 0, .z = 1 }, 10));
+    try testing.expectEqual(@as(u64, 0x7fffffffffffffff), c.morton_code(.{ .x = 1, .y = 1, .z = 1 }, 21));
+}
+
+test "lbvh: radix sort is sorted and stable" {
+    var keys: [1000]u64 = undefined;
+    var values: [1000]c_int = undefined;
+    var prng = std.Random.DefaultPrng.init(7);
+    const random = prng.random();
+    for (&keys, &values, 0..) |*k, *v, i| {
+        k.* = random.int(u64) & 0x3ff0000000; // few distinct keys, so stability matters
+        v.* = @intCast(i);
+    }
+    c.radix_sort_pairs(&keys, &values, keys.len, 40);
+
+    for (1..keys.len) |i| {
+        try testing.expect(keys[i - 1] <= keys[i]);
+        if (keys[i - 1] == keys[i]) try testing.expect(values[i - 1] < values[i]);
+    }
+}
+
+test "transform: inverse undoes the transform" {
+    const t = c.Transform{ .m = .{
+        .{ 0.0, -2.0, 0.0, 1.0 },
+        .{ 0.5, 0.0, 0.0, -3.0 },
+        .{ 0.0, 0.0, 1.5, 2.0 },
+    } };
+    const inv = c.transform_inverse(&t);
+    const p = c.Vec{ .x = 0.3, .y = -1.2, .z = 4.0 };
+    const q = c.transform_point(&inv, c.transform_point(&t, p));
+    try testing.expectApproxEqAbs(p.x, q.x, 1e-5);
+    try testing.expectApproxEqAbs(p.y, q.y, 1e-5);
+    try testing.expectApproxEqAbs(p.z, q.z, 1e-5);
+}
+
+test "tlas: closest hit and occlusion match brute force over the instances" {
+    var prims: [64]c.Primitive = undefined;
+    createPrimitiveGrid(&prims);
+    var meshes = [_]c.Scene{.{ .primitives = &prims, .size = prims.len }};
+
+    // rotated, non-uniformly scaled and overlapping copies of the grid
+    var instances: [8]c.Instance = undefined;
+    var prng = std.Random.DefaultPrng.init(11);
+    const random = prng.random();
+    for (&instances, 0..) |*instance, i| {
+        const angle = random.float(f32) * 6.28;
+        const sx = 0.5 + random.float(f32);
+        const sy = 0.5 + random.float(f32);
+        instance.* = .{ .mesh = 0, .object_to_world = .{ .m = .{
+            .{ @cos(angle) * sx, 0, @sin(angle), @as(f32, @floatFromInt(i % 4)) * 3.0 },
+            .{ 0, sy, 0, @as(f32, @floatFromInt(i / 4)) * 3.0 },
+            .{ -@sin(angle) * sx, 0, @cos(angle), 0 },
+        } } };
+    }
+    const ctx: *c.TracyContext = c.tracy_create();
+    defer c.tracy_destroy(ctx);
+    ctx.current_scene = .{ .primitives = &prims, .size = 0 };
+    ctx.current_instances = .{ .meshes = &meshes, .mesh_count = 1, .instances = &instances, .instance_count = instances.len };
+    c.build_scene_bvh(ctx);
+    c.build_mesh_bvhs(ctx);
+    c.build_scene_tlas(ctx);
+    // the instances are not owned by the context
+    defer ctx.current_instances = std.mem.zeroes(c.SceneInstances);
+
+    for (0..1000) |_| {
+        const r = randomRay(random);
+        var expected: f32 = std.math.inf(f32);
+        for (&instances) |*instance| {
+            const inverse = c.transform_inverse(&instance.object_to_world);
+            const object_ray = c.Ray{
+                .origin = c.transform_point(&inverse, r.origin),
+                .dir = c.transform_vector(&inverse, r.dir),
+            };
+            expected = @min(expected, bruteForceClosest(&object_ray, &prims).t);
+        }
+
+        var hit: c.HitInfo = undefined;
+        var material: [*c]const c.Material = null;
+        const did_hit = c.intersect_scene(ctx, &r, &hit, &material);
+        try testing.expectEqual(expected != std.math.inf(f32), did_hit);
+        if (did_hit) try testing.expectApproxEqRel(expected, hit.t, 1e-5);
+
+        const t_max = random.float(f32) * 8.0;
+        try testing.expectEqual(expected < t_max, c.occluded_scene(ctx, &r, t_max));
+    }
+}
@@ -160,3 +160,34 @@ test "intersection: grazing hit (tangent)" {
     // Should be very close to z=5
     try testing.expectApproxEqAbs(@as(f32, 5.0), hit.t, 0.1);
 }
+
+test "intersection: batch returns the nearest sphere" {
+    // Scenario: 6 spheres with radius 1 on the z axis, spread over two batches. Element 6 is
+    // padding behind the end of the range and must be ignored although it is the closest.
+    var center_x = [_]f32{0} ** 8;
+    var center_y = [_]f32{0} ** 8;
+    var center_z = [_]f32{ 20, 15, 30, 8, 12, 9, 2, 0 };
+    var radius = [_]f32{1} ** 8;
+    var spheres = std.mem.zeroes(c.SphereArrays);
+    spheres.center_x = &center_x;
+    spheres.center_y = &center_y;
+    spheres.center_z = &center_z;
+    spheres.radius = &radius;
+    spheres.count = 6;
+
+    const r = c.Ray{
+        .origin = .{ .x = 0, .y = 0, .z = 0 },
+        .dir = .{ .x = 0, .y = 0, .z = 1 },
+    };
+
+    var hit = std.mem.zeroes(c.HitCandidate);
+    hit.t = std.math.inf(f32);
+    try testing.expect(c.hit_test_spheres(&r, &spheres, 0, 6, &hit));
+    try testing.expectEqual(@as(c_int, 3), hit.index);
+    try testing.expectApproxEqAbs(@as(f32, 7.0), hit.t, epsilon);
+
+    // Candidates are only accepted if they are closer than the current closest hit
+    try testing.expect(!c.hit_test_spheres(&r, &spheres, 0, 6, &hit));
+    hit.t = 5.0;
+    try testing.expect(!c.hit_test_spheres(&r, &spheres, 0, 6, &hit));
+}
@@ -19,7 +19,7 @@ fn createTriangle(x0: f32, y0: f32, z0: f32, x1: f32, y1: f32, z1: f32, x2: f32,
         .one_sided = true,
     };
 
-    // Call your new C function to compute edge1 and edge2
+    // Call your new C function to compute the normal
     c.precompute_triangle(&tri);
 
     return tri;
@@ -206,3 +206,28 @@ test "triangle: back hit (one sided)" {
 
     try testing.expect(did_hit == false);
 }
+
+test "triangle: watertight at shared edges" {
+    // Two triangles of a skewed quad share the edge v0 -> v1. Every ray aimed at a point on that
+    // edge must hit at least one of them, a miss of both would let light leak through the quad.
+    const a = createTriangle(-1.3, 0.2, 4.1, 0.7, 1.9, 5.3, 1.1, -0.9, 4.7);
+    const b = createTriangle(-1.3, 0.2, 4.1, -0.4, 2.3, 4.9, 0.7, 1.9, 5.3);
+
+    var prng = std.Random.DefaultPrng.init(3);
+    const random = prng.random();
+    for (0..10000) |_| {
+        const s = random.float(f32);
+        const target = c.vec_add(a.v0, c.vec_scale(c.vec_sub(a.v1, a.v0), s));
+        const origin = c.Vec{
+            .x = random.float(f32) * 4.0 - 2.0,
+            .y = random.float(f32) * 4.0 - 2.0,
+            .z = random.float(f32) * 2.0 - 1.0,
+        };
+        const r = c.Ray{ .origin = origin, .dir = c.vec_normalize(c.vec_sub(target, origin)) };
+
+        var hit: c.HitInfo = undefined;
+        const hit_a = c.intersect_triangle(&r, &a, &hit);
+        const hit_b = c.intersect_triangle(&r, &b, &hit);
+        try testing.expect(hit_a or hit_b);
+    }
+}
@@ -0,0 +1,123 @@
+const std = @import("std");
+const testing = std.testing;
+
+// Import the C implementation to access the internal sampler functions
+const c = @cImport({
+    @cInclude("../src/tracy.c");
+});
+
+fn sobolSampler(seed: u32, index: u32, dimension: u32) c.Sampler {
+    return c.Sampler{
+        .type = c.SAMPLER_SOBOL,
+        .rng = null,
+        .seed = seed,
+        .reversed_index = c.reverse_bits(index),
+        .dimension = dimension,
+        .blue_noise = null,
+        .x = 0,
+        .y = 0,
+    };
+}
+
+test "sampler: second Sobol dimension matches its direction numbers" {
+    // Reference: XOR of the direction numbers v_i = v_{i-1} ^ (v_{i-1} >> 1) of the set bits
+    var prng = std.Random.DefaultPrng.init(7);
+    const random = prng.random();
+    for (0..1000) |_| {
+        const index = random.int(u32);
+        var expected: u32 = 0;
+        var v: u32 = 1 << 31;
+        var bits = index;
+        while (bits != 0) : ({
+            bits >>= 1;
+            v ^= v >> 1;
+        }) {
+            if (bits & 1 != 0) expected ^= v;
+        }
+        try testing.expectEqual(c.reverse_bits(expected), c.sobol_second_dimension_reversed(index));
+    }
+}
+
+test "sampler: every 16 samples of a pair of dimensions are stratified in all elementary intervals" {
+    // An Owen-scrambled (0, 2)-sequence has one point in each of the 16 intervals of size
+    // 1/16 x 1, 1/8 x 1/2, 1/4 x 1/4, 1/2 x 1/8 and 1 x 1/16 for every aligned block of 16 samples
+    for (0..20) |pixel| {
+        const seed = c.hash_uint32(@intCast(pixel));
+        for (0..8) |dimension| {
+            for (0..4) |block| {
+                var xs: [16]f32 = undefined;
+                var ys: [16]f32 = undefined;
+                for (0..16) |i| {
+                    var sampler = sobolSampler(seed, @intCast(block * 16 + i), @intCast(dimension));
+                    c.sampler_2d(&sampler, &xs[i], &ys[i]);
+                }
+                for (0..5) |k| {
+                    const nx: usize = @as(usize, 1) << @intCast(k);
+                    const ny: usize = 16 / nx;
+                    var counts = [_]u32{0} ** 16;
+                    for (0..16) |i| {
+                        const cx: usize = @intFromFloat(xs[i] * @as(f32, @floatFromInt(nx)));
+                        const cy: usize = @intFromFloat(ys[i] * @as(f32, @floatFromInt(ny)));
+                        counts[cx * ny + cy] += 1;
+                    }
+                    for (counts) |count| try testing.expectEqual(@as(u32, 1), count);
+                }
+            }
+        }
+    }
+}
+
+test "sampler: every 16 samples of a single dimension fall into distinct sixteenths" {
+    for (0..20) |pixel| {
+        const seed = c.hash_uint32(@intCast(pixel));
+        for (0..8) |dimension| {
+            var counts = [_]u32{0} ** 16;
+            for (0..16) |i| {
+                var sampler = sobolSampler(seed, @intCast(16 + i), @intCast(dimension));
+                const u = c.sampler_1d(&sampler);
+                try testing.expect(u >= 0.0 and u < 1.0);
+                const bucket: usize = @intFromFloat(u * 16.0);
+                counts[bucket] += 1;
+            }
+            for (counts) |count| try testing.expectEqual(@as(u32, 1), count);
+        }
+    }
+}
+
+test "sampler: dimensions of the same sample are not the same sequence" {
+    // Without the per dimension shuffle of the index, all dimensions would return equal values
+    const seed = c.hash_uint32(3);
+    var equal: u32 = 0;
+    for (0..64) |i| {
+        var sampler = sobolSampler(seed, @intCast(i), 0);
+        const first = c.sampler_1d(&sampler);
+        const second = c.sampler_1d(&sampler);
+        if (@abs(first - second) < 1.0 / 16.0) equal += 1;
+    }
+    try testing.expect(equal < 16);
+}
+
+test "sampler: the blue noise mask ranks every pixel once and spreads the low ranks" {
+    const mask = c.generate_blue_noise();
+    defer c.free(mask);
+    const size = c.BLUE_NOISE_SIZE;
+    var seen = [_]bool{false} ** (size * size);
+    for (0..size * size) |i| {
+        const rank: usize = @intCast((@as(u64, mask[i]) * size * size) >> 32);
+        try testing.expect(!seen[rank]);
+        seen[rank] = true;
+    }
+    // every 8x8 block of the tiled mask has a pixel among the lowest sixteenth of the ranks
+    for (0..size / 8) |block_y| {
+        for (0..size / 8) |block_x| {
+            var found = false;
+            for (0..8) |y| {
+                for (0..8) |x| {
+                    const i = (block_y * 8 + y) * size + block_x * 8 + x;
+                    if (mask[i] < (1 << 28)) found = true;
+                }
+            }
+            try testing.expect(found);
+        }
+    }
+}
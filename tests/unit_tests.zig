@@ -13,6 +13,10 @@ export var scene_cornell: [0]c.Primitive = undefined;
 export var scene_caustics: [0]c.Primitive = undefined;
 export var scene_glass_sphere: [0]c.Primitive = undefined;
 export var scene_cyberpunk: [0]c.Primitive = undefined;
+export var scene_rock_field: [0]c.Primitive = undefined;
+export var scene_many_lights: [0]c.Primitive = undefined;
+export var mesh_rock: [0]c.Primitive = undefined;
+export var mesh_ball: [0]c.Primitive = undefined;
 
 comptime {
     _ = @import("unit/vec_test.zig");
@@ -20,4 +24,7 @@ comptime {
     _ = @import("unit/intersect_triangle_test.zig");
     _ = @import("unit/refract_test.zig");
     _ = @import("unit/fresnel_test.zig");
+    _ = @import("unit/bvh_test.zig");
+    _ = @import("unit/sampler_test.zig");
+    _ = @import("unit/adaptive_test.zig");
 }